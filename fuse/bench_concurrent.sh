@@ -0,0 +1,48 @@
+#!/bin/bash
+# Read/write throughput through the mount as the number of concurrent
+# writers grows from 1 to N. Files are written as .bin so they are not
+# queued for TEE processing.
+
+if [ "$#" -lt 1 ]; then
+	echo "Usage: $0 <mountpoint> [max writers (default: nproc)] [MiB per writer (default: 256)]"
+	exit 1
+fi
+
+MNT=$1
+MAX=${2:-$(nproc)}
+SIZE=${3:-256}
+DIR="${MNT}/bench_concurrent.$$"
+
+mkdir -p "$DIR" || exit 1
+
+# Milliseconds since the epoch
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+printf "%8s %14s %14s\n" "writers" "write MiB/s" "read MiB/s"
+
+for n in $(seq 1 "$MAX"); do
+	START=$(now_ms)
+	for i in $(seq 1 "$n"); do
+		dd if=/dev/zero of="${DIR}/w${i}.bin" bs=1M count="$SIZE" conv=fsync status=none &
+	done
+	wait
+	WRITE_MS=$(($(now_ms) - START))
+
+	# Re-read through the mount. The backing files are still in the page
+	# cache, so this mostly measures the FUSE request path, not the disk
+	START=$(now_ms)
+	for i in $(seq 1 "$n"); do
+		dd if="${DIR}/w${i}.bin" of=/dev/null bs=1M status=none &
+	done
+	wait
+	READ_MS=$(($(now_ms) - START))
+
+	TOTAL=$((n * SIZE))
+	printf "%8d %14d %14d\n" "$n" $((TOTAL * 1000 / (WRITE_MS + 1))) $((TOTAL * 1000 / (READ_MS + 1)))
+
+	rm -f "${DIR}"/w*.bin
+done
+
+rmdir "$DIR"
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Sequential and random read throughput through the mount, one reader per
+# job. Run it against the same mount before and after a change to the
+# read path. Needs fio.
+
+if [ "$#" -lt 1 ]; then
+	echo "Usage: $0 <mountpoint> [MiB per job (default: 512)] [jobs (default: 1)]"
+	exit 1
+fi
+
+if ! command -v fio > /dev/null; then
+	echo "fio is required"
+	exit 1
+fi
+
+MNT=$1
+SIZE=${2:-512}
+JOBS=${3:-1}
+DIR="${MNT}/bench_read.$$"
+
+mkdir -p "$DIR" || exit 1
+
+# Lay out the files once, so every pass reads the same data
+fio --name=layout --directory="$DIR" --rw=write --bs=1M --size="${SIZE}M" \
+	--numjobs="$JOBS" --end_fsync=1 > /dev/null || exit 1
+
+printf "%-12s %8s %14s %10s\n" "pattern" "bs" "MiB/s" "IOPS"
+
+for rw in read randread; do
+	for bs in 4k 128k 1M; do
+		# fio's terse v3 output: field 7 is read KiB/s, field 8 read IOPS
+		OUT=$(fio --name=layout --directory="$DIR" --rw="$rw" --bs="$bs" \
+			--size="${SIZE}M" --numjobs="$JOBS" --time_based --runtime=10 \
+			--group_reporting --output-format=terse --terse-version=3)
+		KIBS=$(echo "$OUT" | cut -d';' -f7)
+		IOPS=$(echo "$OUT" | cut -d';' -f8)
+		printf "%-12s %8s %14d %10d\n" "$rw" "$bs" $((KIBS / 1024)) "$IOPS"
+	done
+done
+
+rm -rf "$DIR"
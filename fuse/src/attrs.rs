@@ -0,0 +1,245 @@
+// Attrs :: Userspace cache of the attributes of backing files, including missing ones.
+//
+// getattr is the most frequent request: the kernel asks again for every path whose attributes
+// are older than their TTL, so a scan over a large frame folder turns into one lstat per file per
+// TTL. Attributes are kept here for the same TTL the kernel is given, and the absence of a path
+// (ENOENT) for a separate, usually shorter, negative TTL; fuse_mt has no way to hand the kernel a
+// negative entry, so repeated lookups of missing paths are only answered from here.
+//
+// Changes made through this mount drop the affected entries, so only changes made to the target
+// directory behind its back can be seen late, by at most the TTL, as with the kernel's own cache.
+// Entries live in shards, each behind its own lock. A shard counts its invalidations, and an
+// lstat that raced with one is not cached, so a stale result cannot overwrite a fresh drop.
+//
+
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::hash::{Hash, Hasher};
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+use fuse_mt::FileAttr;
+
+use crate::libc_extras::libc;
+
+/// Default TTL of attributes, for the kernel and for this cache.
+pub const DEFAULT_TTL: Duration = Duration::from_secs(1);
+
+/// Default TTL of cached ENOENT results.
+pub const DEFAULT_NEGATIVE_TTL: Duration = Duration::from_millis(500);
+
+/// Shards of the cache. A path always hashes to the same one, so only lookups that land on the
+/// same shard wait for each other.
+const SHARDS: usize = 64;
+
+/// Entries per shard before expired ones are swept out.
+const SHARD_CAPACITY: usize = 4096;
+
+struct Entry {
+    /// The attributes, or None for a path that does not exist.
+    attr: Option<FileAttr>,
+    expires: Instant,
+}
+
+#[derive(Default)]
+struct Shard {
+    entries: HashMap<PathBuf, Entry>,
+    /// Bumped by every invalidation in this shard.
+    generation: u64,
+}
+
+/// Token of a lookup that missed, to cache its result with.
+pub struct Miss {
+    shard: usize,
+    generation: u64,
+}
+
+pub struct AttrCache {
+    ttl: Duration,
+    negative_ttl: Duration,
+    shards: Vec<Mutex<Shard>>,
+}
+
+fn shard_of(path: &Path) -> usize {
+    let mut hasher = DefaultHasher::new();
+    path.hash(&mut hasher);
+    hasher.finish() as usize % SHARDS
+}
+
+impl AttrCache {
+    /// A TTL of zero disables caching of that kind.
+    pub fn new(ttl: Duration, negative_ttl: Duration) -> AttrCache {
+        AttrCache {
+            ttl,
+            negative_ttl,
+            shards: (0..SHARDS).map(|_| Mutex::new(Shard::default())).collect(),
+        }
+    }
+
+    /// TTL to hand the kernel with attributes and entries.
+    pub fn ttl(&self) -> Duration {
+        self.ttl
+    }
+
+    /// Cached result of lstat on `path`, or a token to cache the result with once it is known.
+    pub fn get(&self, path: &Path) -> Result<Result<FileAttr, libc::c_int>, Miss> {
+        let index = shard_of(path);
+        let shard = self.shards[index].lock().unwrap();
+        match shard.entries.get(path) {
+            Some(entry) if entry.expires > Instant::now() => Ok(entry.attr.ok_or(libc::ENOENT)),
+            _ => Err(Miss {
+                shard: index,
+                generation: shard.generation,
+            }),
+        }
+    }
+
+    /// Cache the result of an lstat that missed, unless `path` was invalidated meanwhile. Only
+    /// ENOENT is cached of the errors.
+    pub fn put(&self, path: &Path, miss: Miss, result: &Result<FileAttr, libc::c_int>) {
+        let (attr, ttl) = match result {
+            Ok(attr) => (Some(*attr), self.ttl),
+            Err(libc::ENOENT) => (None, self.negative_ttl),
+            Err(_) => return,
+        };
+        if ttl == Duration::ZERO {
+            return;
+        }
+
+        let mut shard = self.shards[miss.shard].lock().unwrap();
+        if shard.generation != miss.generation {
+            return;
+        }
+
+        let now = Instant::now();
+        if shard.entries.len() >= SHARD_CAPACITY {
+            shard.entries.retain(|_, entry| entry.expires > now);
+            if shard.entries.len() >= SHARD_CAPACITY {
+                shard.entries.clear();
+            }
+        }
+        shard.entries.insert(
+            path.to_owned(),
+            Entry {
+                attr,
+                expires: now + ttl,
+            },
+        );
+    }
+
+    /// Drop `path` after it was changed, created or removed through the mount.
+    pub fn invalidate(&self, path: &Path) {
+        let mut shard = self.shards[shard_of(path)].lock().unwrap();
+        shard.generation += 1;
+        shard.entries.remove(path);
+    }
+
+    /// Drop `path` and everything below it, after a directory was renamed.
+    pub fn invalidate_tree(&self, path: &Path) {
+        for shard in &self.shards {
+            let mut shard = shard.lock().unwrap();
+            shard.generation += 1;
+            shard.entries.retain(|p, _| !p.starts_with(path));
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use fuse_mt::FileType;
+    use std::time::SystemTime;
+
+    fn attr(size: u64) -> FileAttr {
+        FileAttr {
+            size,
+            blocks: 0,
+            atime: SystemTime::UNIX_EPOCH,
+            mtime: SystemTime::UNIX_EPOCH,
+            ctime: SystemTime::UNIX_EPOCH,
+            crtime: SystemTime::UNIX_EPOCH,
+            kind: FileType::RegularFile,
+            perm: 0o644,
+            nlink: 1,
+            uid: 0,
+            gid: 0,
+            rdev: 0,
+            flags: 0,
+        }
+    }
+
+    fn cached(cache: &AttrCache, path: &Path) -> Option<Result<u64, libc::c_int>> {
+        cache
+            .get(path)
+            .ok()
+            .map(|result| result.map(|attr| attr.size))
+    }
+
+    #[test]
+    fn hit_after_put() {
+        let cache = AttrCache::new(Duration::from_secs(60), Duration::from_secs(60));
+        let path = Path::new("/a.bmp");
+
+        let miss = cache.get(path).err().unwrap();
+        cache.put(path, miss, &Ok(attr(42)));
+        assert_eq!(cached(&cache, path), Some(Ok(42)));
+
+        cache.invalidate(path);
+        assert_eq!(cached(&cache, path), None);
+    }
+
+    #[test]
+    fn lstat_racing_an_invalidation_is_not_cached() {
+        let cache = AttrCache::new(Duration::from_secs(60), Duration::from_secs(60));
+        let path = Path::new("/a.bmp");
+
+        // The file changes through the mount while its old attributes are being read
+        let miss = cache.get(path).err().unwrap();
+        cache.invalidate(path);
+        cache.put(path, miss, &Ok(attr(1)));
+        assert_eq!(cached(&cache, path), None);
+
+        let miss = cache.get(path).err().unwrap();
+        cache.invalidate_tree(Path::new("/"));
+        cache.put(path, miss, &Err(libc::ENOENT));
+        assert_eq!(cached(&cache, path), None);
+
+        // A lookup that starts after the invalidation is cached again
+        let miss = cache.get(path).err().unwrap();
+        cache.put(path, miss, &Ok(attr(2)));
+        assert_eq!(cached(&cache, path), Some(Ok(2)));
+    }
+
+    #[test]
+    fn negative_entries_use_their_own_ttl() {
+        let cache = AttrCache::new(Duration::from_secs(60), Duration::from_millis(20));
+        let missing = Path::new("/missing.bmp");
+        let present = Path::new("/present.bmp");
+
+        let miss = cache.get(missing).err().unwrap();
+        cache.put(missing, miss, &Err(libc::ENOENT));
+        let miss = cache.get(present).err().unwrap();
+        cache.put(present, miss, &Ok(attr(7)));
+        assert_eq!(cached(&cache, missing), Some(Err(libc::ENOENT)));
+
+        std::thread::sleep(Duration::from_millis(40));
+        assert_eq!(cached(&cache, missing), None);
+        assert_eq!(cached(&cache, present), Some(Ok(7)));
+    }
+
+    #[test]
+    fn only_enoent_is_cached_and_zero_ttl_disables() {
+        let cache = AttrCache::new(Duration::from_secs(60), Duration::ZERO);
+        let path = Path::new("/a.bmp");
+
+        let miss = cache.get(path).err().unwrap();
+        cache.put(path, miss, &Err(libc::ENOENT));
+        assert_eq!(cached(&cache, path), None);
+
+        let cache = AttrCache::new(Duration::from_secs(60), Duration::from_secs(60));
+        let miss = cache.get(path).err().unwrap();
+        cache.put(path, miss, &Err(libc::EACCES));
+        assert_eq!(cached(&cache, path), None);
+    }
+}
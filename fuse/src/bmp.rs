@@ -0,0 +1,121 @@
+// Bmp :: The bits of the BMP format the mount needs: where the pixel rows of a source image are,
+// and how a processed image is written back out.
+//
+// Mirrors videoTEE/lib/bmp (bmp_layout_parse() and bmp_write_fd()).
+//
+
+/// File header + BITMAPINFOHEADER.
+pub const HEADER_SIZE: usize = 54;
+
+/// 256-entry gray palette of 8-bit images.
+const PALETTE_SIZE: usize = 256 * 4;
+
+/// Largest width or height accepted, as in bmp_map.c.
+const MAX_DIM: i64 = 1 << 16;
+
+/// Where the pixel rows of an uncompressed 24-bit BMP are.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Layout {
+    pub width: u32,
+    pub height: u32,
+    pub off_bits: u64,
+    /// Bytes per stored row, padding included.
+    pub row: u64,
+}
+
+impl Layout {
+    pub fn parse(hdr: &[u8]) -> Option<Layout> {
+        if hdr.len() < HEADER_SIZE {
+            return None;
+        }
+        let le16 = |i: usize| u16::from_le_bytes(hdr[i..i + 2].try_into().unwrap());
+        let le32 = |i: usize| u32::from_le_bytes(hdr[i..i + 4].try_into().unwrap());
+
+        let width = i64::from(le32(18) as i32);
+        let height = i64::from(le32(22) as i32);
+        if &hdr[0..2] != b"BM"
+            || le32(14) < 40
+            || le16(26) != 1
+            || le16(28) != 24
+            || le32(30) != 0
+            || width <= 0
+            || width > MAX_DIM
+            || height == 0
+            || height.abs() > MAX_DIM
+            || (le32(10) as usize) < HEADER_SIZE
+        {
+            return None;
+        }
+
+        Some(Layout {
+            width: width as u32,
+            height: height.unsigned_abs() as u32,
+            off_bits: u64::from(le32(10)),
+            // Rows are padded to 4 bytes
+            row: (3 * width as u64 + 3) & !3,
+        })
+    }
+
+    /// Rows wholly contained in the first `written` bytes of the file.
+    pub fn rows_in(&self, written: u64) -> u32 {
+        let rows = written.saturating_sub(self.off_bits) / self.row;
+        rows.min(u64::from(self.height)) as u32
+    }
+
+    pub fn pixels(&self) -> usize {
+        self.width as usize * self.height as usize
+    }
+}
+
+/// Size of the file `encode` writes for a `width` x `height` image with `bpp` bytes per pixel.
+pub fn encoded_size(width: u32, height: u32, bpp: usize) -> usize {
+    let stride = (bpp * width as usize + 3) & !3;
+    off_bits(bpp) + stride * height as usize
+}
+
+fn off_bits(bpp: usize) -> usize {
+    HEADER_SIZE + if bpp == 1 { PALETTE_SIZE } else { 0 }
+}
+
+/// Write packed, top-down pixels (gray, or red-first RGB) as a bottom-up BMP file.
+pub fn encode(width: u32, height: u32, bpp: usize, pixels: &[u8]) -> Vec<u8> {
+    let row = bpp * width as usize;
+    let stride = (row + 3) & !3;
+    let off_bits = off_bits(bpp);
+    let size = encoded_size(width, height, bpp);
+    let mut out = vec![0u8; size];
+
+    let mut put32 = |i: usize, v: u32| out[i..i + 4].copy_from_slice(&v.to_le_bytes());
+    put32(2, size as u32);
+    put32(10, off_bits as u32);
+    put32(14, 40);
+    put32(18, width);
+    put32(22, height);
+    put32(34, (stride * height as usize) as u32);
+    if bpp == 1 {
+        put32(46, 256);
+    }
+    out[0..2].copy_from_slice(b"BM");
+    out[26..28].copy_from_slice(&1u16.to_le_bytes());
+    out[28..30].copy_from_slice(&(8 * bpp as u16).to_le_bytes());
+
+    if bpp == 1 {
+        // Gray ramp palette, entries are B,G,R,reserved
+        for (i, entry) in out[HEADER_SIZE..off_bits].chunks_exact_mut(4).enumerate() {
+            entry[..3].fill(i as u8);
+        }
+    }
+
+    let rows = out[off_bits..].chunks_exact_mut(stride);
+    for (line, dst) in pixels.chunks_exact(row).rev().zip(rows) {
+        if bpp == 1 {
+            dst[..row].copy_from_slice(line);
+        } else {
+            for (src, dst) in line.chunks_exact(3).zip(dst.chunks_exact_mut(3)) {
+                dst.copy_from_slice(&[src[2], src[1], src[0]]);
+            }
+        }
+    }
+
+    out
+}
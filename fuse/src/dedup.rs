@@ -0,0 +1,307 @@
+// Dedup :: Results of earlier jobs keyed by the SHA-256 of the image, reused for copies.
+//
+// Camera streams repeat frames (static scenes) and copy tools write the same image many times.
+// If content identical to a queued image was processed before, its job gets that result instead
+// of going to the TEE: the TA would compute the same digest, store the same secure-storage object
+// and sign the same digest again. The processed image is not kept here, only the attestation;
+// the `/.processed` view reloads the image by digest.
+//
+// The hash is computed write by write as the image comes in, so looking it up costs no second
+// read of the file. Only a handle that writes its file strictly sequentially from offset 0, with
+// no other handle writing the same path, gets one; other images are hashed by reading them back
+// before they are processed. Streamed images are never looked up, since the daemon has already
+// done most of the TA's work on them, but their results are remembered.
+//
+
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{self, Read};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+use sha2::{Digest, Sha256};
+
+use crate::lru::Lru;
+use crate::processing::JobResult;
+
+/// Default number of results kept once enabled with `--dedup`.
+pub const DEFAULT_ENTRIES: usize = 65536;
+
+pub type ContentHash = [u8; 32];
+
+/// Hash the file at `path`.
+pub fn hash_file(path: &Path) -> io::Result<ContentHash> {
+    let mut file = File::open(path)?;
+    let mut hasher = Sha256::new();
+    let mut buf = vec![0u8; 64 * 1024];
+    loop {
+        let n = match file.read(&mut buf) {
+            Ok(0) => break,
+            Ok(n) => n,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e),
+        };
+        hasher.update(&buf[..n]);
+    }
+    Ok(hasher.finalize().into())
+}
+
+/// Hash of what one handle has written so far.
+struct Hashing {
+    fh: u64,
+    /// Tells this hash apart from a later one of the same path and handle.
+    id: u64,
+    /// Bytes hashed, or being hashed, all of them contiguous from offset 0.
+    written: u64,
+    /// None while a write is hashed outside the lock.
+    hasher: Option<Sha256>,
+}
+
+/// Hashes of the images being written, keyed by their path in the mount.
+pub struct WriteHashes {
+    open: Mutex<HashMap<PathBuf, Hashing>>,
+    next_id: AtomicU64,
+}
+
+impl WriteHashes {
+    pub fn new() -> WriteHashes {
+        WriteHashes {
+            open: Mutex::new(HashMap::new()),
+            next_id: AtomicU64::new(0),
+        }
+    }
+
+    /// Called after `data` was written at `offset` through `fh` to `path`.
+    pub fn wrote(&self, fh: u64, path: &Path, offset: u64, data: &[u8]) {
+        // Take the hasher out, or start a new one, reserving the bytes it is going to cover.
+        let (id, hasher) = {
+            let mut open = self.open.lock().unwrap();
+            match open.get_mut(path) {
+                Some(h) if h.fh == fh && h.written == offset && h.hasher.is_some() => {
+                    h.written += data.len() as u64;
+                    (h.id, h.hasher.take().unwrap())
+                }
+                Some(_) => {
+                    // A gap, a rewrite, another writer, or a write racing this one
+                    open.remove(path);
+                    return;
+                }
+                None if offset == 0 => {
+                    let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+                    let hashing = Hashing {
+                        fh,
+                        id,
+                        written: data.len() as u64,
+                        hasher: None,
+                    };
+                    open.insert(path.to_owned(), hashing);
+                    (id, Sha256::new())
+                }
+                None => return,
+            }
+        };
+
+        let mut hasher = hasher;
+        hasher.update(data);
+
+        let mut open = self.open.lock().unwrap();
+        if let Some(h) = open.get_mut(path) {
+            if h.id == id {
+                h.hasher = Some(hasher);
+            }
+        }
+    }
+
+    /// Hash of everything `fh` wrote to `path`, and its length, at release. Drops whatever else
+    /// `fh` left behind under a path it was renamed from.
+    pub fn take(&self, fh: u64, path: &Path) -> Option<(ContentHash, u64)> {
+        let mut open = self.open.lock().unwrap();
+        match open.remove(path) {
+            Some(Hashing {
+                fh: owner,
+                written,
+                hasher: Some(hasher),
+                ..
+            }) if owner == fh => Some((hasher.finalize().into(), written)),
+            Some(other) => {
+                open.insert(path.to_owned(), other);
+                open.retain(|_, h| h.fh != fh);
+                None
+            }
+            None => {
+                open.retain(|_, h| h.fh != fh);
+                None
+            }
+        }
+    }
+
+    /// Drop the hash of `path`, after it was truncated, renamed or removed.
+    pub fn forget(&self, path: &Path) {
+        self.open.lock().unwrap().remove(path);
+    }
+}
+
+struct Entry {
+    attestation: Vec<u8>,
+}
+
+/// Lookups so far, for the statistics.
+#[derive(Clone, Copy, Default, Debug)]
+pub struct DedupStats {
+    pub hits: u64,
+    pub misses: u64,
+}
+
+pub struct DedupCache {
+    capacity: usize,
+    lru: Mutex<Lru<ContentHash, Entry>>,
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+impl DedupCache {
+    pub fn new(capacity: usize) -> DedupCache {
+        DedupCache {
+            capacity: capacity.max(1),
+            lru: Mutex::new(Lru::default()),
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+        }
+    }
+
+    /// The result of earlier content `hash`, without pixels or TA time.
+    pub fn lookup(&self, hash: &ContentHash) -> Option<JobResult> {
+        let mut lru = self.lru.lock().unwrap();
+        let entry = match lru.touch(hash) {
+            Some(entry) => entry,
+            None => {
+                self.misses.fetch_add(1, Ordering::Relaxed);
+                return None;
+            }
+        };
+        self.hits.fetch_add(1, Ordering::Relaxed);
+
+        Some(JobResult {
+            took_ms: 0,
+            attestation: entry.attestation.clone(),
+            pixels: None,
+            dedup: true,
+        })
+    }
+
+    /// Remember the result of content `hash`, dropping the least recently used beyond capacity.
+    pub fn insert(&self, hash: ContentHash, result: &JobResult) {
+        let mut lru = self.lru.lock().unwrap();
+        lru.insert(
+            hash,
+            Entry {
+                attestation: result.attestation.clone(),
+            },
+        );
+        while lru.len() > self.capacity {
+            lru.pop_oldest();
+        }
+    }
+
+    pub fn stats(&self) -> DedupStats {
+        DedupStats {
+            hits: self.hits.load(Ordering::Relaxed),
+            misses: self.misses.load(Ordering::Relaxed),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn sha(data: &[u8]) -> ContentHash {
+        Sha256::digest(data).into()
+    }
+
+    #[test]
+    fn sequential_writes_hash_the_whole_file() {
+        let hashes = WriteHashes::new();
+        let path = Path::new("/a.bmp");
+        hashes.wrote(1, path, 0, b"hello ");
+        hashes.wrote(1, path, 6, b"world");
+        assert_eq!(hashes.take(1, path), Some((sha(b"hello world"), 11)));
+        assert_eq!(hashes.take(1, path), None);
+    }
+
+    #[test]
+    fn anything_but_one_sequential_writer_drops_the_hash() {
+        let hashes = WriteHashes::new();
+        let path = Path::new("/a.bmp");
+
+        // A rewrite
+        hashes.wrote(1, path, 0, b"hello");
+        hashes.wrote(1, path, 0, b"j");
+        assert_eq!(hashes.take(1, path), None);
+
+        // A gap
+        hashes.wrote(1, path, 0, b"hello");
+        hashes.wrote(1, path, 10, b"world");
+        assert_eq!(hashes.take(1, path), None);
+
+        // Another handle writing the same path
+        hashes.wrote(1, path, 0, b"hello");
+        hashes.wrote(2, path, 5, b"world");
+        assert_eq!(hashes.take(1, path), None);
+
+        // A truncate or rename
+        hashes.wrote(1, path, 0, b"hello");
+        hashes.forget(path);
+        hashes.wrote(1, path, 5, b"world");
+        assert_eq!(hashes.take(1, path), None);
+    }
+
+    #[test]
+    fn hits_replay_the_attestation_but_not_the_ta_time() {
+        let cache = DedupCache::new(1);
+        let result = JobResult {
+            took_ms: 40,
+            attestation: vec![1, 2, 3],
+            pixels: Some(vec![0; 4]),
+            dedup: false,
+        };
+        cache.insert(sha(b"a"), &result);
+
+        let hit = cache.lookup(&sha(b"a")).unwrap();
+        assert_eq!((hit.took_ms, hit.dedup), (0, true));
+        assert_eq!(hit.attestation, result.attestation);
+        assert!(hit.pixels.is_none());
+
+        // Capacity 1 evicts the older entry
+        cache.insert(sha(b"b"), &result);
+        assert!(cache.lookup(&sha(b"a")).is_none());
+        let stats = cache.stats();
+        assert_eq!((stats.hits, stats.misses), (1, 1));
+    }
+
+    #[test]
+    fn release_under_a_new_name_drops_the_old_one() {
+        let hashes = WriteHashes::new();
+        hashes.wrote(1, Path::new("/old.bmp"), 0, b"hello");
+        assert_eq!(hashes.take(1, Path::new("/new.bmp")), None);
+        assert!(hashes.open.lock().unwrap().is_empty());
+    }
+
+    #[test]
+    fn hash_matches_a_read_back() {
+        let path = std::env::temp_dir().join(format!("dedup_test_{}", std::process::id()));
+        let data: Vec<u8> = (0..200_000u32).map(|i| (i * 7) as u8).collect();
+        std::fs::write(&path, &data).unwrap();
+
+        let hashes = WriteHashes::new();
+        for (i, chunk) in data.chunks(4096).enumerate() {
+            hashes.wrote(3, &path, (i * 4096) as u64, chunk);
+        }
+        let (hash, len) = hashes.take(3, &path).unwrap();
+        assert_eq!(len, data.len() as u64);
+        assert_eq!(hash, hash_file(&path).unwrap());
+
+        std::fs::remove_file(&path).unwrap();
+    }
+}
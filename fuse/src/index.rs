@@ -0,0 +1,178 @@
+// Index :: Persistent index of the files that have already been processed.
+//
+// Files are keyed by (inode, size, mtime) rather than by path, so a rewritten frame is processed
+// again while a renamed one is not. The set is split into shards, each behind its own lock, so
+// concurrent releases rarely contend. A key is claimed in memory when its job is queued and
+// appended to a journal in the target directory once the job succeeds; the journal is replayed at
+// mount so the "already processed" decision survives restarts.
+//
+
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashSet;
+use std::fs::{File, OpenOptions};
+use std::hash::{Hash, Hasher};
+use std::io::{self, Read, Write};
+use std::os::unix::fs::MetadataExt;
+use std::path::Path;
+use std::sync::Mutex;
+
+use crate::libc_extras::libc;
+
+/// Name of the journal in the target directory. Hidden from directory listings.
+pub const JOURNAL_NAME: &str = ".processed_index";
+
+/// Shards of the set, so releases of different files rarely wait for the same lock.
+const SHARDS: usize = 64;
+
+/// Size of one journal record: inode, size and mtime as little-endian 64-bit integers.
+const RECORD_SIZE: usize = 24;
+
+/// Identity of one version of a file.
+#[derive(Clone, Copy, Debug, Hash, PartialEq, Eq)]
+pub struct FileKey {
+    pub ino: u64,
+    pub size: u64,
+    pub mtime_ns: i64,
+}
+
+impl FileKey {
+    pub fn from_stat(stat: &libc::stat64) -> FileKey {
+        FileKey {
+            ino: stat.st_ino as u64,
+            size: stat.st_size as u64,
+            mtime_ns: stat.st_mtime * 1_000_000_000 + stat.st_mtime_nsec,
+        }
+    }
+
+    /// Key of the file at `path` as it is now.
+    pub fn of(path: &Path) -> Option<FileKey> {
+        let meta = std::fs::metadata(path).ok()?;
+        Some(FileKey {
+            ino: meta.ino(),
+            size: meta.size(),
+            mtime_ns: meta.mtime() * 1_000_000_000 + meta.mtime_nsec(),
+        })
+    }
+
+    fn to_record(self) -> [u8; RECORD_SIZE] {
+        let mut record = [0u8; RECORD_SIZE];
+        record[0..8].copy_from_slice(&self.ino.to_le_bytes());
+        record[8..16].copy_from_slice(&self.size.to_le_bytes());
+        record[16..24].copy_from_slice(&self.mtime_ns.to_le_bytes());
+        record
+    }
+
+    fn from_record(record: &[u8]) -> FileKey {
+        let field = |i: usize| record[8 * i..8 * i + 8].try_into().unwrap();
+        FileKey {
+            ino: u64::from_le_bytes(field(0)),
+            size: u64::from_le_bytes(field(1)),
+            mtime_ns: i64::from_le_bytes(field(2)),
+        }
+    }
+
+    fn shard(&self) -> usize {
+        let mut hasher = DefaultHasher::new();
+        self.hash(&mut hasher);
+        hasher.finish() as usize % SHARDS
+    }
+}
+
+pub struct ProcessedIndex {
+    shards: Vec<Mutex<HashSet<FileKey>>>,
+    journal: File,
+}
+
+impl ProcessedIndex {
+    /// Open (or create) the journal in `target` and load the keys recorded in it.
+    pub fn open(target: &Path) -> io::Result<ProcessedIndex> {
+        let mut journal = OpenOptions::new()
+            .read(true)
+            .append(true)
+            .create(true)
+            .open(target.join(JOURNAL_NAME))?;
+
+        let mut data = vec![];
+        journal.read_to_end(&mut data)?;
+
+        // A crash mid-append can leave a torn record at the end; drop it so later appends stay
+        // aligned.
+        let whole = data.len() - data.len() % RECORD_SIZE;
+        if whole != data.len() {
+            warn!("index: dropping {} bytes of a torn journal record", data.len() - whole);
+            journal.set_len(whole as u64)?;
+        }
+
+        let shards: Vec<_> = (0..SHARDS).map(|_| Mutex::new(HashSet::new())).collect();
+        for record in data[..whole].chunks_exact(RECORD_SIZE) {
+            let key = FileKey::from_record(record);
+            shards[key.shard()].lock().unwrap().insert(key);
+        }
+        info!("index: loaded {} processed files", whole / RECORD_SIZE);
+
+        Ok(ProcessedIndex { shards, journal })
+    }
+
+    /// Claim `key` for processing. Returns false if it is already processed or queued; the check
+    /// and the insert happen under the shard lock, so two threads releasing the same file cannot
+    /// both queue it.
+    pub fn claim(&self, key: FileKey) -> bool {
+        self.shards[key.shard()].lock().unwrap().insert(key)
+    }
+
+    /// Give up a claim whose job was rejected or failed, so the next release queues it again.
+    pub fn forget(&self, key: FileKey) {
+        self.shards[key.shard()].lock().unwrap().remove(&key);
+    }
+
+    /// Record a claimed key as processed in the journal.
+    pub fn commit(&self, key: FileKey) {
+        // One O_APPEND write per record, so concurrent appends do not interleave. A failure only
+        // costs reprocessing the file after a restart.
+        if let Err(e) = (&self.journal).write_all(&key.to_record()) {
+            error!("index: failed to append to journal: {}", e);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn key(n: u64) -> FileKey {
+        FileKey {
+            ino: n,
+            size: 1000 + n,
+            mtime_ns: -(n as i64),
+        }
+    }
+
+    #[test]
+    fn torn_trailing_record_is_dropped() {
+        let dir = std::env::temp_dir().join(format!("index_test_{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let journal = dir.join(JOURNAL_NAME);
+
+        let mut data = vec![];
+        data.extend_from_slice(&key(1).to_record());
+        data.extend_from_slice(&key(2).to_record());
+        data.extend_from_slice(&key(3).to_record()[..RECORD_SIZE / 2]);
+        std::fs::write(&journal, &data).unwrap();
+
+        let index = ProcessedIndex::open(&dir).unwrap();
+        assert_eq!(std::fs::metadata(&journal).unwrap().len(), 2 * RECORD_SIZE as u64);
+        assert!(!index.claim(key(1)));
+        assert!(!index.claim(key(2)));
+        assert!(index.claim(key(3)));
+
+        // The next append lands on a record boundary and survives a reopen
+        index.commit(key(3));
+        drop(index);
+        let index = ProcessedIndex::open(&dir).unwrap();
+        assert_eq!(std::fs::metadata(&journal).unwrap().len(), 3 * RECORD_SIZE as u64);
+        assert!(!index.claim(key(3)));
+        assert!(index.claim(key(4)));
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -3,7 +3,7 @@
 // Copyright (c) 2016-2019 by William R. Fraser
 //
 
-use std::ffi::{CString, OsString};
+use std::ffi::{CStr, CString, OsString};
 use std::io;
 use std::mem;
 use std::ptr;
@@ -23,37 +23,74 @@ macro_rules! into_cstring {
     }
 }
 
+/// Open a directory for listing with `getdents`. The handle is a plain descriptor, so fsync and
+/// the *at calls work on it too.
 pub fn opendir(path: OsString) -> Result<u64, libc::c_int> {
     let path_c = into_cstring!(path, "opendir");
 
-    let dir: *mut libc::DIR = unsafe { libc::opendir(path_c.as_ptr()) };
-    if dir.is_null() {
+    let fd = unsafe {
+        libc::open(path_c.as_ptr(), libc::O_RDONLY | libc::O_DIRECTORY | libc::O_CLOEXEC)
+    };
+    if fd == -1 {
         return Err(io::Error::last_os_error().raw_os_error().unwrap());
     }
 
-    Ok(dir as u64)
+    Ok(fd as u64)
 }
 
-pub fn readdir(fh: u64) -> Result<Option<libc::dirent>, libc::c_int> {
-    let dir = fh as usize as *mut libc::DIR;
-    let mut entry: libc::dirent = unsafe { mem::zeroed() };
-    let mut result: *mut libc::dirent = ptr::null_mut();
+/// Go back to the first entry of a directory opened with `opendir`.
+pub fn rewinddir(fh: u64) -> Result<(), libc::c_int> {
+    if -1 == unsafe { libc::lseek(fh as libc::c_int, 0, libc::SEEK_SET) } {
+        return Err(io::Error::last_os_error().raw_os_error().unwrap());
+    }
+    Ok(())
+}
 
-    let error: i32 = unsafe { libc::readdir_r(dir, &mut entry, &mut result) };
-    if error != 0 {
-        return Err(error);
+/// Read the next batch of entries of a directory into `buf`, as many as fit. Returns the bytes
+/// filled, 0 at the end; walk them with `Dirents`.
+pub fn getdents(fh: u64, buf: &mut [u8]) -> Result<usize, libc::c_int> {
+    let n = unsafe {
+        libc::syscall(libc::SYS_getdents64, fh as libc::c_int, buf.as_mut_ptr(), buf.len())
+    };
+    if n < 0 {
+        return Err(io::Error::last_os_error().raw_os_error().unwrap());
     }
+    Ok(n as usize)
+}
+
+/// Entries of a `getdents` batch, as (d_type, name).
+pub struct Dirents<'a> {
+    buf: &'a [u8],
+}
 
-    if result.is_null() {
-        return Ok(None);
+impl<'a> Dirents<'a> {
+    pub fn new(buf: &'a [u8]) -> Dirents<'a> {
+        Dirents { buf }
     }
+}
+
+impl<'a> Iterator for Dirents<'a> {
+    type Item = (u8, &'a CStr);
 
-    Ok(Some(entry))
+    fn next(&mut self) -> Option<(u8, &'a CStr)> {
+        // struct linux_dirent64: d_ino (8), d_off (8), d_reclen (2), d_type (1), d_name.
+        const NAME: usize = 19;
+        if self.buf.len() < NAME {
+            return None;
+        }
+        let reclen = u16::from_ne_bytes([self.buf[16], self.buf[17]]) as usize;
+        if reclen < NAME || reclen > self.buf.len() {
+            return None;
+        }
+        let (record, rest) = self.buf.split_at(reclen);
+        self.buf = rest;
+        let name = CStr::from_bytes_until_nul(&record[NAME..]).ok()?;
+        Some((record[18], name))
+    }
 }
 
 pub fn closedir(fh: u64) -> Result<(), libc::c_int> {
-    let dir = fh as usize as *mut libc::DIR;
-    if -1 == unsafe { libc::closedir(dir) } {
+    if -1 == unsafe { libc::close(fh as libc::c_int) } {
         Err(io::Error::last_os_error().raw_os_error().unwrap())
     } else {
         Ok(())
@@ -71,6 +108,44 @@ pub fn open(path: OsString, flags: libc::c_int) -> Result<u64, libc::c_int> {
     Ok(fd as u64)
 }
 
+/// Send `data` on a Unix socket with `fd` attached as SCM_RIGHTS. Returns the bytes sent; the
+/// descriptor goes with the first byte.
+pub fn send_fd(sock: libc::c_int, data: &[u8], fd: libc::c_int) -> Result<usize, libc::c_int> {
+    // Room for one cmsghdr carrying one descriptor, suitably aligned.
+    let mut control = [0u64; 4];
+    let space = unsafe { libc::CMSG_SPACE(mem::size_of::<libc::c_int>() as u32) } as usize;
+    assert!(space <= mem::size_of_val(&control));
+
+    let mut iov = libc::iovec {
+        iov_base: data.as_ptr() as *mut libc::c_void,
+        iov_len: data.len(),
+    };
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = space as _;
+
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(mem::size_of::<libc::c_int>() as u32) as _;
+        ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut libc::c_int, fd);
+    }
+
+    loop {
+        let n = unsafe { libc::sendmsg(sock, &msg, libc::MSG_NOSIGNAL) };
+        if n >= 0 {
+            return Ok(n as usize);
+        }
+        let e = io::Error::last_os_error().raw_os_error().unwrap();
+        if e != libc::EINTR {
+            return Err(e);
+        }
+    }
+}
+
 pub fn close(fh: u64) -> Result<(), libc::c_int> {
     let fd = fh as libc::c_int;
     if -1 == unsafe { libc::close(fd) } {
@@ -91,6 +166,19 @@ pub fn lstat(path: OsString) -> Result<libc::stat64, libc::c_int> {
     Ok(buf)
 }
 
+/// lstat of `name` in the directory open as `dir`.
+pub fn fstatat(dir: u64, name: &CStr) -> Result<libc::stat64, libc::c_int> {
+    let mut buf: libc::stat64 = unsafe { mem::zeroed() };
+    let result = unsafe {
+        libc::fstatat64(dir as libc::c_int, name.as_ptr(), &mut buf, libc::AT_SYMLINK_NOFOLLOW)
+    };
+    if -1 == result {
+        return Err(io::Error::last_os_error().raw_os_error().unwrap());
+    }
+
+    Ok(buf)
+}
+
 pub fn fstat(fd: u64) -> Result<libc::stat64, libc::c_int> {
     let mut buf: libc::stat64 = unsafe { mem::zeroed() };
     if -1 == unsafe { libc::fstat64(fd as libc::c_int, &mut buf) } {
@@ -171,4 +259,73 @@ pub fn lremovexattr(path: OsString, name: OsString) -> Result<(), libc::c_int> {
     } else {
         Ok(())
     }
-}
\ No newline at end of file
+}
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A linux_dirent64 record for `name`, padded to 8 bytes, with `reclen` overriding its length
+    /// field if given.
+    fn record(name: &str, d_type: u8, reclen: Option<u16>) -> Vec<u8> {
+        let len = (19 + name.len() + 1 + 7) & !7;
+        let mut rec = vec![0u8; len];
+        rec[16..18].copy_from_slice(&reclen.unwrap_or(len as u16).to_ne_bytes());
+        rec[18] = d_type;
+        rec[19..19 + name.len()].copy_from_slice(name.as_bytes());
+        rec
+    }
+
+    fn names(buf: &[u8]) -> Vec<(u8, String)> {
+        Dirents::new(buf).map(|(t, name)| (t, name.to_str().unwrap().to_owned())).collect()
+    }
+
+    #[test]
+    fn dirents_well_formed() {
+        let mut buf = record("a.bmp", libc::DT_REG, None);
+        buf.extend(record("subdir", libc::DT_DIR, None));
+        assert_eq!(names(&buf), [(libc::DT_REG, "a.bmp".to_owned()),
+                                 (libc::DT_DIR, "subdir".to_owned())]);
+        assert!(names(&[]).is_empty());
+    }
+
+    #[test]
+    fn dirents_malformed_reclen_stops() {
+        let good = record("a.bmp", libc::DT_REG, None);
+        for reclen in [0, 1, 18, 4096] {
+            let mut buf = good.clone();
+            buf.extend(record("b.bmp", libc::DT_REG, Some(reclen)));
+            assert_eq!(names(&buf), [(libc::DT_REG, "a.bmp".to_owned())], "reclen {}", reclen);
+        }
+
+        // A record cut short by the end of the buffer, and a name without its NUL
+        assert!(names(&good[..good.len() - 1]).is_empty());
+        assert!(names(&good[..18]).is_empty());
+        let mut unterminated = record("abcde", libc::DT_REG, Some(24));
+        unterminated.truncate(24);
+        assert!(names(&unterminated).is_empty());
+    }
+
+    #[test]
+    fn getdents_lists_a_directory() {
+        let dir = std::env::temp_dir().join(format!("getdents_test_{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        std::fs::write(dir.join("frame.bmp"), b"").unwrap();
+
+        let fh = opendir(dir.clone().into_os_string()).unwrap();
+        let mut buf = vec![0u8; 4096];
+        let mut listed = vec![];
+        loop {
+            let n = getdents(fh, &mut buf).unwrap();
+            if n == 0 {
+                break;
+            }
+            listed.extend(names(&buf[..n]));
+        }
+        closedir(fh).unwrap();
+        listed.sort();
+        assert_eq!(listed, [(libc::DT_DIR, ".".to_owned()), (libc::DT_DIR, "..".to_owned()),
+                            (libc::DT_REG, "frame.bmp".to_owned())]);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,303 @@
+// Logger :: Asynchronous JSON-lines logger behind the `log` facade and the per-job logs.
+//
+// Log calls and per-job records are pushed onto a bounded lock-free ring (a Vyukov MPMC queue
+// drained by one consumer) and written out by a single flusher thread, so FUSE and TEE workers
+// never wait on stdout or on a file. When the ring is full records are dropped rather than
+// blocking the caller; the flusher reports how many.
+//
+// Every record is one JSON object per line with a microsecond timestamp and, when logged while a
+// worker is on a job, the job's ID. Log messages go to stdout; the per-job timing and queue
+// records go to files that stay open for the life of the mount and are written in batches.
+//
+
+use std::cell::{Cell, UnsafeCell};
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::fs::{File, OpenOptions};
+use std::io::{self, BufWriter, Write};
+use std::mem::MaybeUninit;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::OnceLock;
+use std::thread::{self, Thread};
+use std::time::{Duration, Instant, SystemTime};
+
+/// Records the ring holds before new ones are dropped.
+const RING_SIZE: usize = 1 << 14;
+
+/// How long the flusher sleeps when there is nothing to write.
+const FLUSH_INTERVAL: Duration = Duration::from_millis(50);
+
+thread_local! {
+    /// The job this thread is working on, stamped on its records.
+    static JOB: Cell<Option<u64>> = Cell::new(None);
+}
+
+struct Slot<T> {
+    seq: AtomicUsize,
+    value: UnsafeCell<MaybeUninit<T>>,
+}
+
+/// Bounded queue for many producers and one consumer. Each slot's sequence number says whether it
+/// is free for the push at that position or holds the value for the pop at that position.
+struct Ring<T> {
+    slots: Box<[Slot<T>]>,
+    mask: usize,
+    head: AtomicUsize,
+    tail: AtomicUsize,
+}
+
+unsafe impl<T: Send> Sync for Ring<T> {}
+
+impl<T> Ring<T> {
+    fn new(size: usize) -> Ring<T> {
+        assert!(size.is_power_of_two());
+        Ring {
+            slots: (0..size)
+                .map(|i| Slot {
+                    seq: AtomicUsize::new(i),
+                    value: UnsafeCell::new(MaybeUninit::uninit()),
+                })
+                .collect(),
+            mask: size - 1,
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+        }
+    }
+
+    /// Add `value`, or hand it back if the ring is full.
+    fn push(&self, value: T) -> Result<(), T> {
+        let mut pos = self.head.load(Ordering::Relaxed);
+        loop {
+            let slot = &self.slots[pos & self.mask];
+            let seq = slot.seq.load(Ordering::Acquire);
+            let lag = seq.wrapping_sub(pos) as isize;
+            if lag == 0 {
+                match self.head.compare_exchange_weak(
+                    pos,
+                    pos.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(_) => {
+                        unsafe { (*slot.value.get()).write(value) };
+                        slot.seq.store(pos.wrapping_add(1), Ordering::Release);
+                        return Ok(());
+                    }
+                    Err(current) => pos = current,
+                }
+            } else if lag < 0 {
+                return Err(value);
+            } else {
+                pos = self.head.load(Ordering::Relaxed);
+            }
+        }
+    }
+
+    /// Take the oldest value. Only one thread may pop.
+    fn pop(&self) -> Option<T> {
+        let pos = self.tail.load(Ordering::Relaxed);
+        let slot = &self.slots[pos & self.mask];
+        if slot.seq.load(Ordering::Acquire) != pos.wrapping_add(1) {
+            return None;
+        }
+        self.tail.store(pos.wrapping_add(1), Ordering::Relaxed);
+        let value = unsafe { (*slot.value.get()).assume_init_read() };
+        slot.seq
+            .store(pos.wrapping_add(self.mask + 1), Ordering::Release);
+        Some(value)
+    }
+}
+
+impl<T> Drop for Ring<T> {
+    fn drop(&mut self) {
+        while self.pop().is_some() {}
+    }
+}
+
+/// Where a record is written.
+#[derive(Clone, Copy)]
+enum Sink {
+    Stdout,
+    File(&'static str),
+}
+
+struct Record {
+    time: SystemTime,
+    sink: Sink,
+    job: Option<u64>,
+    /// The rest of the JSON object, without braces.
+    fields: String,
+}
+
+struct AsyncLogger {
+    ring: Ring<Record>,
+    dropped: AtomicU64,
+    flusher: OnceLock<Thread>,
+    /// Bumped each time the flusher has written everything out.
+    flushes: AtomicU64,
+}
+
+static LOGGER: OnceLock<AsyncLogger> = OnceLock::new();
+
+/// `s` as a JSON string literal.
+pub fn json_str(s: &str) -> String {
+    let mut out = String::with_capacity(s.len() + 2);
+    out.push('"');
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            '\n' => out.push_str("\\n"),
+            '\r' => out.push_str("\\r"),
+            '\t' => out.push_str("\\t"),
+            c if (c as u32) < 0x20 => {
+                let _ = write!(out, "\\u{:04x}", c as u32);
+            }
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+    out
+}
+
+impl AsyncLogger {
+    fn push(&self, sink: Sink, fields: String) {
+        let record = Record {
+            time: SystemTime::now(),
+            sink,
+            job: JOB.with(|job| job.get()),
+            fields,
+        };
+        if self.ring.push(record).is_err() {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    fn flush_loop(&self) {
+        let mut console = BufWriter::new(io::stdout());
+        let mut files: HashMap<&'static str, BufWriter<File>> = HashMap::new();
+        let mut line = String::new();
+
+        loop {
+            let mut wrote = false;
+            while let Some(record) = self.ring.pop() {
+                wrote = true;
+                line.clear();
+                let micros = record
+                    .time
+                    .duration_since(SystemTime::UNIX_EPOCH)
+                    .map_or(0, |d| d.as_micros());
+                let _ = write!(line, "{{\"ts_us\":{}", micros);
+                if let Some(job) = record.job {
+                    let _ = write!(line, ",\"job\":{}", job);
+                }
+                let _ = writeln!(line, ",{}}}", record.fields);
+
+                let result = match record.sink {
+                    Sink::Stdout => console.write_all(line.as_bytes()),
+                    Sink::File(name) => match files.get_mut(name) {
+                        Some(file) => file.write_all(line.as_bytes()),
+                        None => match OpenOptions::new().append(true).create(true).open(name) {
+                            Ok(file) => {
+                                let mut file = BufWriter::new(file);
+                                let result = file.write_all(line.as_bytes());
+                                files.insert(name, file);
+                                result
+                            }
+                            Err(e) => Err(e),
+                        },
+                    },
+                };
+                if let Err(e) = result {
+                    let _ = writeln!(
+                        console,
+                        "{{\"level\":\"ERROR\",\"msg\":{}}}",
+                        json_str(&e.to_string())
+                    );
+                }
+            }
+
+            let dropped = self.dropped.swap(0, Ordering::Relaxed);
+            if dropped > 0 {
+                let _ = writeln!(
+                    console,
+                    "{{\"level\":\"WARN\",\"target\":\"logger\",\"msg\":\"dropped {} records\"}}",
+                    dropped
+                );
+            }
+
+            if !wrote {
+                let _ = console.flush();
+                for file in files.values_mut() {
+                    let _ = file.flush();
+                }
+                self.flushes.fetch_add(1, Ordering::Release);
+                thread::park_timeout(FLUSH_INTERVAL);
+            }
+        }
+    }
+}
+
+impl log::Log for AsyncLogger {
+    fn enabled(&self, _metadata: &log::Metadata<'_>) -> bool {
+        true
+    }
+
+    fn log(&self, record: &log::Record<'_>) {
+        self.push(
+            Sink::Stdout,
+            format!(
+                "\"level\":\"{}\",\"target\":{},\"msg\":{}",
+                record.level(),
+                json_str(record.target()),
+                json_str(&record.args().to_string())
+            ),
+        );
+    }
+
+    /// Wait (up to a second) until everything logged so far is written.
+    fn flush(&self) {
+        let flusher = match self.flusher.get() {
+            Some(flusher) => flusher,
+            None => return,
+        };
+        let deadline = Instant::now() + Duration::from_secs(1);
+        let target = self.flushes.load(Ordering::Acquire) + 2;
+        while self.flushes.load(Ordering::Acquire) < target && Instant::now() < deadline {
+            flusher.unpark();
+            thread::sleep(Duration::from_millis(1));
+        }
+    }
+}
+
+/// Install the logger and start its flusher thread.
+pub fn init(level: log::LevelFilter) {
+    let logger = LOGGER.get_or_init(|| AsyncLogger {
+        ring: Ring::new(RING_SIZE),
+        dropped: AtomicU64::new(0),
+        flusher: OnceLock::new(),
+        flushes: AtomicU64::new(0),
+    });
+
+    let flusher = thread::Builder::new()
+        .name("log-flusher".to_owned())
+        .spawn(move || logger.flush_loop())
+        .expect("Failed to start the log flusher");
+    let _ = logger.flusher.set(flusher.thread().clone());
+
+    log::set_logger(logger).unwrap();
+    log::set_max_level(level);
+}
+
+/// Append a record with the JSON `fields` (without braces) to the file `name`. Does nothing
+/// until `init` was called.
+pub fn write(name: &'static str, fields: String) {
+    if let Some(logger) = LOGGER.get() {
+        logger.push(Sink::File(name), fields);
+    }
+}
+
+/// Stamp the records this thread logs from now on with `job`.
+pub fn set_job(job: Option<u64>) {
+    JOB.with(|current| current.set(job));
+}
@@ -0,0 +1,110 @@
+// Lru :: Map that keeps its entries in least recently used order.
+//
+// Used by the result cache behind `/.processed` and by the dedup cache. Every insert or touch
+// stamps the entry with a new tick, and a BTreeMap from tick to key keeps the entries in order, so
+// the oldest one is found without a scan. How much to keep is up to the caller.
+//
+
+use std::collections::{BTreeMap, HashMap};
+use std::hash::Hash;
+
+pub struct Lru<K, V> {
+    entries: HashMap<K, (V, u64)>,
+    order: BTreeMap<u64, K>,
+    next_tick: u64,
+}
+
+impl<K, V> Default for Lru<K, V> {
+    fn default() -> Self {
+        Lru {
+            entries: HashMap::new(),
+            order: BTreeMap::new(),
+            next_tick: 0,
+        }
+    }
+}
+
+impl<K: Hash + Eq + Clone, V> Lru<K, V> {
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Look up `key` without changing the order.
+    pub fn peek(&self, key: &K) -> Option<&V> {
+        self.entries.get(key).map(|(value, _)| value)
+    }
+
+    /// Look up `key` and make it the most recently used.
+    pub fn touch(&mut self, key: &K) -> Option<&V> {
+        let (value, tick) = self.entries.get_mut(key)?;
+        self.order.remove(tick);
+        *tick = self.next_tick;
+        self.next_tick += 1;
+        self.order.insert(*tick, key.clone());
+        Some(value)
+    }
+
+    /// Insert `value` as the most recently used, returning the one it replaces.
+    pub fn insert(&mut self, key: K, value: V) -> Option<V> {
+        let old = self.entries.remove(&key).map(|(old, tick)| {
+            self.order.remove(&tick);
+            old
+        });
+
+        let tick = self.next_tick;
+        self.next_tick += 1;
+        self.order.insert(tick, key.clone());
+        self.entries.insert(key, (value, tick));
+        old
+    }
+
+    /// Remove the least recently used entry.
+    pub fn pop_oldest(&mut self) -> Option<(K, V)> {
+        let (_, key) = self.order.pop_first()?;
+        let (value, _) = self.entries.remove(&key).unwrap();
+        Some((key, value))
+    }
+
+    /// Visit the values from the least recently used on, until `f` returns false. The order is
+    /// left as it is.
+    pub fn for_each_oldest(&mut self, mut f: impl FnMut(&mut V) -> bool) {
+        for key in self.order.values() {
+            let (value, _) = self.entries.get_mut(key).unwrap();
+            if !f(value) {
+                return;
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn oldest_goes_first() {
+        let mut lru = Lru::default();
+        lru.insert(1, "a");
+        lru.insert(2, "b");
+        lru.insert(3, "c");
+
+        // Touching or replacing makes an entry the newest; peeking does not
+        assert_eq!(lru.touch(&1), Some(&"a"));
+        assert_eq!(lru.insert(2, "B"), Some("b"));
+        assert_eq!(lru.peek(&3), Some(&"c"));
+        assert_eq!(lru.len(), 3);
+
+        let mut seen = vec![];
+        lru.for_each_oldest(|value| {
+            seen.push(*value);
+            seen.len() < 2
+        });
+        assert_eq!(seen, ["c", "a"]);
+
+        assert_eq!(lru.pop_oldest(), Some((3, "c")));
+        assert_eq!(lru.pop_oldest(), Some((1, "a")));
+        assert_eq!(lru.pop_oldest(), Some((2, "B")));
+        assert_eq!(lru.pop_oldest(), None);
+        assert_eq!(lru.touch(&1), None);
+    }
+}
@@ -6,54 +6,226 @@
 
 use std::env;
 use std::ffi::{OsStr, OsString};
+use std::time::Duration;
 
 #[macro_use]
 extern crate log;
 
+mod attrs;
+mod bmp;
+mod dedup;
+mod index;
 mod libc_extras;
 mod libc_wrappers;
+mod logger;
+mod lru;
 mod passthrough;
+mod processing;
+mod results;
+mod stats;
+mod stream;
+mod virtual_files;
 
-struct ConsoleLogger;
+struct Options {
+    fuse_threads: usize,
+    tee_workers: usize,
+    tee_socket: Option<OsString>,
+    queue: processing::QueueConfig,
+    keep_cache: bool,
+    stream: bool,
+    result_cache_mb: usize,
+    attr_ttl: Duration,
+    negative_ttl: Duration,
+    readdir_prefill: bool,
+    dedup_entries: usize,
+}
+
+fn usage() -> ! {
+    println!(
+        "usage: {} [--fuse-threads=N] [--tee-workers=N] [--tee-socket=PATH] [--queue-depth=N] \
+         [--max-in-flight=N] [--queue-full=block|reject] \
+         [--keep-cache] [--stream] [--result-cache=MB] [--attr-ttl=SECS] [--negative-ttl=SECS] \
+         [--readdir-prefill] [--dedup[=N]] <target> <mountpoint>",
+        &env::args().next().unwrap()
+    );
+    std::process::exit(-1);
+}
+
+/// Parse a duration in (possibly fractional) seconds.
+fn parse_secs(value: &str) -> Duration {
+    match value.parse::<f64>() {
+        Ok(secs) if secs >= 0.0 && secs.is_finite() => Duration::from_secs_f64(secs),
+        _ => usage(),
+    }
+}
+
+/// Split the command line into `--name=value` options and positional arguments.
+fn parse_args(args: impl Iterator<Item = OsString>) -> (Options, Vec<OsString>) {
+    let mut options = Options {
+        // One FUSE worker per core by default, so concurrent writers are not serialized.
+        fuse_threads: std::thread::available_parallelism().map_or(1, |n| n.get()),
+        tee_workers: processing::DEFAULT_WORKERS,
+        tee_socket: None,
+        // max_in_flight 0 means one per TEE worker, resolved below.
+        queue: processing::QueueConfig {
+            depth: processing::DEFAULT_QUEUE_DEPTH,
+            max_in_flight: 0,
+            overflow: processing::Overflow::Block,
+        },
+        keep_cache: false,
+        stream: false,
+        result_cache_mb: results::DEFAULT_CACHE_MB,
+        attr_ttl: attrs::DEFAULT_TTL,
+        negative_ttl: attrs::DEFAULT_NEGATIVE_TTL,
+        readdir_prefill: false,
+        dedup_entries: 0,
+    };
+    let mut positional = vec![];
 
-impl log::Log for ConsoleLogger {
-    fn enabled(&self, _metadata: &log::Metadata<'_>) -> bool {
-        true
+    for arg in args {
+        let s = match arg.to_str() {
+            Some(s) if s.starts_with("--") => s,
+            _ => {
+                positional.push(arg);
+                continue;
+            }
+        };
+        let (name, value) = s.split_once('=').unwrap_or((s, ""));
+        match name {
+            "--fuse-threads" => {
+                options.fuse_threads = match value.parse() {
+                    Ok(n) if n > 0 => n,
+                    _ => usage(),
+                };
+            }
+            "--tee-workers" => {
+                options.tee_workers = value.parse().unwrap_or_else(|_| usage());
+            }
+            "--tee-socket" => {
+                options.tee_socket = Some(OsString::from(value));
+            }
+            "--queue-depth" => {
+                options.queue.depth = match value.parse() {
+                    Ok(n) if n > 0 => n,
+                    _ => usage(),
+                };
+            }
+            "--max-in-flight" => {
+                options.queue.max_in_flight = match value.parse() {
+                    Ok(n) if n > 0 => n,
+                    _ => usage(),
+                };
+            }
+            "--queue-full" => {
+                options.queue.overflow = match value {
+                    "block" => processing::Overflow::Block,
+                    "reject" => processing::Overflow::Reject,
+                    _ => usage(),
+                };
+            }
+            "--keep-cache" => {
+                options.keep_cache = true;
+            }
+            "--stream" => {
+                options.stream = true;
+            }
+            "--result-cache" => {
+                options.result_cache_mb = value.parse().unwrap_or_else(|_| usage());
+            }
+            "--attr-ttl" => {
+                options.attr_ttl = parse_secs(value);
+            }
+            "--negative-ttl" => {
+                options.negative_ttl = parse_secs(value);
+            }
+            "--readdir-prefill" => {
+                options.readdir_prefill = true;
+            }
+            "--dedup" => {
+                options.dedup_entries = match value {
+                    "" => dedup::DEFAULT_ENTRIES,
+                    _ => value.parse().unwrap_or_else(|_| usage()),
+                };
+            }
+            _ => usage(),
+        }
     }
 
-    fn log(&self, record: &log::Record<'_>) {
-        println!("{}: {}: {}", record.target(), record.level(), record.args());
+    if options.queue.max_in_flight == 0 {
+        options.queue.max_in_flight = options.tee_workers.max(1);
     }
 
-    fn flush(&self) {}
+    (options, positional)
 }
 
-static LOGGER: ConsoleLogger = ConsoleLogger;
-
 fn main() {
-    log::set_logger(&LOGGER).unwrap();
-    log::set_max_level(log::LevelFilter::Warn);
+    logger::init(log::LevelFilter::Warn);
 
-    let args: Vec<OsString> = env::args_os().collect();
+    let (options, args) = parse_args(env::args_os().skip(1));
 
-    if args.len() != 3 {
-        println!(
-            "usage: {} <target> <mountpoint>",
-            &env::args().next().unwrap()
-        );
-        std::process::exit(-1);
+    if args.len() != 2 {
+        usage();
     }
 
+    // Streaming needs the daemon, which reads the rows from the file as they are written.
+    let streams = match (&options.tee_socket, options.stream) {
+        (Some(socket), true) => Some(stream::Streams::new(socket.into())),
+        (None, true) => {
+            warn!("--stream needs --tee-socket, processing images after close");
+            None
+        }
+        _ => None,
+    };
+
+    // The /.processed view loads and processes images through the daemon too. 0 turns it off.
+    let results = match &options.tee_socket {
+        Some(socket) if options.result_cache_mb > 0 => Some(std::sync::Arc::new(
+            results::ResultCache::new(socket.into(), options.result_cache_mb << 20),
+        )),
+        _ => None,
+    };
+
+    // Prefer a running video_tee daemon; otherwise each worker spawns its own session.
+    let backend = match options.tee_socket {
+        Some(socket) => processing::Backend::Daemon(socket.into()),
+        None => processing::Backend::Spawn("video_tee".to_owned()),
+    };
+
+    // Results of content seen before, reused for copies of it. Off unless asked for.
+    let dedup = match options.dedup_entries {
+        0 => None,
+        entries => Some(std::sync::Arc::new(dedup::DedupCache::new(entries))),
+    };
+    let hashes = dedup.as_ref().map(|_| dedup::WriteHashes::new());
+
+    let index = index::ProcessedIndex::open(args[0].as_ref())
+        .expect("Failed to open the processed-file index");
+    let index = std::sync::Arc::new(index);
+
     let filesystem = passthrough::PassthroughFS {
-        target: args[1].clone(),
+        target: args[0].clone(),
+        pool: processing::TeePool::new(options.tee_workers, backend, options.queue, dedup),
+        index,
+        keep_cache: options.keep_cache,
+        streams,
+        hashes,
+        results,
+        // fuse_mt gives the kernel the same TTL for entries and attributes.
+        attrs: attrs::AttrCache::new(options.attr_ttl, options.negative_ttl),
+        // Prefilled attributes would expire at once without a TTL.
+        readdir_prefill: options.readdir_prefill && !options.attr_ttl.is_zero(),
+        stats: std::sync::Arc::new(stats::Stats::new()),
+        virtual_files: virtual_files::VirtualFiles::new(),
     };
 
     let fuse_args = [OsStr::new("-o"), OsStr::new("fsname=passthrufs")];
 
     fuse_mt::mount(
-        fuse_mt::FuseMT::new(filesystem, 1),
-        &args[2],
+        fuse_mt::FuseMT::new(filesystem, options.fuse_threads),
+        &args[1],
         &fuse_args[..],
     )
     .unwrap();
+
+    log::logger().flush();
 }
@@ -5,40 +5,76 @@
 // Copyright (c) 2016-2022 by William R. Fraser
 //
 
-use lazy_static::lazy_static;
-use std::ffi::{CStr, CString, OsStr, OsString};
+use std::cell::RefCell;
+use std::ffi::{CString, OsStr, OsString};
 use std::fs::{self, File};
 use std::io::{self, Read, Seek, SeekFrom, Write};
 use std::os::unix::ffi::{OsStrExt, OsStringExt};
+use std::os::unix::fs::FileExt;
 use std::os::unix::io::{FromRawFd, IntoRawFd};
 use std::path::{Path, PathBuf};
-use std::process::{Command, Output};
-use std::sync::Mutex;
-use std::time::{Duration,  SystemTime};
-use std::{mem, thread};
+use std::sync::Arc;
+use std::time::{Duration,  Instant, SystemTime};
+use std::mem;
 
+use crate::attrs::AttrCache;
+use crate::dedup::WriteHashes;
 use crate::libc_extras::libc;
+use crate::index::{FileKey, ProcessedIndex, JOURNAL_NAME};
 use crate::libc_wrappers;
+use crate::processing::{Job, JobResult, TeePool, PRIORITY_NORMAL};
+use crate::results::{ResultCache, ViewFile, ATTESTATION_SUFFIX, VIEW_DIR};
+use crate::stats::{Op, Stats, STATS_JSON, STATS_PROM};
+use crate::stream::Streams;
+use crate::virtual_files::{self, VirtualFiles};
 
 use fuse_mt::*;
 
+thread_local! {
+    /// Read buffer of each FUSE worker thread, reused so a read request does not allocate. It
+    /// grows to the largest request seen, normally max_read (128 KiB).
+    static READ_BUF: RefCell<Vec<u8>> = RefCell::new(Vec::new());
+}
+
 pub struct PassthroughFS {
     pub target: OsString,
+    pub pool: TeePool,
+    pub index: Arc<ProcessedIndex>,
+    /// Let the kernel keep the page cache of non-image files across opens.
+    pub keep_cache: bool,
+    /// Stream images to the TEE daemon while they are written, if enabled.
+    pub streams: Option<Streams>,
+    /// Hashes of images being written, for the dedup cache if it is enabled.
+    pub hashes: Option<WriteHashes>,
+    /// Results behind the `/.processed` view, if enabled.
+    pub results: Option<Arc<ResultCache>>,
+    /// Attributes of backing files, and the TTL of replies.
+    pub attrs: AttrCache,
+    /// Cache the attributes of listed entries ahead of the lookups that follow.
+    pub readdir_prefill: bool,
+    pub stats: Arc<Stats>,
+    /// Open `/.processed` and `/.stats` files.
+    pub virtual_files: VirtualFiles,
 }
 
-// List of already processed files
-lazy_static! {
-    static ref STRING_LIST: Mutex<Vec<String>> = Mutex::new(Vec::new());
+/// What a path under `/.processed` refers to.
+enum ViewPath {
+    /// A directory of the view, mirroring this source directory.
+    Dir(PathBuf),
+    /// The processed image of a source file, or its attestation.
+    File(PathBuf, ViewFile),
 }
 
-fn add_processed_file(s: String) {
-    let mut list = STRING_LIST.lock().unwrap();
-    list.push(s);
-}
+/// Size of the buffer directories are read into; getdents fills it with as many entries as fit.
+const DIRENT_BUF_SIZE: usize = 64 * 1024;
 
-fn check_is_processed(s: &str) -> bool {
-    let list = STRING_LIST.lock().unwrap();
-    list.contains(&s.to_string())
+/// Reply flags of open/create (FOPEN_* in <linux/fuse.h>).
+const FOPEN_DIRECT_IO: u32 = 1 << 0;
+const FOPEN_KEEP_CACHE: u32 = 1 << 1;
+
+/// Files that are queued for TEE processing when closed.
+fn is_image(path: &Path) -> bool {
+    path.as_os_str().as_bytes().ends_with(b".bmp")
 }
 
 fn mode_to_filetype(mode: libc::mode_t) -> FileType {
@@ -56,6 +92,23 @@ fn mode_to_filetype(mode: libc::mode_t) -> FileType {
     }
 }
 
+/// File type from a d_type; None if the filesystem did not say.
+fn dtype_to_filetype(d_type: u8) -> Option<FileType> {
+    match d_type {
+        libc::DT_DIR => Some(FileType::Directory),
+        libc::DT_REG => Some(FileType::RegularFile),
+        libc::DT_LNK => Some(FileType::Symlink),
+        libc::DT_BLK => Some(FileType::BlockDevice),
+        libc::DT_CHR => Some(FileType::CharDevice),
+        libc::DT_FIFO => Some(FileType::NamedPipe),
+        libc::DT_SOCK => {
+            warn!("FUSE doesn't support Socket file type; translating to NamedPipe instead.");
+            Some(FileType::NamedPipe)
+        }
+        _ => None,
+    }
+}
+
 fn stat_to_fuse(stat: libc::stat64) -> FileAttr {
     // st_mode encodes both the kind and the permissions
     let kind = mode_to_filetype(stat.st_mode);
@@ -123,6 +176,173 @@ impl PassthroughFS {
             .into_os_string()
     }
 
+    /// FOPEN_* flags for a newly opened file. Images always go through this process, so their
+    /// data is never cached by the kernel past the open.
+    fn open_reply_flags(&self, path: &Path) -> u32 {
+        if self.keep_cache && !is_image(path) {
+            FOPEN_KEEP_CACHE
+        } else {
+            0
+        }
+    }
+
+    /// Claim the current version of an open file for processing; None if it already was.
+    fn claim_new_version(&self, path: &Path, fh: u64) -> Option<FileKey> {
+        match libc_wrappers::fstat(fh) {
+            Ok(stat) => {
+                let key = FileKey::from_stat(&stat);
+                if self.index.claim(key) {
+                    Some(key)
+                } else {
+                    None
+                }
+            }
+            Err(e) => {
+                error!("fstat({:?}): {}", path, io::Error::from_raw_os_error(e));
+                None
+            }
+        }
+    }
+
+    /// Whether `path` is a statistics file, and which: Some(true) for the Prometheus one.
+    fn stats_file(&self, path: &Path) -> Option<bool> {
+        let name = path.strip_prefix("/").ok()?;
+        if name == Path::new(STATS_JSON) {
+            Some(false)
+        } else if name == Path::new(STATS_PROM) {
+            Some(true)
+        } else {
+            None
+        }
+    }
+
+    /// Attributes of the statistics files: read-only, owned like the root, and empty, as their
+    /// size is only known once a snapshot is taken at open.
+    fn stats_getattr(&self) -> ResultEntry {
+        let mut attr = self.stat_real(Path::new("/")).map_err(|e| e.raw_os_error().unwrap())?;
+        let now = SystemTime::now();
+        attr.kind = FileType::RegularFile;
+        attr.perm = 0o444;
+        attr.nlink = 1;
+        attr.size = 0;
+        attr.blocks = 0;
+        attr.atime = now;
+        attr.mtime = now;
+        attr.ctime = now;
+        Ok((self.attrs.ttl(), attr))
+    }
+
+    /// Where `path` points in the `/.processed` view; None if it is outside of it.
+    fn view_path(&self, path: &Path) -> Option<ViewPath> {
+        self.results.as_ref()?;
+        let rest = path.strip_prefix("/").ok()?.strip_prefix(VIEW_DIR).ok()?;
+        let source = Path::new("/").join(rest);
+
+        let bytes = source.as_os_str().as_bytes();
+        if let Some(image) = bytes.strip_suffix(ATTESTATION_SUFFIX.as_bytes()) {
+            let image = Path::new(OsStr::from_bytes(image));
+            if is_image(image) {
+                return Some(ViewPath::File(image.to_owned(), ViewFile::Attestation));
+            }
+        }
+        if is_image(&source) {
+            Some(ViewPath::File(source, ViewFile::Image))
+        } else {
+            Some(ViewPath::Dir(source))
+        }
+    }
+
+    /// Version of the source image behind a view file.
+    fn view_source(&self, source: &Path) -> Result<(FileKey, libc::stat64), libc::c_int> {
+        let stat = libc_wrappers::lstat(self.real_path(source))?;
+        if stat.st_mode & libc::S_IFMT != libc::S_IFREG {
+            return Err(libc::ENOENT);
+        }
+        Ok((FileKey::from_stat(&stat), stat))
+    }
+
+    /// Attributes in the view: read-only copies of the source's, with the size of what is served.
+    fn view_getattr(&self, view: ViewPath) -> ResultEntry {
+        let results = self.results.as_ref().unwrap();
+        match view {
+            ViewPath::Dir(source) => {
+                let mut attr = self
+                    .stat_real(&source)
+                    .map_err(|e| e.raw_os_error().unwrap())?;
+                if attr.kind != FileType::Directory {
+                    return Err(libc::ENOENT);
+                }
+                attr.perm &= 0o555;
+                Ok((self.attrs.ttl(), attr))
+            }
+            ViewPath::File(source, which) => {
+                let (key, stat) = self.view_source(&source)?;
+                let size = results
+                    .size(key, &self.real_path(&source), which)
+                    .ok_or(libc::ENOENT)?;
+                let mut attr = stat_to_fuse(stat);
+                attr.size = size;
+                attr.blocks = (size + 511) / 512;
+                attr.perm &= 0o444;
+                attr.nlink = 1;
+                Ok((self.attrs.ttl(), attr))
+            }
+        }
+    }
+
+    /// List a view directory: subdirectories, and an image and attestation per source image.
+    fn view_readdir(&self, source: &Path) -> ResultReaddir {
+        let real = self.real_path(source);
+        let mut entries = vec![
+            DirectoryEntry {
+                name: OsString::from("."),
+                kind: FileType::Directory,
+            },
+            DirectoryEntry {
+                name: OsString::from(".."),
+                kind: FileType::Directory,
+            },
+        ];
+
+        let dir = fs::read_dir(&real).map_err(|e| e.raw_os_error().unwrap_or(libc::EIO))?;
+        for entry in dir.flatten() {
+            let name = entry.file_name();
+            match entry.file_type() {
+                Ok(t) if t.is_dir() => entries.push(DirectoryEntry {
+                    name,
+                    kind: FileType::Directory,
+                }),
+                Ok(t) if t.is_file() && is_image(Path::new(&name)) => {
+                    let mut attestation = name.clone();
+                    attestation.push(ATTESTATION_SUFFIX);
+                    entries.push(DirectoryEntry {
+                        name,
+                        kind: FileType::RegularFile,
+                    });
+                    entries.push(DirectoryEntry {
+                        name: attestation,
+                        kind: FileType::RegularFile,
+                    });
+                }
+                _ => {}
+            }
+        }
+
+        Ok(entries)
+    }
+
+    /// Drop the cached attributes of `parent/name` and of `parent`, whose entries changed.
+    fn entry_changed(&self, parent: &Path, name: &OsStr) {
+        self.attrs.invalidate(&parent.join(name));
+        self.attrs.invalidate(parent);
+        if let Some(streams) = &self.streams {
+            streams.abort(&parent.join(name));
+        }
+        if let Some(hashes) = &self.hashes {
+            hashes.forget(&parent.join(name));
+        }
+    }
+
     fn stat_real(&self, path: &Path) -> io::Result<FileAttr> {
         let real: OsString = self.real_path(path);
         info!("stat_real: {:?}", real);
@@ -138,8 +358,6 @@ impl PassthroughFS {
     }
 }
 
-const TTL: Duration = Duration::from_secs(1);
-
 impl FilesystemMT for PassthroughFS {
     fn init(&self, _req: RequestInfo) -> ResultEmpty {
         info!("init");
@@ -152,21 +370,47 @@ impl FilesystemMT for PassthroughFS {
 
     fn getattr(&self, _req: RequestInfo, path: &Path, fh: Option<u64>) -> ResultEntry {
         info!("getattr: {:?}", path);
+        let _timer = self.stats.time(Op::Getattr);
+
+        if self.stats_file(path).is_some() {
+            return self.stats_getattr();
+        }
+
+        if let Some(view) = self.view_path(path) {
+            return self.view_getattr(view);
+        }
 
         if let Some(fh) = fh {
             match libc_wrappers::fstat(fh) {
-                Ok(stat) => Ok((TTL, stat_to_fuse(stat))),
+                Ok(stat) => Ok((self.attrs.ttl(), stat_to_fuse(stat))),
                 Err(e) => Err(e),
             }
         } else {
-            match self.stat_real(path) {
-                Ok(attr) => Ok((TTL, attr)),
-                Err(e) => Err(e.raw_os_error().unwrap()),
-            }
+            let result = match self.attrs.get(path) {
+                Ok(result) => result,
+                Err(miss) => {
+                    let result = self.stat_real(path).map_err(|e| e.raw_os_error().unwrap());
+                    self.attrs.put(path, miss, &result);
+                    result
+                }
+            };
+            result.map(|attr| (self.attrs.ttl(), attr))
         }
     }
 
     fn opendir(&self, _req: RequestInfo, path: &Path, _flags: u32) -> ResultOpen {
+        // View directories are listed from the source directory by path.
+        if let Some(view) = self.view_path(path) {
+            return match view {
+                ViewPath::Dir(source) => match self.stat_real(&source) {
+                    Ok(attr) if attr.kind == FileType::Directory => Ok((virtual_files::DIR_FH, 0)),
+                    Ok(_) => Err(libc::ENOTDIR),
+                    Err(e) => Err(e.raw_os_error().unwrap()),
+                },
+                ViewPath::File(..) => Err(libc::ENOTDIR),
+            };
+        }
+
         let real = self.real_path(path);
         info!("opendir: {:?} (flags = {:#o})", real, _flags);
         match libc_wrappers::opendir(real) {
@@ -181,6 +425,9 @@ impl FilesystemMT for PassthroughFS {
 
     fn releasedir(&self, _req: RequestInfo, path: &Path, fh: u64, _flags: u32) -> ResultEmpty {
         info!("releasedir: {:?}", path);
+        if virtual_files::is_virtual(fh) {
+            return Ok(());
+        }
         libc_wrappers::closedir(fh)
     }
 
@@ -188,54 +435,77 @@ impl FilesystemMT for PassthroughFS {
         info!("readdir: {:?}", path);
         let mut entries: Vec<DirectoryEntry> = vec![];
 
+        if let Some(ViewPath::Dir(source)) = self.view_path(path) {
+            return self.view_readdir(&source);
+        }
+
         if fh == 0 {
             error!("readdir: missing fh");
             return Err(libc::EINVAL);
         }
 
-        loop {
-            match libc_wrappers::readdir(fh) {
-                Ok(Some(entry)) => {
-                    let name_c = unsafe { CStr::from_ptr(entry.d_name.as_ptr()) };
-                    let name = OsStr::from_bytes(name_c.to_bytes()).to_owned();
-
-                    let filetype = match entry.d_type {
-                        libc::DT_DIR => FileType::Directory,
-                        libc::DT_REG => FileType::RegularFile,
-                        libc::DT_LNK => FileType::Symlink,
-                        libc::DT_BLK => FileType::BlockDevice,
-                        libc::DT_CHR => FileType::CharDevice,
-                        libc::DT_FIFO => FileType::NamedPipe,
-                        libc::DT_SOCK => {
-                            warn!("FUSE doesn't support Socket file type; translating to NamedPipe instead.");
-                            FileType::NamedPipe
-                        }
-                        _ => {
-                            let entry_path = PathBuf::from(path).join(&name);
-                            let real_path = self.real_path(&entry_path);
-                            match libc_wrappers::lstat(real_path) {
-                                Ok(stat64) => mode_to_filetype(stat64.st_mode),
-                                Err(errno) => {
-                                    let ioerr = io::Error::from_raw_os_error(errno);
-                                    panic!("lstat failed after readdir_r gave no file type for {:?}: {}",
-                                           entry_path, ioerr);
-                                }
-                            }
-                        }
-                    };
+        // fuse_mt lists a handle once and pages through the result, but start from the top in
+        // case it asks again.
+        libc_wrappers::rewinddir(fh)?;
+        let mut buf = vec![0u8; DIRENT_BUF_SIZE];
 
-                    entries.push(DirectoryEntry {
-                        name,
-                        kind: filetype,
-                    })
-                }
-                Ok(None) => {
-                    break;
-                }
+        loop {
+            let n = match libc_wrappers::getdents(fh, &mut buf) {
+                Ok(0) => break,
+                Ok(n) => n,
                 Err(e) => {
-                    error!("readdir: {:?}: {}", path, e);
+                    error!("readdir: {:?}: {}", path, io::Error::from_raw_os_error(e));
                     return Err(e);
                 }
+            };
+
+            for (d_type, name_c) in libc_wrappers::Dirents::new(&buf[..n]) {
+                let name = OsStr::from_bytes(name_c.to_bytes());
+
+                // The processed-file journal is internal to the mount, and the view is
+                // only reached by name
+                if (name == JOURNAL_NAME || (name == VIEW_DIR && self.results.is_some()))
+                    && path == Path::new("/")
+                {
+                    continue;
+                }
+
+                let mut kind = dtype_to_filetype(d_type);
+                let dots = name == "." || name == "..";
+
+                // The kernel looks up every entry it is given next, so with prefill their
+                // attributes are cached while the directory is hot, at one fstatat each.
+                let entry_path = || path.join(name);
+                let miss = if self.readdir_prefill && !dots {
+                    self.attrs.get(&entry_path()).err()
+                } else {
+                    None
+                };
+
+                if kind.is_none() || miss.is_some() {
+                    match libc_wrappers::fstatat(fh, name_c) {
+                        Ok(stat) => {
+                            kind = Some(mode_to_filetype(stat.st_mode));
+                            if let Some(miss) = miss {
+                                self.attrs.put(&entry_path(), miss, &Ok(stat_to_fuse(stat)));
+                            }
+                        }
+                        // Removed since it was listed
+                        Err(libc::ENOENT) => continue,
+                        Err(e) => {
+                            warn!(
+                                "readdir: no file type for {:?}: {}",
+                                entry_path(),
+                                io::Error::from_raw_os_error(e)
+                            );
+                        }
+                    }
+                }
+
+                entries.push(DirectoryEntry {
+                    name: name.to_owned(),
+                    kind: kind.unwrap_or(FileType::RegularFile),
+                });
             }
         }
 
@@ -244,10 +514,42 @@ impl FilesystemMT for PassthroughFS {
 
     fn open(&self, _req: RequestInfo, path: &Path, flags: u32) -> ResultOpen {
         info!("open: {:?} flags={:#x}", path, flags);
+        let _timer = self.stats.time(Op::Open);
+
+        // A snapshot per open; it is read past its advertised size of 0, so bypass the page cache.
+        if let Some(prometheus) = self.stats_file(path) {
+            if flags as libc::c_int & libc::O_ACCMODE != libc::O_RDONLY {
+                return Err(libc::EACCES);
+            }
+            let queue = self.pool.stats();
+            let data = if prometheus {
+                self.stats.to_prometheus(&queue)
+            } else {
+                self.stats.to_json(&queue)
+            };
+            return Ok((self.virtual_files.open(Arc::new(data.into_bytes())), FOPEN_DIRECT_IO));
+        }
+
+        if let Some(view) = self.view_path(path) {
+            let (source, which) = match view {
+                ViewPath::File(source, which) => (source, which),
+                ViewPath::Dir(_) => return Err(libc::EISDIR),
+            };
+            if flags as libc::c_int & libc::O_ACCMODE != libc::O_RDONLY {
+                return Err(libc::EROFS);
+            }
+            let results = self.results.as_ref().unwrap();
+            let (key, _) = self.view_source(&source)?;
+            let data = results.fetch(key, &self.real_path(&source), which)?;
+            // Either may turn out longer than getattr guessed: an attestation that came from a
+            // batch, or an image before the daemon's output format is known. Bypass the page
+            // cache so the kernel does not cut reads at the guessed size.
+            return Ok((self.virtual_files.open(data), FOPEN_DIRECT_IO));
+        }
 
         let real = self.real_path(path);
         match libc_wrappers::open(real, flags as libc::c_int) {
-            Ok(fh) => Ok((fh, flags)),
+            Ok(fh) => Ok((fh, self.open_reply_flags(path))),
             Err(e) => {
                 error!("open({:?}): {}", path, io::Error::from_raw_os_error(e));
                 Err(e)
@@ -265,61 +567,71 @@ impl FilesystemMT for PassthroughFS {
         _flush: bool,
     ) -> ResultEmpty {
         info!("release: {:?}", path);
+        let _timer = self.stats.time(Op::Release);
+
+        if virtual_files::is_virtual(fh) {
+            self.virtual_files.close(fh);
+            return Ok(());
+        }
+
         info!("Finished writing to file.");
 
-        // Convert the path to a string
-        let path_str = path
-            .to_str()
-            .expect("Failed to convert path to string")
-            .to_string();
+        let streamed = self.streams.as_ref().and_then(|streams| streams.take(fh, path));
+        let hashed = self.hashes.as_ref().and_then(|hashes| hashes.take(fh, path));
 
-        // Check if file has been processed
-        if check_is_processed(&path_str) {
-            info!("File was already processed: {:?}", path);
-        } else if path_str.ends_with(".bmp") {
-            // Add file to processed list
-            add_processed_file(path_str.clone());
-
-            // Define the binary name
-            let binary_name = "video_tee".to_string();
-
-            // Define the argument for the binary
-            let arg = format!("./mountpoint/{}", path_str);
-
-            // Spawn a new thread to execute the command
-            thread::spawn(move || {
-                // let start = Instant::now();
-
-                let output: Output = Command::new("sudo")
-                    .arg(&binary_name)
-                    .arg(&arg)
-                    .output()
-                    .expect("Failed to execute process");
-
-                if output.status.success() {
-                    println!("stdout: {}", String::from_utf8_lossy(&output.stdout));
-                    // let duration = start.elapsed();
-                    // Write timing information to a file
-                    // println!("Duration: {:?}", duration);
-                    let mut file = std::fs::OpenOptions::new()
-                        .append(true)
-                        .create(true)
-                        .open("TA_timing_log.txt")
-                        .expect("Failed to open timing file");
-
-                    writeln!(
-                        file,
-                        "{}",
-                        String::from_utf8_lossy(&output.stdout) 
-                    )
-                    .expect("Failed to write to timing file");
-                } else {
-                    eprintln!("stderr: {}", String::from_utf8_lossy(&output.stderr));
+        if !is_image(path) {
+            info!("File is not a BMP file: {:?}", path);
+        } else if let Some(key) = self.claim_new_version(path, fh) {
+            // The job reads the backing file directly rather than back through this mount.
+            let real = PathBuf::from(self.real_path(path));
+
+            // Journal the version once it is processed and keep its result for the view, or
+            // drop the claim so the next close of the file queues it again.
+            let index = Arc::clone(&self.index);
+            let results = self.results.clone();
+            let stats = Arc::clone(&self.stats);
+            let queued = Instant::now();
+            let source = real.clone();
+            let done = Box::new(move |result: Option<JobResult>| match result {
+                Some(result) => {
+                    stats.record(Op::Job, queued.elapsed());
+                    // A dedup hit did not invoke the TA; /.stats counts those separately.
+                    if !result.dedup {
+                        stats.record(Op::Tee, Duration::from_millis(result.took_ms));
+                    }
+                    index.commit(key);
+                    if let Some(results) = results {
+                        results.insert(key, source.as_os_str(), result);
+                    }
                 }
-
+                None => index.forget(key),
             });
+
+            // Hand the image to a resident TEE worker; this blocks while the queue is full
+            // unless the pool is set to reject.
+            let mut job = Job::new(real, PRIORITY_NORMAL, done);
+            if let Some(conn) = streamed {
+                job = job.streamed(conn, key);
+            }
+            // The hash covers the file only if this handle wrote all of it.
+            if let Some((hash, len)) = hashed {
+                if len == key.size {
+                    job = job.with_content(hash, key);
+                }
+            }
+            if self.results.is_some() {
+                job = job.with_output();
+            }
+            if let Err(job) = self.pool.submit(job) {
+                let stats = self.pool.stats();
+                warn!(
+                    "TEE queue is full ({} queued, {} rejected), not processing {:?}",
+                    stats.depth, stats.rejected, path
+                );
+                (job.done)(None);
+            }
         } else {
-            info!("File is not a BMP file: {:?}", path);
+            info!("File was already processed: {:?}", path);
         }
 
         libc_wrappers::close(fh)
@@ -335,25 +647,39 @@ impl FilesystemMT for PassthroughFS {
         callback: impl FnOnce(ResultSlice<'_>) -> CallbackResult,
     ) -> CallbackResult {
         info!("read: {:?} {:#x} @ {:#x}", path, size, offset);
-        let mut file = unsafe { UnmanagedFile::new(fh) };
-
-        let mut data = Vec::<u8>::with_capacity(size as usize);
-
-        if let Err(e) = file.seek(SeekFrom::Start(offset)) {
-            error!("seek({:?}, {}): {}", path, offset, e);
-            return callback(Err(e.raw_os_error().unwrap()));
+        let _timer = self.stats.time(Op::Read);
+
+        if virtual_files::is_virtual(fh) {
+            let data = match self.virtual_files.data(fh) {
+                Some(data) => data,
+                None => return callback(Err(libc::EBADF)),
+            };
+            let start = (offset as usize).min(data.len());
+            let end = start.saturating_add(size as usize).min(data.len());
+            return callback(Ok(&data[start..end]));
         }
-        match file.read(unsafe { mem::transmute(data.spare_capacity_mut()) }) {
-            Ok(n) => {
-                unsafe { data.set_len(n) };
+        let file = unsafe { UnmanagedFile::new(fh) };
+
+        READ_BUF.with(|buf| {
+            let mut buf = buf.borrow_mut();
+            if buf.len() < size as usize {
+                buf.resize(size as usize, 0);
             }
-            Err(e) => {
-                error!("read {:?}, {:#x} @ {:#x}: {}", path, size, offset, e);
-                return callback(Err(e.raw_os_error().unwrap()));
+            let data = &mut buf[..size as usize];
+
+            // Positional read: requests on the same handle run on several threads, so they must
+            // not share the file offset.
+            match file.read_full_at(data, offset) {
+                Ok(n) => {
+                    self.stats.add_bytes(Op::Read, n as u64);
+                    callback(Ok(&data[..n]))
+                }
+                Err(e) => {
+                    error!("read {:?}, {:#x} @ {:#x}: {}", path, size, offset, e);
+                    callback(Err(e.raw_os_error().unwrap()))
+                }
             }
-        }
-
-        callback(Ok(&data))
+        })
     }
 
     fn write(
@@ -366,13 +692,10 @@ impl FilesystemMT for PassthroughFS {
         _flags: u32,
     ) -> ResultWrite {
         //info!("write: {:?} {:#x} @ {:#x}", path, data.len(), offset);
-        let mut file = unsafe { UnmanagedFile::new(fh) };
+        let _timer = self.stats.time(Op::Write);
+        let file = unsafe { UnmanagedFile::new(fh) };
 
-        if let Err(e) = file.seek(SeekFrom::Start(offset)) {
-            error!("seek({:?}, {}): {}", path, offset, e);
-            return Err(e.raw_os_error().unwrap());
-        }
-        let nwritten: u32 = match file.write(&data) {
+        let nwritten: u32 = match file.write_full_at(&data, offset) {
             Ok(n) => n as u32,
             Err(e) => {
                 error!("write {:?}, {:#x} @ {:#x}: {}", path, data.len(), offset, e);
@@ -380,11 +703,29 @@ impl FilesystemMT for PassthroughFS {
             }
         };
 
+        self.attrs.invalidate(path);
+        self.stats.add_bytes(Op::Write, u64::from(nwritten));
+
+        if let Some(streams) = &self.streams {
+            if is_image(path) {
+                let real = self.real_path(path);
+                streams.wrote(fh, path, &real, offset, &data[..nwritten as usize]);
+            }
+        }
+        if let Some(hashes) = &self.hashes {
+            if is_image(path) {
+                hashes.wrote(fh, path, offset, &data[..nwritten as usize]);
+            }
+        }
+
         Ok(nwritten)
     }
 
     fn flush(&self, _req: RequestInfo, path: &Path, fh: u64, _lock_owner: u64) -> ResultEmpty {
         info!("flush: {:?}", path);
+        if virtual_files::is_virtual(fh) {
+            return Ok(());
+        }
         let mut file = unsafe { UnmanagedFile::new(fh) };
 
         if let Err(e) = file.flush() {
@@ -397,6 +738,9 @@ impl FilesystemMT for PassthroughFS {
 
     fn fsync(&self, _req: RequestInfo, path: &Path, fh: u64, datasync: bool) -> ResultEmpty {
         info!("fsync: {:?}, data={:?}", path, datasync);
+        if virtual_files::is_virtual(fh) {
+            return Ok(());
+        }
         let file = unsafe { UnmanagedFile::new(fh) };
 
         if let Err(e) = if datasync {
@@ -423,6 +767,7 @@ impl FilesystemMT for PassthroughFS {
                 libc::chmod(path_c.as_ptr(), mode as libc::mode_t)
             }
         };
+        self.attrs.invalidate(path);
 
         if -1 == result {
             let e = io::Error::last_os_error();
@@ -454,6 +799,7 @@ impl FilesystemMT for PassthroughFS {
                 libc::chown(path_c.as_ptr(), uid, gid)
             }
         };
+        self.attrs.invalidate(path);
 
         if -1 == result {
             let e = io::Error::last_os_error();
@@ -467,6 +813,13 @@ impl FilesystemMT for PassthroughFS {
     fn truncate(&self, _req: RequestInfo, path: &Path, fh: Option<u64>, size: u64) -> ResultEmpty {
         info!("truncate: {:?} to {:#x}", path, size);
 
+        if let Some(streams) = &self.streams {
+            streams.abort(path);
+        }
+        if let Some(hashes) = &self.hashes {
+            hashes.forget(path);
+        }
+
         let result = if let Some(fd) = fh {
             unsafe { libc::ftruncate64(fd as libc::c_int, size as i64) }
         } else {
@@ -476,6 +829,7 @@ impl FilesystemMT for PassthroughFS {
                 libc::truncate64(path_c.as_ptr(), size as i64)
             }
         };
+        self.attrs.invalidate(path);
 
         if -1 == result {
             let e = io::Error::last_os_error();
@@ -534,6 +888,7 @@ impl FilesystemMT for PassthroughFS {
                 )
             }
         };
+        self.attrs.invalidate(path);
 
         if -1 == result {
             let e = io::Error::last_os_error();
@@ -575,6 +930,9 @@ impl FilesystemMT for PassthroughFS {
 
     fn fsyncdir(&self, _req: RequestInfo, path: &Path, fh: u64, datasync: bool) -> ResultEmpty {
         info!("fsyncdir: {:?} (datasync = {:?})", path, datasync);
+        if virtual_files::is_virtual(fh) {
+            return Ok(());
+        }
 
         // TODO: what does datasync mean with regards to a directory handle?
         let result = unsafe { libc::fsync(fh as libc::c_int) };
@@ -605,6 +963,7 @@ impl FilesystemMT for PassthroughFS {
             let path_c = CString::from_vec_unchecked(real.as_os_str().as_bytes().to_vec());
             libc::mknod(path_c.as_ptr(), mode as libc::mode_t, rdev as libc::dev_t)
         };
+        self.entry_changed(parent_path, name);
 
         if -1 == result {
             let e = io::Error::last_os_error();
@@ -612,7 +971,7 @@ impl FilesystemMT for PassthroughFS {
             Err(e.raw_os_error().unwrap())
         } else {
             match libc_wrappers::lstat(real.into_os_string()) {
-                Ok(attr) => Ok((TTL, stat_to_fuse(attr))),
+                Ok(attr) => Ok((self.attrs.ttl(), stat_to_fuse(attr))),
                 Err(e) => Err(e), // if this happens, yikes
             }
         }
@@ -626,6 +985,7 @@ impl FilesystemMT for PassthroughFS {
             let path_c = CString::from_vec_unchecked(real.as_os_str().as_bytes().to_vec());
             libc::mkdir(path_c.as_ptr(), mode as libc::mode_t)
         };
+        self.entry_changed(parent_path, name);
 
         if -1 == result {
             let e = io::Error::last_os_error();
@@ -633,7 +993,7 @@ impl FilesystemMT for PassthroughFS {
             Err(e.raw_os_error().unwrap())
         } else {
             match libc_wrappers::lstat(real.clone().into_os_string()) {
-                Ok(attr) => Ok((TTL, stat_to_fuse(attr))),
+                Ok(attr) => Ok((self.attrs.ttl(), stat_to_fuse(attr))),
                 Err(e) => {
                     error!("lstat after mkdir({:?}, {:#o}): {}", real, mode, e);
                     Err(e) // if this happens, yikes
@@ -646,20 +1006,24 @@ impl FilesystemMT for PassthroughFS {
         info!("unlink {:?}/{:?}", parent_path, name);
 
         let real = PathBuf::from(self.real_path(parent_path)).join(name);
-        fs::remove_file(&real).map_err(|ioerr| {
+        let result = fs::remove_file(&real).map_err(|ioerr| {
             error!("unlink({:?}): {}", real, ioerr);
             ioerr.raw_os_error().unwrap()
-        })
+        });
+        self.entry_changed(parent_path, name);
+        result
     }
 
     fn rmdir(&self, _req: RequestInfo, parent_path: &Path, name: &OsStr) -> ResultEmpty {
         info!("rmdir: {:?}/{:?}", parent_path, name);
 
         let real = PathBuf::from(self.real_path(parent_path)).join(name);
-        fs::remove_dir(&real).map_err(|ioerr| {
+        let result = fs::remove_dir(&real).map_err(|ioerr| {
             error!("rmdir({:?}): {}", real, ioerr);
             ioerr.raw_os_error().unwrap()
-        })
+        });
+        self.entry_changed(parent_path, name);
+        result
     }
 
     fn symlink(
@@ -672,9 +1036,11 @@ impl FilesystemMT for PassthroughFS {
         info!("symlink: {:?}/{:?} -> {:?}", parent_path, name, target);
 
         let real = PathBuf::from(self.real_path(parent_path)).join(name);
-        match std::os::unix::fs::symlink(target, &real) {
+        let result = std::os::unix::fs::symlink(target, &real);
+        self.entry_changed(parent_path, name);
+        match result {
             Ok(()) => match libc_wrappers::lstat(real.clone().into_os_string()) {
-                Ok(attr) => Ok((TTL, stat_to_fuse(attr))),
+                Ok(attr) => Ok((self.attrs.ttl(), stat_to_fuse(attr))),
                 Err(e) => {
                     error!("lstat after symlink({:?}, {:?}): {}", real, target, e);
                     Err(e)
@@ -702,10 +1068,19 @@ impl FilesystemMT for PassthroughFS {
 
         let real = PathBuf::from(self.real_path(parent_path)).join(name);
         let newreal = PathBuf::from(self.real_path(newparent_path)).join(newname);
-        fs::rename(&real, &newreal).map_err(|ioerr| {
+        let result = fs::rename(&real, &newreal).map_err(|ioerr| {
             error!("rename({:?}, {:?}): {}", real, newreal, ioerr);
             ioerr.raw_os_error().unwrap()
-        })
+        });
+
+        // A renamed directory takes everything below it along.
+        if fs::symlink_metadata(&newreal).map_or(false, |m| m.is_dir()) {
+            self.attrs.invalidate_tree(&parent_path.join(name));
+            self.attrs.invalidate_tree(&newparent_path.join(newname));
+        }
+        self.entry_changed(parent_path, name);
+        self.entry_changed(newparent_path, newname);
+        result
     }
 
     fn link(
@@ -719,9 +1094,12 @@ impl FilesystemMT for PassthroughFS {
 
         let real = self.real_path(path);
         let newreal = PathBuf::from(self.real_path(newparent)).join(newname);
-        match fs::hard_link(&real, &newreal) {
+        let result = fs::hard_link(&real, &newreal);
+        self.attrs.invalidate(path);
+        self.entry_changed(newparent, newname);
+        match result {
             Ok(()) => match libc_wrappers::lstat(real.clone()) {
-                Ok(attr) => Ok((TTL, stat_to_fuse(attr))),
+                Ok(attr) => Ok((self.attrs.ttl(), stat_to_fuse(attr))),
                 Err(e) => {
                     error!("lstat after link({:?}, {:?}): {}", real, newreal, e);
                     Err(e)
@@ -756,6 +1134,7 @@ impl FilesystemMT for PassthroughFS {
                 mode,
             )
         };
+        self.entry_changed(parent, name);
 
         if -1 == fd {
             let ioerr = io::Error::last_os_error();
@@ -779,10 +1158,10 @@ impl FilesystemMT for PassthroughFS {
 
             match libc_wrappers::lstat(real.clone().into_os_string()) {
                 Ok(attr) => Ok(CreatedEntry {
-                    ttl: TTL,
+                    ttl: self.attrs.ttl(),
                     attr: stat_to_fuse(attr),
                     fh: fd as u64,
-                    flags,
+                    flags: self.open_reply_flags(&Path::new(parent).join(name)),
                 }),
                 Err(e) => {
                     error!(
@@ -798,6 +1177,9 @@ impl FilesystemMT for PassthroughFS {
 
     fn listxattr(&self, _req: RequestInfo, path: &Path, size: u32) -> ResultXattr {
         info!("listxattr: {:?}", path);
+        if self.view_path(path).is_some() {
+            return Ok(if size > 0 { Xattr::Data(vec![]) } else { Xattr::Size(0) });
+        }
 
         let real = self.real_path(path);
 
@@ -816,6 +1198,9 @@ impl FilesystemMT for PassthroughFS {
 
     fn getxattr(&self, _req: RequestInfo, path: &Path, name: &OsStr, size: u32) -> ResultXattr {
         info!("getxattr: {:?} {:?} {}", path, name, size);
+        if self.view_path(path).is_some() {
+            return Err(libc::ENODATA);
+        }
 
         let real = self.real_path(path);
 
@@ -850,13 +1235,17 @@ impl FilesystemMT for PassthroughFS {
             position
         );
         let real = self.real_path(path);
-        libc_wrappers::lsetxattr(real, name.to_owned(), value, flags, position)
+        let result = libc_wrappers::lsetxattr(real, name.to_owned(), value, flags, position);
+        self.attrs.invalidate(path);
+        result
     }
 
     fn removexattr(&self, _req: RequestInfo, path: &Path, name: &OsStr) -> ResultEmpty {
         info!("removexattr: {:?} {:?}", path, name);
         let real = self.real_path(path);
-        libc_wrappers::lremovexattr(real, name.to_owned())
+        let result = libc_wrappers::lremovexattr(real, name.to_owned());
+        self.attrs.invalidate(path);
+        result
     }
 
     #[cfg(target_os = "macos")]
@@ -893,6 +1282,39 @@ impl UnmanagedFile {
     fn sync_data(&self) -> io::Result<()> {
         self.inner.as_ref().unwrap().sync_data()
     }
+    /// pread until `buf` is full or EOF. A short count from FUSE read means EOF to the kernel,
+    /// so a short pread must not be passed on as is.
+    fn read_full_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        let file = self.inner.as_ref().unwrap();
+        let mut done = 0;
+        while done < buf.len() {
+            match file.read_at(&mut buf[done..], offset + done as u64) {
+                Ok(0) => break,
+                Ok(n) => done += n,
+                Err(ref e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Err(e) if done == 0 => return Err(e),
+                Err(_) => break,
+            }
+        }
+        Ok(done)
+    }
+    /// pwrite all of `buf`, resuming after short writes. An error after a partial write reports
+    /// the bytes that made it.
+    fn write_full_at(&self, buf: &[u8], offset: u64) -> io::Result<usize> {
+        let file = self.inner.as_ref().unwrap();
+        let mut done = 0;
+        while done < buf.len() {
+            match file.write_at(&buf[done..], offset + done as u64) {
+                Ok(0) if done == 0 => return Err(io::Error::from_raw_os_error(libc::EIO)),
+                Ok(0) => break,
+                Ok(n) => done += n,
+                Err(ref e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Err(e) if done == 0 => return Err(e),
+                Err(_) => break,
+            }
+        }
+        Ok(done)
+    }
 }
 
 impl Drop for UnmanagedFile {
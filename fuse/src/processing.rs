@@ -0,0 +1,720 @@
+// Processing :: Resident pool of TEE workers for post-close image processing.
+//
+// Each worker either owns a long-lived `video_tee -s` child process or a connection to a
+// `video_tee -d` daemon. Both keep the TEE context and session open, so a job only pays for the
+// TA invocation instead of sudo + exec + session setup.
+//
+// Jobs reach the workers through a bounded priority queue. When it is full, producers either
+// block (backpressure on close()) or are turned away, and at most `max_in_flight` jobs are
+// handed to the TEE at once.
+//
+// With a dedup cache (see dedup.rs) a worker first looks up the hash of the image and hands a
+// copy of content processed before the earlier result, without invoking the TA.
+//
+
+use std::cmp::Ordering;
+use std::collections::BinaryHeap;
+use std::fs::File;
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::AsRawFd;
+use std::os::unix::net::UnixStream;
+use std::path::{Path, PathBuf};
+use std::process::{Child, ChildStdin, ChildStdout, Command, Stdio};
+use std::sync::atomic::{self, AtomicU64};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crate::dedup::{hash_file, ContentHash, DedupCache};
+use crate::index::FileKey;
+use crate::libc_wrappers;
+use crate::logger;
+use crate::stream::VT_JOB_STREAM_END;
+
+/// Default number of resident TEE workers.
+pub const DEFAULT_WORKERS: usize = 2;
+
+/// Default number of jobs that may wait in the queue.
+pub const DEFAULT_QUEUE_DEPTH: usize = 1024;
+
+/// Priority of a freshly closed image.
+pub const PRIORITY_NORMAL: u32 = 1;
+
+/// Priority of a job retried after its TEE session broke; fresh frames go first.
+const PRIORITY_RETRY: u32 = 0;
+
+/// Attempts per job before it is given up.
+const MAX_ATTEMPTS: u32 = 3;
+
+/// ID of the next job, for telling the records of its attempts apart from other jobs'.
+static NEXT_JOB_ID: AtomicU64 = AtomicU64::new(1);
+
+/// File the per-image timings reported by `video_tee` are appended to.
+const TIMING_LOG: &str = "TA_timing_log.txt";
+
+/// File the per-job queue depth and wait time are appended to.
+const QUEUE_LOG: &str = "queue_log.txt";
+
+// Job types, flags and limits as defined in videoTEE/host/include/video_tee_daemon.h.
+const VT_JOB_PATH: u32 = 0;
+const VT_JOB_FD: u32 = 1;
+const VT_JOB_LOAD: u32 = 5;
+const VT_JOB_WANT_OUTPUT: u32 = 0x100;
+const VT_MAX_PATH: usize = 4096;
+
+/// Size of a signed_res_t: SHA-256 digest, then the ECDSA P-256 signature. A frame the daemon
+/// processed in a batch has a longer batch_proof_t, which starts with one.
+pub const ATTESTATION_SIZE: usize = 32 + 64;
+
+/// A single image waiting to be processed.
+pub struct Job {
+    /// Stamped on the log records of the job, across retries.
+    pub id: u64,
+    /// Path of the backing file, so processing reads it without going through the mount. Not
+    /// necessarily UTF-8.
+    pub path: PathBuf,
+    /// Higher runs first; equal priorities run in submission order.
+    pub priority: u32,
+    /// Called once when the job is finished or dropped, with its result if it succeeded.
+    pub done: Box<dyn FnOnce(Option<JobResult>) + Send>,
+    /// Have the daemon send the processed image back with the result.
+    want_output: bool,
+    /// Daemon connection the image was streamed on while written, if it was (see stream.rs), and
+    /// the version of the file the stream covers.
+    stream: Option<(UnixStream, FileKey)>,
+    /// Hash of the image taken while it was written, and the version of the file it covers.
+    content: Option<(ContentHash, FileKey)>,
+    attempts: u32,
+}
+
+impl Job {
+    pub fn new(
+        path: PathBuf,
+        priority: u32,
+        done: Box<dyn FnOnce(Option<JobResult>) + Send>,
+    ) -> Job {
+        Job {
+            id: NEXT_JOB_ID.fetch_add(1, atomic::Ordering::Relaxed),
+            path,
+            priority,
+            done,
+            want_output: false,
+            stream: None,
+            content: None,
+            attempts: 0,
+        }
+    }
+
+    /// Version `key` of the image was already streamed to the daemon on `conn`; only its
+    /// signature is missing.
+    pub fn streamed(mut self, conn: UnixStream, key: FileKey) -> Job {
+        self.stream = Some((conn, key));
+        self
+    }
+
+    /// The content of version `key` of the file hashes to `hash`, for the dedup cache.
+    pub fn with_content(mut self, hash: ContentHash, key: FileKey) -> Job {
+        self.content = Some((hash, key));
+        self
+    }
+
+    /// Ask for the processed image too (daemon backend only).
+    pub fn with_output(mut self) -> Job {
+        self.want_output = true;
+        self
+    }
+}
+
+/// What `submit` does when the queue is full.
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub enum Overflow {
+    /// Wait for room, pushing back on the producer.
+    Block,
+    /// Fail right away, handing the job back.
+    Reject,
+}
+
+/// Sizing of the job queue.
+#[derive(Clone, Copy)]
+pub struct QueueConfig {
+    pub depth: usize,
+    pub max_in_flight: usize,
+    pub overflow: Overflow,
+}
+
+/// Snapshot of the queue counters, for sizing a deployment.
+#[derive(Clone, Copy, Default, Debug)]
+pub struct QueueStats {
+    pub depth: usize,
+    pub max_depth: usize,
+    pub in_flight: usize,
+    pub submitted: u64,
+    pub rejected: u64,
+    pub started: u64,
+    pub total_wait: Duration,
+    pub max_wait: Duration,
+    /// Jobs answered from the dedup cache, and jobs looked up there in vain.
+    pub dedup_hits: u64,
+    pub dedup_misses: u64,
+}
+
+struct Queued {
+    priority: u32,
+    seq: u64,
+    enqueued: Instant,
+    job: Job,
+}
+
+impl Ord for Queued {
+    fn cmp(&self, other: &Self) -> Ordering {
+        // Max-heap: higher priority first, then the older submission
+        self.priority
+            .cmp(&other.priority)
+            .then_with(|| other.seq.cmp(&self.seq))
+    }
+}
+
+impl PartialOrd for Queued {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl PartialEq for Queued {
+    fn eq(&self, other: &Self) -> bool {
+        self.seq == other.seq
+    }
+}
+
+impl Eq for Queued {}
+
+struct QueueState {
+    heap: BinaryHeap<Queued>,
+    seq: u64,
+    closed: bool,
+    stats: QueueStats,
+}
+
+/// Bounded priority queue between release() and the TEE workers.
+struct JobQueue {
+    config: QueueConfig,
+    state: Mutex<QueueState>,
+    /// Signalled when a job is queued or an in-flight slot frees up.
+    runnable: Condvar,
+    /// Signalled when a queued job is taken.
+    not_full: Condvar,
+}
+
+impl JobQueue {
+    fn new(config: QueueConfig) -> JobQueue {
+        JobQueue {
+            config,
+            state: Mutex::new(QueueState {
+                heap: BinaryHeap::new(),
+                seq: 0,
+                closed: false,
+                stats: QueueStats::default(),
+            }),
+            runnable: Condvar::new(),
+            not_full: Condvar::new(),
+        }
+    }
+
+    fn push(&self, job: Job, overflow: Overflow) -> Result<(), Job> {
+        let mut state = self.state.lock().unwrap();
+        while state.heap.len() >= self.config.depth && !state.closed {
+            if overflow == Overflow::Reject {
+                state.stats.rejected += 1;
+                return Err(job);
+            }
+            state = self.not_full.wait(state).unwrap();
+        }
+        if state.closed {
+            return Err(job);
+        }
+
+        let seq = state.seq;
+        state.seq += 1;
+        state.heap.push(Queued {
+            priority: job.priority,
+            seq,
+            enqueued: Instant::now(),
+            job,
+        });
+        state.stats.submitted += 1;
+        state.stats.depth = state.heap.len();
+        state.stats.max_depth = state.stats.max_depth.max(state.heap.len());
+        drop(state);
+
+        self.runnable.notify_one();
+        Ok(())
+    }
+
+    /// Take the most urgent job once an in-flight slot is free, with the time it waited and
+    /// the queue depth left behind. None once the queue is closed.
+    fn pop(&self) -> Option<(Job, Duration, usize)> {
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if state.closed {
+                return None;
+            }
+            if !state.heap.is_empty() && state.stats.in_flight < self.config.max_in_flight {
+                break;
+            }
+            state = self.runnable.wait(state).unwrap();
+        }
+
+        let queued = state.heap.pop().unwrap();
+        let wait = queued.enqueued.elapsed();
+        let depth = state.heap.len();
+        let stats = &mut state.stats;
+        stats.in_flight += 1;
+        stats.started += 1;
+        stats.total_wait += wait;
+        stats.max_wait = stats.max_wait.max(wait);
+        stats.depth = depth;
+        drop(state);
+
+        self.not_full.notify_one();
+        Some((queued.job, wait, depth))
+    }
+
+    /// An in-flight job finished.
+    fn finish(&self) {
+        self.state.lock().unwrap().stats.in_flight -= 1;
+        self.runnable.notify_one();
+    }
+
+    fn close(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.closed = true;
+        let dropped: Vec<_> = state.heap.drain().collect();
+        drop(state);
+
+        self.runnable.notify_all();
+        self.not_full.notify_all();
+        for queued in dropped {
+            (queued.job.done)(None);
+        }
+    }
+
+    fn stats(&self) -> QueueStats {
+        self.state.lock().unwrap().stats
+    }
+}
+
+/// Where the workers get their TEE session from.
+#[derive(Clone)]
+pub enum Backend {
+    /// Spawn `sudo <binary> -s` per worker.
+    Spawn(String),
+    /// Connect to a `video_tee -d` daemon listening on this socket.
+    Daemon(PathBuf),
+}
+
+/// Outcome of one job as reported by `video_tee`.
+pub struct JobResult {
+    pub took_ms: u64,
+    /// The signed_res_t; empty from a `video_tee -s` child, which does not report it.
+    pub attestation: Vec<u8>,
+    /// The processed image, packed top-down, if it was asked for and the daemon had it.
+    pub pixels: Option<Vec<u8>>,
+    /// Answered from the dedup cache: the TA did not run, and took_ms is 0.
+    pub dedup: bool,
+}
+
+/// Pool of workers, each holding an open TEE session, fed from a shared job queue.
+pub struct TeePool {
+    queue: Arc<JobQueue>,
+    dedup: Option<Arc<DedupCache>>,
+}
+
+impl TeePool {
+    pub fn new(
+        workers: usize,
+        backend: Backend,
+        config: QueueConfig,
+        dedup: Option<Arc<DedupCache>>,
+    ) -> TeePool {
+        let queue = Arc::new(JobQueue::new(QueueConfig {
+            depth: config.depth.max(1),
+            max_in_flight: config.max_in_flight.max(1),
+            overflow: config.overflow,
+        }));
+
+        for id in 0..workers.max(1) {
+            let queue = Arc::clone(&queue);
+            let backend = backend.clone();
+            let dedup = dedup.clone();
+            thread::Builder::new()
+                .name(format!("tee-worker-{}", id))
+                .spawn(move || worker_loop(id, queue, backend, dedup))
+                .expect("Failed to spawn TEE worker thread");
+        }
+
+        TeePool { queue, dedup }
+    }
+
+    /// Queue a job. With `Overflow::Block` this waits for room; with `Overflow::Reject` a full
+    /// queue hands the job back right away (the EAGAIN case).
+    pub fn submit(&self, job: Job) -> Result<(), Job> {
+        self.queue.push(job, self.queue.config.overflow)
+    }
+
+    pub fn stats(&self) -> QueueStats {
+        let mut stats = self.queue.stats();
+        if let Some(dedup) = &self.dedup {
+            let dedup = dedup.stats();
+            stats.dedup_hits = dedup.hits;
+            stats.dedup_misses = dedup.misses;
+        }
+        stats
+    }
+}
+
+impl Drop for TeePool {
+    fn drop(&mut self) {
+        self.queue.close();
+    }
+}
+
+/// A worker's open TEE session.
+enum TeeWorker {
+    /// `video_tee -s` child: one image path per line in, one result line out.
+    Child {
+        child: Child,
+        stdin: ChildStdin,
+        stdout: BufReader<ChildStdout>,
+    },
+    /// Connection to `video_tee -d`, speaking the protocol in video_tee_daemon.h.
+    Daemon(UnixStream),
+}
+
+impl TeeWorker {
+    fn connect(backend: &Backend) -> io::Result<TeeWorker> {
+        match backend {
+            Backend::Spawn(binary) => {
+                let mut child = Command::new("sudo")
+                    .arg(binary)
+                    .arg("-s")
+                    .stdin(Stdio::piped())
+                    .stdout(Stdio::piped())
+                    .spawn()?;
+
+                let stdin = child.stdin.take().unwrap();
+                let stdout = BufReader::new(child.stdout.take().unwrap());
+
+                Ok(TeeWorker::Child {
+                    child,
+                    stdin,
+                    stdout,
+                })
+            }
+            Backend::Daemon(socket) => Ok(TeeWorker::Daemon(UnixStream::connect(socket)?)),
+        }
+    }
+
+    /// Run one job. The outer error means the session is broken and must be reopened; the inner
+    /// one is a job that failed on a healthy session.
+    fn process(
+        &mut self,
+        path: &Path,
+        want_output: bool,
+    ) -> io::Result<Result<JobResult, String>> {
+        match self {
+            TeeWorker::Child { stdin, stdout, .. } => {
+                // One path per line: a newline in the name would split it into two jobs and
+                // leave every later reply on this session answering the wrong one.
+                let path = path.as_os_str().as_bytes();
+                if path.contains(&b'\n') {
+                    return Ok(Err("path contains a newline".to_owned()));
+                }
+                stdin.write_all(path)?;
+                stdin.write_all(b"\n")?;
+                stdin.flush()?;
+
+                let mut line = String::new();
+                if stdout.read_line(&mut line)? == 0 {
+                    return Err(io::Error::new(
+                        io::ErrorKind::UnexpectedEof,
+                        "video_tee exited",
+                    ));
+                }
+                let line = line.trim_end();
+                Ok(match line.strip_prefix("Took: ").map(str::parse) {
+                    Some(Ok(took_ms)) => Ok(JobResult {
+                        took_ms,
+                        attestation: vec![],
+                        pixels: None,
+                        dedup: false,
+                    }),
+                    _ => Err(line.to_owned()),
+                })
+            }
+            TeeWorker::Daemon(stream) => {
+                // Hand the daemon an open descriptor of the backing file, so it neither resolves
+                // the path from its own working directory nor reads through the mount. Fall back
+                // to sending the path if we cannot open it ourselves.
+                let flags = if want_output { VT_JOB_WANT_OUTPUT } else { 0 };
+                match File::open(path) {
+                    Ok(file) => send_fd_job(stream, &file, flags)?,
+                    Err(e) => {
+                        warn!("open({:?}): {}, sending the path instead", path, e);
+
+                        let path = path.as_os_str().as_bytes();
+                        if path.is_empty() || path.len() > VT_MAX_PATH {
+                            return Ok(Err(format!("bad path length {}", path.len())));
+                        }
+
+                        let mut req = Vec::with_capacity(8 + path.len());
+                        req.extend_from_slice(&(VT_JOB_PATH | flags).to_ne_bytes());
+                        req.extend_from_slice(&(path.len() as u32).to_ne_bytes());
+                        req.extend_from_slice(path);
+                        stream.write_all(&req)?;
+                    }
+                }
+
+                read_reply(stream, want_output)
+            }
+        }
+    }
+}
+
+/// Send a VT_JOB_FD request for `file`.
+fn send_fd_job(mut conn: &UnixStream, file: &File, flags: u32) -> io::Result<()> {
+    let mut req = [0u8; 8];
+    req[..4].copy_from_slice(&(VT_JOB_FD | flags).to_ne_bytes());
+    let sent = libc_wrappers::send_fd(conn.as_raw_fd(), &req, file.as_raw_fd())
+        .map_err(io::Error::from_raw_os_error)?;
+    conn.write_all(&req[sent..])
+}
+
+/// Read a vt_job_rep_t (status, took_us, res_size) and the signed result after it, then the
+/// processed image if the request asked for it.
+fn read_reply(
+    mut stream: &UnixStream,
+    want_output: bool,
+) -> io::Result<Result<JobResult, String>> {
+    let mut rep = [0u8; 12];
+    stream.read_exact(&mut rep)?;
+    let field = |i: usize| u32::from_ne_bytes(rep[4 * i..4 * i + 4].try_into().unwrap());
+    let (status, took_us, res_size) = (field(0), field(1), field(2));
+
+    let mut attestation = vec![0u8; res_size as usize];
+    stream.read_exact(&mut attestation)?;
+
+    let mut pixels = None;
+    if want_output {
+        let mut size = [0u8; 4];
+        stream.read_exact(&mut size)?;
+        let mut out = vec![0u8; u32::from_ne_bytes(size) as usize];
+        stream.read_exact(&mut out)?;
+        if !out.is_empty() {
+            pixels = Some(out);
+        }
+    }
+
+    Ok(if status == 0 {
+        Ok(JobResult {
+            took_ms: u64::from(took_us) / 1000,
+            attestation,
+            pixels,
+            dedup: false,
+        })
+    } else {
+        Err(format!("TA invocation failed with code {:#x}", status))
+    })
+}
+
+/// Ask the daemon to sign an image streamed on `conn`.
+fn finish_stream(mut conn: &UnixStream, want_output: bool) -> io::Result<Result<JobResult, String>> {
+    let flags = if want_output { VT_JOB_WANT_OUTPUT } else { 0 };
+    let mut req = [0u8; 8];
+    req[..4].copy_from_slice(&(VT_JOB_STREAM_END | flags).to_ne_bytes());
+    conn.write_all(&req)?;
+    read_reply(conn, want_output)
+}
+
+/// Process `file` on a daemon connection of the caller's own and return the processed image
+/// with its attestation, outside the job queue.
+pub fn process_now(conn: &UnixStream, file: &File) -> io::Result<Result<JobResult, String>> {
+    send_fd_job(conn, file, VT_JOB_WANT_OUTPUT)?;
+    read_reply(conn, true)
+}
+
+/// Fetch the processed image the TA stored under `digest` from the daemon.
+pub fn load_output(mut conn: &UnixStream, digest: &[u8]) -> io::Result<Result<Vec<u8>, String>> {
+    let mut req = Vec::with_capacity(8 + digest.len());
+    req.extend_from_slice(&VT_JOB_LOAD.to_ne_bytes());
+    req.extend_from_slice(&(digest.len() as u32).to_ne_bytes());
+    req.extend_from_slice(digest);
+    conn.write_all(&req)?;
+
+    Ok(match read_reply(conn, true)? {
+        Ok(JobResult {
+            pixels: Some(pixels),
+            ..
+        }) => Ok(pixels),
+        Ok(_) => Err("no image stored".to_owned()),
+        Err(msg) => Err(msg),
+    })
+}
+
+impl Drop for TeeWorker {
+    fn drop(&mut self) {
+        // Reap the child so it does not linger as a zombie.
+        if let TeeWorker::Child { child, .. } = self {
+            let _ = child.kill();
+            let _ = child.wait();
+        }
+    }
+}
+
+fn worker_loop(id: usize, queue: Arc<JobQueue>, backend: Backend, dedup: Option<Arc<DedupCache>>) {
+    let mut worker: Option<TeeWorker> = None;
+
+    while let Some((mut job, wait, depth)) = queue.pop() {
+        logger::set_job(Some(job.id));
+        let stats = queue.stats();
+        logger::write(
+            QUEUE_LOG,
+            format!(
+                "\"wait_ms\":{},\"depth\":{},\"in_flight\":{},\"max_depth\":{},\
+                 \"max_wait_ms\":{},\"rejected\":{}",
+                wait.as_millis(),
+                depth,
+                stats.in_flight,
+                stats.max_depth,
+                stats.max_wait.as_millis(),
+                stats.rejected
+            ),
+        );
+
+        // Content processed before gets the earlier result. A hash is only trusted while the
+        // file is the version it was taken of, up to when the TA is done with it. Streamed
+        // images are only remembered: the daemon has already done most of the work on them.
+        let mut content = None;
+        if let Some(dedup) = &dedup {
+            content = job
+                .content
+                .take()
+                .filter(|(_, key)| FileKey::of(&job.path) == Some(*key));
+            if content.is_none() && job.stream.is_none() {
+                let key = FileKey::of(&job.path);
+                match hash_file(&job.path) {
+                    Ok(hash) => content = key.map(|key| (hash, key)),
+                    Err(e) => warn!("tee-worker-{}: hashing {:?}: {}", id, job.path, e),
+                }
+            }
+
+            let earlier = match (&content, &job.stream) {
+                (Some((hash, _)), None) => dedup.lookup(hash),
+                _ => None,
+            };
+            if let Some(result) = earlier {
+                queue.finish();
+                info!("tee-worker-{}: {:?} was processed before", id, job.path);
+                logger::write(
+                    TIMING_LOG,
+                    format!(
+                        "\"path\":{},\"took_ms\":{},\"dedup\":true",
+                        logger::json_str(&job.path.to_string_lossy()),
+                        result.took_ms
+                    ),
+                );
+                (job.done)(Some(result));
+                continue;
+            }
+        }
+
+        // (Re)open the session lazily, so a crashed session does not take the worker down.
+        if worker.is_none() {
+            match TeeWorker::connect(&backend) {
+                Ok(w) => worker = Some(w),
+                Err(e) => error!("tee-worker-{}: failed to open TEE session: {}", id, e),
+            }
+        }
+
+        let started = Instant::now();
+
+        // A streamed image only needs signing. If that fails (another file held the daemon's
+        // stream, or the connection dropped) or the file is no longer the version that was
+        // streamed, process it as a whole.
+        let want_output = job.want_output;
+        let streamed = job.stream.take().and_then(|(conn, key)| {
+            match finish_stream(&conn, want_output) {
+                Ok(Ok(result)) if FileKey::of(&job.path) == Some(key) => Some(result),
+                Ok(Ok(_)) => {
+                    info!("tee-worker-{}: {:?} changed after it was streamed", id, job.path);
+                    None
+                }
+                Ok(Err(msg)) => {
+                    info!("tee-worker-{}: stream of {:?} not signed: {}", id, job.path, msg);
+                    None
+                }
+                Err(e) => {
+                    warn!("tee-worker-{}: stream of {:?}: {}", id, job.path, e);
+                    None
+                }
+            }
+        });
+
+        let outcome = match (streamed, worker.as_mut()) {
+            (Some(result), _) => Ok(Ok(result)),
+            (None, Some(w)) => w.process(&job.path, job.want_output),
+            (None, None) => Err(io::Error::new(io::ErrorKind::NotConnected, "no TEE session")),
+        };
+        let total = started.elapsed();
+        queue.finish();
+
+        match outcome {
+            Ok(Ok(result)) => {
+                // took_ms is the TA invocation alone; total_ms adds loading the image and the
+                // round trip to video_tee.
+                info!(
+                    "tee-worker-{}: {:?} took {} ms, {} ms in total",
+                    id,
+                    job.path,
+                    result.took_ms,
+                    total.as_millis()
+                );
+                logger::write(
+                    TIMING_LOG,
+                    format!(
+                        "\"path\":{},\"took_ms\":{},\"total_ms\":{}",
+                        logger::json_str(&job.path.to_string_lossy()),
+                        result.took_ms,
+                        total.as_millis()
+                    ),
+                );
+                if let (Some(dedup), Some((hash, key))) = (&dedup, content) {
+                    if FileKey::of(&job.path) == Some(key) {
+                        dedup.insert(hash, &result);
+                    }
+                }
+                (job.done)(Some(result));
+            }
+            Ok(Err(msg)) => {
+                warn!("tee-worker-{}: {:?}: {}", id, job.path, msg);
+                (job.done)(None);
+            }
+            Err(e) => {
+                error!("tee-worker-{}: {:?}: {}", id, job.path, e);
+                worker = None;
+
+                // Retry behind fresh frames, without blocking the worker on a full queue.
+                job.attempts += 1;
+                if job.attempts < MAX_ATTEMPTS {
+                    job.priority = PRIORITY_RETRY;
+                    if let Err(job) = queue.push(job, Overflow::Reject) {
+                        (job.done)(None);
+                    }
+                } else {
+                    (job.done)(None);
+                }
+            }
+        }
+    }
+}
+
@@ -0,0 +1,285 @@
+// Results :: Processed images and their attestations, served read-only under `/.processed`.
+//
+// `/.processed/<path>` is the processed image of `<path>` as a BMP file and
+// `/.processed/<path>.att` its attestation (a signed_res_t, or for a frame the daemon processed in a
+// batch a batch_proof_t, which starts with one). Both come from an in-memory LRU keyed
+// by the version of the source file, filled as jobs finish, so reading them costs no TEE
+// invocation. When an image has been evicted, or was never sent (streamed files), but its
+// attestation is still known, it is reloaded from the TA's secure storage by digest. A file with
+// no result at all is processed on demand.
+//
+
+use std::ffi::OsStr;
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+use std::os::unix::net::UnixStream;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+
+use crate::bmp::{self, Layout};
+use crate::index::FileKey;
+use crate::libc_extras::libc;
+use crate::lru::Lru;
+use crate::processing::{self, JobResult, ATTESTATION_SIZE};
+
+/// Name of the view in the root of the mount. Hidden from directory listings.
+pub const VIEW_DIR: &str = ".processed";
+
+/// Suffix of the attestation next to each processed image.
+pub const ATTESTATION_SUFFIX: &str = ".att";
+
+/// Default size of the cache, in MiB.
+pub const DEFAULT_CACHE_MB: usize = 64;
+
+/// The two files the view has for each source image.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum ViewFile {
+    Image,
+    Attestation,
+}
+
+struct Entry {
+    attestation: Arc<Vec<u8>>,
+    /// The processed image as a BMP file.
+    image: Option<Arc<Vec<u8>>>,
+}
+
+impl Entry {
+    fn cost(&self) -> usize {
+        self.attestation.len() + self.image.as_ref().map_or(0, |image| image.len())
+    }
+}
+
+/// Results in least recently used order, and the bytes they hold.
+#[derive(Default)]
+struct Results {
+    entries: Lru<FileKey, Entry>,
+    bytes: usize,
+}
+
+impl Results {
+    fn touch(&mut self, key: &FileKey) -> Option<&Entry> {
+        self.entries.touch(key)
+    }
+
+    fn put(&mut self, key: FileKey, attestation: Arc<Vec<u8>>, image: Option<Arc<Vec<u8>>>) {
+        let entry = Entry { attestation, image };
+        self.bytes += entry.cost();
+        if let Some(old) = self.entries.insert(key, entry) {
+            self.bytes -= old.cost();
+        }
+    }
+
+    /// Shrink to `capacity` bytes. Images go first, oldest first; an attestation is small and
+    /// lets the image be reloaded without reprocessing, so it is only dropped if that is not
+    /// enough.
+    fn trim(&mut self, capacity: usize) {
+        let bytes = &mut self.bytes;
+        self.entries.for_each_oldest(|entry| {
+            if *bytes <= capacity {
+                return false;
+            }
+            if let Some(image) = entry.image.take() {
+                *bytes -= image.len();
+            }
+            true
+        });
+
+        while self.bytes > capacity {
+            match self.entries.pop_oldest() {
+                Some((_, entry)) => self.bytes -= entry.cost(),
+                None => return,
+            }
+        }
+    }
+}
+
+pub struct ResultCache {
+    /// Socket of the `video_tee -d` daemon images are loaded and processed through.
+    socket: PathBuf,
+    capacity: usize,
+    lru: Mutex<Results>,
+    /// Bytes per pixel of the daemon's output format, learned from the first image it returns.
+    bpp: AtomicUsize,
+}
+
+/// Where the pixel rows of the BMP at `real` are.
+fn read_layout(real: &OsStr) -> Option<Layout> {
+    let mut hdr = [0u8; bmp::HEADER_SIZE];
+    let file = File::open(real).ok()?;
+    file.read_exact_at(&mut hdr, 0).ok()?;
+    Layout::parse(&hdr)
+}
+
+impl ResultCache {
+    pub fn new(socket: PathBuf, capacity: usize) -> ResultCache {
+        ResultCache {
+            socket,
+            capacity,
+            lru: Mutex::new(Results::default()),
+            bpp: AtomicUsize::new(1),
+        }
+    }
+
+    /// Keep the result of a finished job on version `key` of the file at `real`.
+    pub fn insert(&self, key: FileKey, real: &OsStr, result: JobResult) {
+        if result.attestation.len() < ATTESTATION_SIZE {
+            return;
+        }
+        let image = result.pixels.and_then(|pixels| self.encode(real, &pixels));
+
+        let mut lru = self.lru.lock().unwrap();
+        lru.put(key, Arc::new(result.attestation), image.map(Arc::new));
+        lru.trim(self.capacity);
+    }
+
+    /// Turn the processed pixels of the image at `real` into a BMP file.
+    fn encode(&self, real: &OsStr, pixels: &[u8]) -> Option<Vec<u8>> {
+        let layout = read_layout(real)?;
+        let bpp = pixels.len() / layout.pixels();
+        if (bpp != 1 && bpp != 3) || pixels.len() != bpp * layout.pixels() {
+            warn!(
+                "results: {:?}: {} bytes is not a processed image",
+                real,
+                pixels.len()
+            );
+            return None;
+        }
+        self.bpp.store(bpp, Ordering::Relaxed);
+        Some(bmp::encode(layout.width, layout.height, bpp, pixels))
+    }
+
+    /// Size of `which` for version `key` of `real`, without producing it. None if `real` is not
+    /// an image the TA can process. Only a guess for a result not cached yet: its attestation is
+    /// assumed not to come from a batch, and its image to have the bytes per pixel of the last
+    /// one encoded (gray before the first). The view is opened with direct I/O because of this.
+    pub fn size(&self, key: FileKey, real: &OsStr, which: ViewFile) -> Option<u64> {
+        let lru = self.lru.lock().unwrap();
+        let entry = lru.entries.peek(&key);
+        if which == ViewFile::Attestation {
+            let size = entry.map_or(ATTESTATION_SIZE, |entry| entry.attestation.len());
+            return Some(size as u64);
+        }
+
+        let cached = entry.and_then(|entry| entry.image.as_ref().map(|image| image.len() as u64));
+        drop(lru);
+        cached.or_else(|| {
+            let layout = read_layout(real)?;
+            let bpp = self.bpp.load(Ordering::Relaxed);
+            Some(bmp::encoded_size(layout.width, layout.height, bpp) as u64)
+        })
+    }
+
+    /// Contents of `which` for version `key` of `real`.
+    pub fn fetch(
+        &self,
+        key: FileKey,
+        real: &OsStr,
+        which: ViewFile,
+    ) -> Result<Arc<Vec<u8>>, libc::c_int> {
+        let attestation = match self.lru.lock().unwrap().touch(&key) {
+            Some(entry) => match (which, &entry.image) {
+                (ViewFile::Attestation, _) => return Ok(Arc::clone(&entry.attestation)),
+                (ViewFile::Image, Some(image)) => return Ok(Arc::clone(image)),
+                (ViewFile::Image, None) => Some(Arc::clone(&entry.attestation)),
+            },
+            None => None,
+        };
+
+        let conn = UnixStream::connect(&self.socket).map_err(|e| {
+            error!("results: cannot reach the TEE daemon: {}", e);
+            libc::EIO
+        })?;
+
+        // The attestation starts with the digest the TA stored the image under.
+        if let Some(attestation) = attestation {
+            match processing::load_output(&conn, &attestation[..32]) {
+                Ok(Ok(pixels)) => {
+                    if let Some(image) = self.encode(real, &pixels) {
+                        let image = Arc::new(image);
+                        let mut lru = self.lru.lock().unwrap();
+                        lru.put(key, attestation, Some(Arc::clone(&image)));
+                        lru.trim(self.capacity);
+                        return Ok(image);
+                    }
+                }
+                Ok(Err(msg)) => info!("results: {:?} not in secure storage: {}", real, msg),
+                Err(e) => {
+                    error!("results: loading {:?}: {}", real, e);
+                    return Err(libc::EIO);
+                }
+            }
+        }
+
+        // Nothing to go on: process the file now.
+        let file = File::open(real).map_err(|e| e.raw_os_error().unwrap_or(libc::EIO))?;
+        let result = match processing::process_now(&conn, &file) {
+            Ok(Ok(result)) => result,
+            Ok(Err(msg)) => {
+                error!("results: processing {:?}: {}", real, msg);
+                return Err(libc::EIO);
+            }
+            Err(e) => {
+                error!("results: processing {:?}: {}", real, e);
+                return Err(libc::EIO);
+            }
+        };
+
+        let attestation = Arc::new(result.attestation);
+        let image = result
+            .pixels
+            .and_then(|pixels| self.encode(real, &pixels))
+            .map(Arc::new);
+        let wanted = match which {
+            ViewFile::Attestation => Some(Arc::clone(&attestation)),
+            ViewFile::Image => image.clone(),
+        };
+        if attestation.len() >= ATTESTATION_SIZE {
+            let mut lru = self.lru.lock().unwrap();
+            lru.put(key, attestation, image);
+            lru.trim(self.capacity);
+        }
+        wanted.ok_or(libc::EIO)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn key(n: u64) -> FileKey {
+        FileKey {
+            ino: n,
+            size: 0,
+            mtime_ns: 0,
+        }
+    }
+
+    #[test]
+    fn trim_drops_images_before_attestations() {
+        let mut results = Results::default();
+        for n in 1..=3 {
+            let image = Some(Arc::new(vec![0u8; 1000]));
+            results.put(key(n), Arc::new(vec![0u8; 100]), image);
+        }
+        results.touch(&key(1));
+        assert_eq!(results.bytes, 3300);
+
+        // The images of 2 and 3 go, 1 was used last
+        results.trim(1300);
+        assert_eq!(results.bytes, 1300);
+        assert!(results.touch(&key(1)).unwrap().image.is_some());
+        assert!(results.touch(&key(2)).unwrap().image.is_none());
+
+        // Then whole results, oldest first
+        results.trim(150);
+        assert_eq!(results.bytes, 100);
+        assert!(results.touch(&key(3)).is_none());
+        assert!(results.touch(&key(2)).is_some());
+
+        // Replacing a result does not count it twice
+        results.put(key(2), Arc::new(vec![0u8; 96]), None);
+        assert_eq!(results.bytes, 96);
+    }
+}
@@ -0,0 +1,422 @@
+// Stats :: Per-operation counters and latency histograms, served read-only as `/.stats`.
+//
+// Every timed operation bumps a handful of relaxed atomics in its own cache line: a count, the
+// total and maximum latency, the bytes moved, and one bucket of a log-linear histogram (four
+// buckets per power of two of nanoseconds, so any value is within 25% of its bucket, as an HDR
+// histogram with two significant bits). Nothing takes a lock or allocates, so recording costs
+// two clock reads and a few relaxed adds on the read and write paths.
+//
+// `/.stats` renders a snapshot as JSON and `/.stats.prom` in the Prometheus text format, with the
+// TEE queue and dedup counters alongside. Neither shows up in directory listings.
+//
+
+use std::fmt::Write;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use crate::processing::QueueStats;
+
+/// Name of the JSON snapshot in the root of the mount.
+pub const STATS_JSON: &str = ".stats";
+
+/// Name of the Prometheus snapshot in the root of the mount.
+pub const STATS_PROM: &str = ".stats.prom";
+
+/// Timed operations.
+#[derive(Clone, Copy)]
+pub enum Op {
+    Getattr,
+    Open,
+    Read,
+    Write,
+    Release,
+    /// A processing job, from the close that queued it until its result.
+    Job,
+    /// The TA invocation of a job, as reported by the TEE side.
+    Tee,
+}
+
+const OPS: [(Op, &str); 7] = [
+    (Op::Getattr, "getattr"),
+    (Op::Open, "open"),
+    (Op::Read, "read"),
+    (Op::Write, "write"),
+    (Op::Release, "release"),
+    (Op::Job, "job"),
+    (Op::Tee, "tee"),
+];
+
+/// Sub-buckets per power of two.
+const SUB_BITS: u32 = 2;
+const SUBS: usize = 1 << SUB_BITS;
+
+/// Enough buckets for any u64 number of nanoseconds.
+const BUCKETS: usize = (64 - SUB_BITS as usize + 1) * SUBS;
+
+/// Bucket of a latency of `ns` nanoseconds.
+fn bucket(ns: u64) -> usize {
+    if ns < SUBS as u64 {
+        return ns as usize;
+    }
+    let exp = 63 - ns.leading_zeros();
+    let sub = (ns >> (exp - SUB_BITS)) as usize & (SUBS - 1);
+    (exp - SUB_BITS + 1) as usize * SUBS + sub
+}
+
+/// Smallest latency that falls in bucket `i`.
+fn bucket_floor(i: usize) -> u64 {
+    if i < SUBS {
+        return i as u64;
+    }
+    let exp = (i / SUBS) as u32 + SUB_BITS - 1;
+    ((SUBS + i % SUBS) as u64) << (exp - SUB_BITS)
+}
+
+/// Counters of one operation, in a cache line of its own so operations do not contend.
+#[repr(align(64))]
+struct OpStats {
+    count: AtomicU64,
+    total_ns: AtomicU64,
+    max_ns: AtomicU64,
+    bytes: AtomicU64,
+    buckets: [AtomicU64; BUCKETS],
+}
+
+impl OpStats {
+    fn new() -> OpStats {
+        OpStats {
+            count: AtomicU64::new(0),
+            total_ns: AtomicU64::new(0),
+            max_ns: AtomicU64::new(0),
+            bytes: AtomicU64::new(0),
+            buckets: std::array::from_fn(|_| AtomicU64::new(0)),
+        }
+    }
+
+    fn record(&self, ns: u64) {
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.total_ns.fetch_add(ns, Ordering::Relaxed);
+        self.max_ns.fetch_max(ns, Ordering::Relaxed);
+        self.buckets[bucket(ns)].fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+/// A copy of the counters of one operation.
+struct Snapshot {
+    count: u64,
+    total_ns: u64,
+    max_ns: u64,
+    bytes: u64,
+    buckets: Vec<u64>,
+}
+
+impl Snapshot {
+    /// Latency below which `q` of the samples fall, to the precision of the buckets.
+    fn quantile(&self, q: f64) -> u64 {
+        let total: u64 = self.buckets.iter().sum();
+        if total == 0 {
+            return 0;
+        }
+        let rank = ((total as f64 * q).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (i, n) in self.buckets.iter().enumerate() {
+            seen += n;
+            if seen >= rank && i + 1 < BUCKETS {
+                // Upper edge of the bucket, capped by the largest sample seen.
+                return (bucket_floor(i + 1) - 1).min(self.max_ns);
+            }
+        }
+        self.max_ns
+    }
+}
+
+pub struct Stats {
+    ops: Vec<OpStats>,
+    started: Instant,
+}
+
+/// Records the latency of an operation when dropped.
+pub struct Timer<'a> {
+    op: &'a OpStats,
+    started: Instant,
+}
+
+impl Drop for Timer<'_> {
+    fn drop(&mut self) {
+        self.op.record(self.started.elapsed().as_nanos() as u64);
+    }
+}
+
+impl Stats {
+    pub fn new() -> Stats {
+        Stats {
+            ops: OPS.iter().map(|_| OpStats::new()).collect(),
+            started: Instant::now(),
+        }
+    }
+
+    /// Time `op` until the returned guard goes out of scope.
+    pub fn time(&self, op: Op) -> Timer<'_> {
+        Timer {
+            op: &self.ops[op as usize],
+            started: Instant::now(),
+        }
+    }
+
+    /// Record an operation that took `took`, timed elsewhere.
+    pub fn record(&self, op: Op, took: Duration) {
+        self.ops[op as usize].record(took.as_nanos() as u64);
+    }
+
+    /// Count `n` bytes moved by `op`.
+    pub fn add_bytes(&self, op: Op, n: u64) {
+        self.ops[op as usize].bytes.fetch_add(n, Ordering::Relaxed);
+    }
+
+    fn snapshot(&self, op: Op) -> Snapshot {
+        let stats = &self.ops[op as usize];
+        Snapshot {
+            count: stats.count.load(Ordering::Relaxed),
+            total_ns: stats.total_ns.load(Ordering::Relaxed),
+            max_ns: stats.max_ns.load(Ordering::Relaxed),
+            bytes: stats.bytes.load(Ordering::Relaxed),
+            buckets: stats
+                .buckets
+                .iter()
+                .map(|b| b.load(Ordering::Relaxed))
+                .collect(),
+        }
+    }
+
+    /// The counters as a JSON document. Histograms list their non-empty buckets as
+    /// [lowest ns, count] pairs.
+    pub fn to_json(&self, queue: &QueueStats) -> String {
+        let mut out = String::new();
+        let _ = write!(
+            out,
+            "{{\n  \"uptime_s\": {},\n  \"ops\": {{",
+            self.started.elapsed().as_secs()
+        );
+        for (i, (op, name)) in OPS.iter().enumerate() {
+            let s = self.snapshot(*op);
+            let _ = write!(
+                out,
+                "{}\n    \"{}\": {{\"count\": {}, \"total_ns\": {}, \"max_ns\": {}, \"bytes\": {}, \
+                 \"p50_ns\": {}, \"p90_ns\": {}, \"p99_ns\": {}, \"p999_ns\": {}, \"buckets\": [",
+                if i == 0 { "" } else { "," },
+                name,
+                s.count,
+                s.total_ns,
+                s.max_ns,
+                s.bytes,
+                s.quantile(0.5),
+                s.quantile(0.9),
+                s.quantile(0.99),
+                s.quantile(0.999)
+            );
+            let mut first = true;
+            for (b, n) in s.buckets.iter().enumerate().filter(|(_, n)| **n > 0) {
+                let _ = write!(
+                    out,
+                    "{}[{}, {}]",
+                    if first { "" } else { ", " },
+                    bucket_floor(b),
+                    n
+                );
+                first = false;
+            }
+            out.push_str("]}");
+        }
+        let _ = write!(
+            out,
+            "\n  }},\n  \"queue\": {{\"depth\": {}, \"max_depth\": {}, \"in_flight\": {}, \
+             \"submitted\": {}, \"rejected\": {}, \"started\": {}, \"total_wait_ns\": {}, \
+             \"max_wait_ns\": {}, \"dedup_hits\": {}, \"dedup_misses\": {}}}\n}}\n",
+            queue.depth,
+            queue.max_depth,
+            queue.in_flight,
+            queue.submitted,
+            queue.rejected,
+            queue.started,
+            queue.total_wait.as_nanos(),
+            queue.max_wait.as_nanos(),
+            queue.dedup_hits,
+            queue.dedup_misses
+        );
+        out
+    }
+
+    /// The counters in the Prometheus text format. Histogram buckets are merged to one per power
+    /// of two, from 1 µs to about 69 s.
+    pub fn to_prometheus(&self, queue: &QueueStats) -> String {
+        let mut out = String::new();
+        out.push_str(
+            "# HELP securefuse_op_latency_seconds Latency of filesystem operations and TEE jobs.\n\
+             # TYPE securefuse_op_latency_seconds histogram\n",
+        );
+        for (op, name) in OPS.iter() {
+            let s = self.snapshot(*op);
+            let mut cumulative = 0;
+            let mut b = 0;
+            for exp in 10..=36 {
+                let le = 1u64 << exp;
+                while b < BUCKETS && bucket_floor(b) < le {
+                    cumulative += s.buckets[b];
+                    b += 1;
+                }
+                let _ = writeln!(
+                    out,
+                    "securefuse_op_latency_seconds_bucket{{op=\"{}\",le=\"{:e}\"}} {}",
+                    name,
+                    le as f64 / 1e9,
+                    cumulative
+                );
+            }
+            let _ = writeln!(
+                out,
+                "securefuse_op_latency_seconds_bucket{{op=\"{}\",le=\"+Inf\"}} {}",
+                name,
+                s.buckets.iter().sum::<u64>()
+            );
+            let _ = writeln!(
+                out,
+                "securefuse_op_latency_seconds_sum{{op=\"{}\"}} {:e}",
+                name,
+                s.total_ns as f64 / 1e9
+            );
+            let _ = writeln!(
+                out,
+                "securefuse_op_latency_seconds_count{{op=\"{}\"}} {}",
+                name, s.count
+            );
+        }
+
+        out.push_str(
+            "# HELP securefuse_op_bytes_total Bytes moved by reads and writes.\n\
+             # TYPE securefuse_op_bytes_total counter\n",
+        );
+        for (op, name) in OPS[2..4].iter() {
+            let _ = writeln!(
+                out,
+                "securefuse_op_bytes_total{{op=\"{}\"}} {}",
+                name,
+                self.snapshot(*op).bytes
+            );
+        }
+
+        let gauges = [
+            (
+                "queue_depth",
+                "Jobs waiting for a TEE worker.",
+                queue.depth as u64,
+            ),
+            (
+                "queue_max_depth",
+                "Most jobs ever waiting at once.",
+                queue.max_depth as u64,
+            ),
+            (
+                "queue_in_flight",
+                "Jobs being processed.",
+                queue.in_flight as u64,
+            ),
+        ];
+        for (name, help, value) in gauges.iter() {
+            let _ = write!(
+                out,
+                "# HELP securefuse_{0} {1}\n# TYPE securefuse_{0} gauge\nsecurefuse_{0} {2}\n",
+                name, help, value
+            );
+        }
+        let counters = [
+            ("jobs_submitted_total", "Jobs queued.", queue.submitted),
+            (
+                "jobs_rejected_total",
+                "Jobs turned away by a full queue.",
+                queue.rejected,
+            ),
+            (
+                "jobs_started_total",
+                "Jobs handed to a TEE worker.",
+                queue.started,
+            ),
+            (
+                "dedup_hits_total",
+                "Jobs answered with the result of identical content.",
+                queue.dedup_hits,
+            ),
+            (
+                "dedup_misses_total",
+                "Jobs whose content was not processed before.",
+                queue.dedup_misses,
+            ),
+        ];
+        for (name, help, value) in counters.iter() {
+            let _ = write!(
+                out,
+                "# HELP securefuse_{0} {1}\n# TYPE securefuse_{0} counter\nsecurefuse_{0} {2}\n",
+                name, help, value
+            );
+        }
+        out
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn buckets_round_trip() {
+        for i in 0..BUCKETS {
+            let floor = bucket_floor(i);
+            assert_eq!(bucket(floor), i, "floor of bucket {}", i);
+            if i + 1 < BUCKETS {
+                assert!(bucket_floor(i + 1) > floor);
+                assert_eq!(bucket(bucket_floor(i + 1) - 1), i, "top of bucket {}", i);
+            }
+        }
+        assert_eq!(bucket(u64::MAX), BUCKETS - 1);
+    }
+
+    #[test]
+    fn buckets_are_within_a_quarter() {
+        for ns in [5, 100, 999, 123_456, 1 << 40, u64::MAX / 3] {
+            let i = bucket(ns);
+            let width = bucket_floor(i + 1) - bucket_floor(i);
+            assert!(bucket_floor(i) <= ns && ns - bucket_floor(i) < width);
+            assert!(
+                width <= bucket_floor(i) / 4,
+                "bucket of {} is {} wide",
+                ns,
+                width
+            );
+        }
+    }
+
+    #[test]
+    fn quantiles() {
+        let stats = Stats::new();
+        assert_eq!(stats.snapshot(Op::Read).quantile(0.5), 0);
+
+        // 1..=1000 us: each quantile lands in the bucket of the exact value, at most its top
+        for us in 1..=1000u64 {
+            stats.record(Op::Read, Duration::from_micros(us));
+        }
+        let snapshot = stats.snapshot(Op::Read);
+        for (q, exact) in [(0.5, 500_000), (0.9, 900_000), (0.99, 990_000)] {
+            let got = snapshot.quantile(q);
+            assert!(
+                got >= exact && bucket(got) == bucket(exact),
+                "q {}: {}",
+                q,
+                got
+            );
+        }
+        assert_eq!(snapshot.quantile(1.0), 1_000_000);
+
+        // The top of the last bucket is capped by the largest sample
+        stats.record(Op::Write, Duration::from_nanos(u64::MAX));
+        assert_eq!(stats.snapshot(Op::Write).quantile(0.5), u64::MAX);
+    }
+}
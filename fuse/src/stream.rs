@@ -0,0 +1,263 @@
+// Stream :: Hand an image to the TEE daemon row band by row band while it is being written.
+//
+// When the first write of a `.bmp` carries its headers, the file is announced to the daemon on a
+// connection of its own (VT_JOB_STREAM_BEGIN with a read-only descriptor of the backing file).
+// Every `BAND_ROWS` complete rows the daemon is told to read them (VT_JOB_STREAM_ROWS), so the
+// TA converts and hashes the frame while the writer is still busy. On release the connection is
+// handed to the queued job, which only has to ask for the signature (VT_JOB_STREAM_END).
+//
+// Only strictly sequential writers are streamed. Anything else (a gap, a rewrite, a truncate, a
+// write to the same file through another handle) drops the stream and the file is processed as a
+// whole after close, as without streaming. The daemon streams one file at a time, so so does this.
+//
+
+use std::collections::HashMap;
+use std::ffi::OsStr;
+use std::fs::File;
+use std::io::{self, Write};
+use std::os::unix::io::AsRawFd;
+use std::os::unix::net::UnixStream;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+use crate::bmp::Layout;
+use crate::libc_wrappers;
+
+// Streaming requests of the daemon protocol, see videoTEE/host/include/video_tee_daemon.h.
+const VT_JOB_STREAM_BEGIN: u32 = 2;
+const VT_JOB_STREAM_ROWS: u32 = 3;
+pub const VT_JOB_STREAM_END: u32 = 4;
+
+/// Rows per VT_JOB_STREAM_ROWS message.
+const BAND_ROWS: u32 = 64;
+
+struct Stream {
+    conn: UnixStream,
+    layout: Layout,
+    /// Bytes written so far, all of them contiguous from offset 0.
+    written: u64,
+    /// Rows the daemon has been told about.
+    rows_sent: u32,
+}
+
+impl Stream {
+    fn begin(socket: &Path, real: &OsStr, hdr: &[u8]) -> io::Result<Option<Stream>> {
+        let layout = match Layout::parse(hdr) {
+            Some(layout) => layout,
+            None => return Ok(None),
+        };
+
+        let conn = UnixStream::connect(socket)?;
+        let file = File::open(real)?;
+        let mut req = [0u8; 8];
+        req[..4].copy_from_slice(&VT_JOB_STREAM_BEGIN.to_ne_bytes());
+        let sent = libc_wrappers::send_fd(conn.as_raw_fd(), &req, file.as_raw_fd())
+            .map_err(io::Error::from_raw_os_error)?;
+        (&conn).write_all(&req[sent..])?;
+
+        Ok(Some(Stream {
+            conn,
+            layout,
+            written: 0,
+            rows_sent: 0,
+        }))
+    }
+
+    /// Account for `len` more bytes and tell the daemon once a band (or the frame) is complete.
+    fn advance(&mut self, len: u64) -> io::Result<()> {
+        self.written += len;
+        let rows = self.layout.rows_in(self.written);
+        if rows >= self.rows_sent + BAND_ROWS
+            || (rows == self.layout.height && rows > self.rows_sent)
+        {
+            let mut req = [0u8; 8];
+            req[..4].copy_from_slice(&VT_JOB_STREAM_ROWS.to_ne_bytes());
+            req[4..].copy_from_slice(&rows.to_ne_bytes());
+            (&self.conn).write_all(&req)?;
+            self.rows_sent = rows;
+        }
+        Ok(())
+    }
+
+    fn complete(&self) -> bool {
+        self.rows_sent == self.layout.height
+    }
+}
+
+/// The stream of one file, fed by the handle that started it.
+struct Slot {
+    fh: u64,
+    /// Tells a slot apart from one started after it was dropped.
+    id: u64,
+    /// None while a write talks to the daemon. The socket I/O happens outside the lock, so a
+    /// busy daemon stalls only the writer of the streamed file, not every image write.
+    stream: Option<Stream>,
+}
+
+/// Streams of the files being written, keyed by mount path, so that a write through any other
+/// handle (a second open, mmap writeback) drops the stream of the file it changes.
+pub struct Streams {
+    socket: PathBuf,
+    open: Mutex<HashMap<PathBuf, Slot>>,
+    next_id: AtomicU64,
+}
+
+impl Streams {
+    pub fn new(socket: PathBuf) -> Streams {
+        Streams {
+            socket,
+            open: Mutex::new(HashMap::new()),
+            next_id: AtomicU64::new(0),
+        }
+    }
+
+    /// Called after `data` was written at `offset` through `fh` to `path`, whose backing file is
+    /// `real`.
+    pub fn wrote(&self, fh: u64, path: &Path, real: &OsStr, offset: u64, data: &[u8]) {
+        // Take the stream out of the map, or reserve the slot for a new one.
+        let (id, stream) = {
+            let mut open = self.open.lock().unwrap();
+            let idle = open.is_empty();
+            match open.get_mut(path) {
+                Some(slot) => match slot.stream.take() {
+                    Some(stream) if slot.fh == fh && offset == stream.written => {
+                        (slot.id, Some(stream))
+                    }
+                    _ => {
+                        // A gap, a rewrite, another writer, or a write racing this one
+                        info!(
+                            "stream: non-sequential write to {:?}, processing it after close",
+                            real
+                        );
+                        open.remove(path);
+                        return;
+                    }
+                },
+                None if offset == 0 && idle => {
+                    let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+                    open.insert(
+                        path.to_owned(),
+                        Slot {
+                            fh,
+                            id,
+                            stream: None,
+                        },
+                    );
+                    (id, None)
+                }
+                None => return,
+            }
+        };
+
+        let stream = match stream {
+            Some(stream) => Some(stream),
+            None => match Stream::begin(&self.socket, real, data) {
+                Ok(stream) => stream,
+                Err(e) => {
+                    warn!("stream: failed to start {:?}: {}", real, e);
+                    None
+                }
+            },
+        };
+        let stream = stream.and_then(|mut stream| match stream.advance(data.len() as u64) {
+            Ok(()) => Some(stream),
+            Err(e) => {
+                warn!("stream: {:?}: {}", real, e);
+                None
+            }
+        });
+
+        // Put it back unless the file was aborted or released meanwhile; dropping the
+        // connection ends the stream on the daemon's side.
+        let mut open = self.open.lock().unwrap();
+        if let Some(slot) = open.get_mut(path) {
+            if slot.id == id {
+                match stream {
+                    Some(stream) => slot.stream = Some(stream),
+                    None => {
+                        open.remove(path);
+                    }
+                }
+            }
+        }
+    }
+
+    /// Drop the stream of `path`, if any; the file is processed after close instead.
+    pub fn abort(&self, path: &Path) {
+        self.open.lock().unwrap().remove(path);
+    }
+
+    /// Take the daemon connection for `path` at release, if `fh` streamed every row of its frame.
+    /// Drops whatever else `fh` left behind under a path it was renamed from.
+    pub fn take(&self, fh: u64, path: &Path) -> Option<UnixStream> {
+        let mut open = self.open.lock().unwrap();
+        let conn = match open.remove(path) {
+            Some(Slot {
+                fh: owner,
+                stream: Some(stream),
+                ..
+            }) if owner == fh && stream.complete() => Some(stream.conn),
+            Some(other) if other.fh != fh => {
+                open.insert(path.to_owned(), other);
+                None
+            }
+            _ => None,
+        };
+        open.retain(|_, slot| slot.fh != fh);
+        conn
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::os::unix::net::UnixListener;
+
+    /// Header of a 1x1 24-bit BMP, whose single row is 4 bytes.
+    fn header() -> Vec<u8> {
+        let mut hdr = vec![0u8; crate::bmp::HEADER_SIZE];
+        hdr[0..2].copy_from_slice(b"BM");
+        hdr[10..14].copy_from_slice(&54u32.to_le_bytes());
+        hdr[14..18].copy_from_slice(&40u32.to_le_bytes());
+        hdr[18..22].copy_from_slice(&1u32.to_le_bytes());
+        hdr[22..26].copy_from_slice(&1u32.to_le_bytes());
+        hdr[26..28].copy_from_slice(&1u16.to_le_bytes());
+        hdr[28..30].copy_from_slice(&24u16.to_le_bytes());
+        hdr
+    }
+
+    #[test]
+    fn write_through_another_handle_drops_the_stream() {
+        let dir = std::env::temp_dir().join(format!("stream_test_{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let socket = dir.join("daemon.sock");
+        let real = dir.join("a.bmp");
+        std::fs::write(&real, header()).unwrap();
+        // Connections queue up in the backlog; nothing needs to accept them.
+        let _daemon = UnixListener::bind(&socket).unwrap();
+
+        let streams = Streams::new(socket);
+        let path = Path::new("/a.bmp");
+        let real = real.as_os_str();
+
+        // One handle writing the whole frame
+        streams.wrote(1, path, real, 0, &header());
+        streams.wrote(1, path, real, 54, &[0; 4]);
+        assert!(streams.take(1, path).is_some());
+
+        // Another handle writing the same file
+        streams.wrote(1, path, real, 0, &header());
+        streams.wrote(2, path, real, 54, &[0; 4]);
+        assert!(streams.take(1, path).is_none());
+
+        // A truncate or rename
+        streams.wrote(1, path, real, 0, &header());
+        streams.abort(path);
+        streams.wrote(1, path, real, 54, &[0; 4]);
+        assert!(streams.take(1, path).is_none());
+        assert!(streams.open.lock().unwrap().is_empty());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,51 @@
+// VirtualFiles :: Handles of the files the mount makes up rather than passes through.
+//
+// The `/.processed` view and `/.stats` are read-only files whose contents are fixed when they are
+// opened. Their handles carry a tag bit no descriptor has, so every handle-based operation can
+// tell them apart from the backing files it passes through.
+//
+
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+/// Tag of virtual handles; descriptors never have it.
+const TAG: u64 = 1 << 63;
+
+/// Handle of every open virtual directory; they are listed by path.
+pub const DIR_FH: u64 = TAG;
+
+/// Whether `fh` was handed out here rather than being a descriptor.
+pub fn is_virtual(fh: u64) -> bool {
+    fh & TAG != 0
+}
+
+pub struct VirtualFiles {
+    /// Contents of the open files.
+    open: Mutex<HashMap<u64, Arc<Vec<u8>>>>,
+    next_fh: AtomicU64,
+}
+
+impl VirtualFiles {
+    pub fn new() -> VirtualFiles {
+        VirtualFiles {
+            open: Mutex::new(HashMap::new()),
+            next_fh: AtomicU64::new(1),
+        }
+    }
+
+    /// Hand out a file handle for an open file with contents `data`.
+    pub fn open(&self, data: Arc<Vec<u8>>) -> u64 {
+        let fh = TAG | self.next_fh.fetch_add(1, Ordering::Relaxed);
+        self.open.lock().unwrap().insert(fh, data);
+        fh
+    }
+
+    pub fn data(&self, fh: u64) -> Option<Arc<Vec<u8>>> {
+        self.open.lock().unwrap().get(&fh).cloned()
+    }
+
+    pub fn close(&self, fh: u64) {
+        self.open.lock().unwrap().remove(&fh);
+    }
+}
@@ -0,0 +1,572 @@
+/*
+ * Daemon mode of the video_tee client.
+ *
+ * The TEE context and session are opened once; jobs then arrive over a
+ * Unix domain socket (see video_tee_daemon.h). Clients are multiplexed with
+ * poll() and served one job at a time, since the TA instance serializes
+ * invocations anyway.
+ *
+ * With batching on (tee->batch_max > 1) image jobs are held back and run
+ * together in one TA invocation once batch_max of them are waiting, every
+ * connected client is waiting on one, or the oldest has waited
+ * batch_wait_ms. Each still gets its own reply, with an inclusion proof as
+ * its attestation.
+ */
+
+#define _GNU_SOURCE /* accept4 */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "video_tee_host.h"
+#include "video_tee_daemon.h"
+#include "bmp_map.h"
+
+/* Most clients served at once */
+#define VT_MAX_CLIENTS 64
+
+/*
+ * The image being streamed in. It lives in the TA session, so there is one
+ * at a time; other clients' streams are refused and fall back to jobs.
+ */
+struct vt_stream {
+  int owner;                  /* Client socket, -1 when idle */
+  int img_fd;
+  bmp_layout layout;
+  uint32_t rows;              /* Stored rows handed to the TA so far */
+  TEEC_Result status;         /* First failure, reported on END */
+  unsigned long long took_us; /* Time spent in the TA so far */
+  uint8_t *staging;           /* Stored rows read from the file */
+  size_t staging_size;
+};
+
+/* Image jobs held back for the next batch, at most one per client */
+struct vt_batch {
+  uint32_t count;
+  unsigned long long deadline; /* gettime() by which the batch runs */
+  struct {
+    int sock;
+    FILE *img_file;
+    int want_output;
+  } jobs[TA_BATCH_MAX_FRAMES];
+};
+
+/* Write all of buf, retrying on short writes */
+static int write_full(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Read exactly len bytes, failing on EOF */
+static int read_full(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Receive a request header and, if one was attached, the image fd.
+ * *img_fd is -1 when no descriptor came with the header.
+ */
+static int recv_req(int sock, vt_job_req_t *req, int *img_fd)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cbuf,
+    .msg_controllen = sizeof(cbuf),
+  };
+  struct cmsghdr *cmsg;
+  ssize_t n;
+
+  *img_fd = -1;
+
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return -1;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(img_fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  /* The rest of a header split across segments */
+  if ((size_t)n < sizeof(*req) &&
+      read_full(sock, (char *)req + n, sizeof(*req) - n) != 0) {
+    if (*img_fd >= 0)
+      close(*img_fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Read exactly len bytes at off, failing on EOF */
+static int pread_full(int fd, void *buf, size_t len, off_t off)
+{
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0)
+      return -1;
+    p += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void stream_close(struct vt_stream *st)
+{
+  if (st->img_fd >= 0)
+    close(st->img_fd);
+  st->img_fd = -1;
+  st->owner = -1;
+}
+
+/* Start streaming the image on img_fd for client sock */
+static void stream_open(struct tee_ctx *tee, struct vt_stream *st, int sock,
+                        int img_fd)
+{
+  uint8_t hdr[BMP_LAYOUT_HEADER];
+
+  if (st->owner >= 0 && st->owner != sock) {
+    /* Busy; this client's END gets an error */
+    if (img_fd >= 0)
+      close(img_fd);
+    return;
+  }
+
+  stream_close(st);
+  st->owner = sock;
+  st->img_fd = img_fd;
+  st->rows = 0;
+  st->took_us = 0;
+  st->status = TEEC_ERROR_BAD_PARAMETERS;
+
+  if (img_fd < 0 || pread_full(img_fd, hdr, sizeof(hdr), 0) != 0 ||
+      bmp_layout_parse(&st->layout, hdr, sizeof(hdr)) != 0)
+    return;
+
+  unsigned long long t_start = gettime();
+  st->status = stream_begin(tee, st->layout.width, st->layout.height);
+  st->took_us += gettime() - t_start;
+}
+
+/*
+ * The first rows stored rows of the file are written; hand the new ones
+ * to the TA. Bottom-up files store the bottom row first, so their new rows
+ * are a band above the ones already sent.
+ */
+static void stream_feed(struct tee_ctx *tee, struct vt_stream *st,
+                        uint32_t rows)
+{
+  const bmp_layout *l = &st->layout;
+
+  if (st->status != TEEC_SUCCESS || rows <= st->rows)
+    return;
+  if (rows > (uint32_t)l->height) {
+    st->status = TEEC_ERROR_BAD_PARAMETERS;
+    return;
+  }
+
+  uint32_t count = rows - st->rows;
+  size_t size = l->row * count;
+  if (size > st->staging_size) {
+    uint8_t *staging = realloc(st->staging, size);
+    if (staging == NULL) {
+      st->status = TEEC_ERROR_OUT_OF_MEMORY;
+      return;
+    }
+    st->staging = staging;
+    st->staging_size = size;
+  }
+
+  uint8_t *dst = stream_buffer(tee, count);
+  if (dst == NULL) {
+    st->status = TEEC_ERROR_OUT_OF_MEMORY;
+    return;
+  }
+  if (pread_full(st->img_fd, st->staging, size,
+                 l->off_bits + l->row * st->rows) != 0) {
+    st->status = TEEC_ERROR_COMMUNICATION;
+    return;
+  }
+
+  /* Pack the rows top-down, dropping the padding */
+  size_t packed = 3 * (size_t)l->width;
+  uint32_t first = l->bottom_up ? l->height - rows : st->rows;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t y = l->bottom_up ? count - 1 - i : i;
+    memcpy(dst + y * packed, st->staging + i * l->row, packed);
+  }
+
+  unsigned long long t_start = gettime();
+  st->status = stream_rows(tee, first, count);
+  st->took_us += gettime() - t_start;
+  st->rows = rows;
+}
+
+/* Finish client sock's stream into res_buf */
+static TEEC_Result stream_finish(struct tee_ctx *tee, struct vt_stream *st,
+                                 int sock, signed_res_t *res_buf,
+                                 unsigned long long *took_us)
+{
+  TEEC_Result res;
+
+  if (st->owner != sock)
+    return TEEC_ERROR_BUSY;
+
+  res = st->status;
+  if (res == TEEC_SUCCESS) {
+    unsigned long long t_start = gettime();
+    res = stream_end(tee, res_buf);
+    st->took_us += gettime() - t_start;
+  }
+  *took_us = st->took_us;
+
+  stream_close(st);
+  return res;
+}
+
+/* Send a reply with res_size bytes of res and, if asked for, the image */
+static int send_rep(int sock, const vt_job_rep_t *rep, const void *res,
+                    int want_output, const void *out, uint32_t out_size)
+{
+  if (write_full(sock, rep, sizeof(*rep)) != 0 ||
+      write_full(sock, res, rep->res_size) != 0)
+    return -1;
+
+  if (want_output &&
+      (write_full(sock, &out_size, sizeof(out_size)) != 0 ||
+       write_full(sock, out, out_size) != 0))
+    return -1;
+
+  return 0;
+}
+
+/* Whether client sock has a job in the batch */
+static int batch_has(const struct vt_batch *b, int sock)
+{
+  for (uint32_t i = 0; i < b->count; i++)
+    if (b->jobs[i].sock == sock)
+      return 1;
+  return 0;
+}
+
+/* Drop the job of a client that went away */
+static void batch_drop(struct vt_batch *b, int sock)
+{
+  for (uint32_t i = 0; i < b->count; i++) {
+    if (b->jobs[i].sock != sock)
+      continue;
+    fclose(b->jobs[i].img_file);
+    b->jobs[i] = b->jobs[--b->count];
+    return;
+  }
+}
+
+/*
+ * Process the jobs in the batch and reply to each. A lone job, or a batch
+ * the TA could not take as one, is processed job by job as without
+ * batching. A client that cannot be written to is shut down, so the poll
+ * loop closes it.
+ */
+static void batch_run(struct tee_ctx *tee, struct vt_batch *b)
+{
+  FILE *img_files[TA_BATCH_MAX_FRAMES];
+  unsigned long long took_us = 0;
+  TEEC_Result batched = TEEC_ERROR_NOT_SUPPORTED;
+
+  if (b->count > 1) {
+    for (uint32_t i = 0; i < b->count; i++)
+      img_files[i] = b->jobs[i].img_file;
+    batched = run_batch(tee, img_files, b->count, &took_us);
+  }
+
+  for (uint32_t i = 0; i < b->count; i++) {
+    vt_job_rep_t rep = { 0 };
+    batch_proof_t proof;
+    signed_res_t res_buf;
+    const void *res = &res_buf, *out = NULL;
+    size_t out_size = 0;
+
+    if (batched == TEEC_SUCCESS) {
+      fclose(b->jobs[i].img_file);
+      rep.status = TEEC_SUCCESS;
+      /* Each frame's share, so summing the replies counts the TA time once */
+      rep.took_us = (uint32_t)(took_us / b->count);
+      rep.res_size = (uint32_t)batch_proof(tee, i, &proof);
+      res = &proof;
+      out = batch_output(tee, i, &out_size);
+    } else {
+      rep.status = run_job(tee, b->jobs[i].img_file, &res_buf, &took_us);
+      rep.took_us = (uint32_t)took_us;
+      if (rep.status == TEEC_SUCCESS) {
+        rep.res_size = sizeof(res_buf);
+        out = tee->out_shm.buffer;
+        out_size = IMG_FMT_BPP(tee->frame.out_format) * tee->frame.width *
+                   tee->frame.height;
+      }
+    }
+
+    if (send_rep(b->jobs[i].sock, &rep, res, b->jobs[i].want_output, out,
+                 (uint32_t)out_size) != 0)
+      shutdown(b->jobs[i].sock, SHUT_RDWR);
+  }
+
+  b->count = 0;
+}
+
+/*
+ * Serve one job from a client.
+ * Returns -1 when the connection should be closed.
+ */
+static int handle_job(struct tee_ctx *tee, struct vt_stream *st,
+                      struct vt_batch *b, int sock)
+{
+  vt_job_req_t req;
+  vt_job_rep_t rep = { 0 };
+  signed_res_t res_buf;
+  unsigned long long took_us = 0;
+  char path[VT_MAX_PATH + 1];
+  uint8_t digest[DIGEST_SIZE];
+  FILE *img_file = NULL;
+  uint32_t out_size = 0;
+  size_t loaded;
+  int img_fd, want_output;
+
+  /* Replies go out in order, so a job held back is answered first */
+  if (batch_has(b, sock))
+    batch_run(tee, b);
+
+  if (recv_req(sock, &req, &img_fd) != 0)
+    return -1;
+
+  want_output = (req.type & VT_JOB_WANT_OUTPUT) != 0;
+  req.type &= ~VT_JOB_WANT_OUTPUT;
+
+  switch (req.type) {
+  case VT_JOB_STREAM_BEGIN:
+    stream_open(tee, st, sock, img_fd);
+    return 0;
+  case VT_JOB_STREAM_ROWS:
+    if (img_fd >= 0)
+      close(img_fd);
+    if (st->owner == sock)
+      stream_feed(tee, st, req.path_len);
+    return 0;
+  case VT_JOB_STREAM_END:
+    if (img_fd >= 0)
+      close(img_fd);
+    rep.status = stream_finish(tee, st, sock, &res_buf, &took_us);
+    rep.took_us = (uint32_t)took_us;
+    if (rep.status == TEEC_SUCCESS)
+      rep.res_size = sizeof(res_buf);
+    goto reply;
+  case VT_JOB_LOAD:
+    if (img_fd >= 0)
+      close(img_fd);
+    if (req.path_len != DIGEST_SIZE ||
+        read_full(sock, digest, sizeof(digest)) != 0)
+      return -1;
+    took_us = gettime();
+    rep.status = load_output(tee, digest, &loaded);
+    rep.took_us = (uint32_t)(gettime() - took_us);
+    if (rep.status == TEEC_SUCCESS)
+      out_size = (uint32_t)loaded;
+    want_output = 1;
+    goto reply;
+  case VT_JOB_PATH:
+    if (img_fd >= 0)
+      close(img_fd);
+    if (req.path_len == 0 || req.path_len > VT_MAX_PATH ||
+        read_full(sock, path, req.path_len) != 0)
+      return -1;
+    path[req.path_len] = '\0';
+    img_file = fopen(path, "rb");
+    break;
+  case VT_JOB_FD:
+    if (img_fd >= 0)
+      img_file = fdopen(img_fd, "rb");
+    if (img_file == NULL && img_fd >= 0)
+      close(img_fd);
+    break;
+  default:
+    if (img_fd >= 0)
+      close(img_fd);
+    break;
+  }
+
+  if (img_file == NULL) {
+    rep.status = TEEC_ERROR_BAD_PARAMETERS;
+  } else if (tee->batch_max > 1) {
+    if (b->count == 0)
+      b->deadline = gettime() + 1000ULL * tee->batch_wait_ms;
+    b->jobs[b->count].sock = sock;
+    b->jobs[b->count].img_file = img_file;
+    b->jobs[b->count].want_output = want_output;
+    b->count++;
+    if (b->count >= tee->batch_max || b->count == TA_BATCH_MAX_FRAMES)
+      batch_run(tee, b);
+    return 0;
+  } else {
+    rep.status = run_job(tee, img_file, &res_buf, &took_us);
+    rep.took_us = (uint32_t)took_us;
+    if (rep.status == TEEC_SUCCESS) {
+      rep.res_size = sizeof(res_buf);
+      out_size = IMG_FMT_BPP(tee->frame.out_format) * tee->frame.width *
+                 tee->frame.height;
+    }
+  }
+
+reply:
+  /* The processed image is still in out_shm */
+  return send_rep(sock, &rep, &res_buf, want_output, tee->out_shm.buffer,
+                  out_size);
+}
+
+int vt_daemon_listen(const char *sock_path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd;
+
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, sock_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  /* Remove a stale socket left by a previous run */
+  unlink(sock_path);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int vt_daemon_serve(struct tee_ctx *tee, int listen_fd, int stop_fd)
+{
+  /* [0] stop_fd, [1] listen_fd, then clients */
+  struct pollfd fds[2 + VT_MAX_CLIENTS];
+  nfds_t nfds = 2;
+  struct vt_stream stream = { .owner = -1, .img_fd = -1 };
+  struct vt_batch batch = { .count = 0 };
+
+  fds[0].fd = stop_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = listen_fd;
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    /* Wake up when the batch is due */
+    int timeout = -1;
+    if (batch.count > 0) {
+      unsigned long long now = gettime();
+      timeout = now >= batch.deadline ? 0 : (batch.deadline - now + 999) / 1000;
+    }
+
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    if (fds[0].revents)
+      break;
+
+    if (fds[1].revents & POLLIN) {
+      int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (client < 0) {
+        perror("accept");
+      } else if (nfds == 2 + VT_MAX_CLIENTS) {
+        fprintf(stderr, "Too many clients, dropping connection\n");
+        close(client);
+      } else {
+        fds[nfds].fd = client;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+      }
+    }
+
+    for (nfds_t i = 2; i < nfds; i++) {
+      if (fds[i].revents == 0)
+        continue;
+
+      if (!(fds[i].revents & POLLIN) ||
+          handle_job(tee, &stream, &batch, fds[i].fd) != 0) {
+        /* A stream left unfinished is dropped; the next BEGIN resets the TA */
+        if (stream.owner == fds[i].fd)
+          stream_close(&stream);
+        batch_drop(&batch, fds[i].fd);
+        close(fds[i].fd);
+        fds[i--] = fds[--nfds];
+      }
+    }
+
+    /* No one else can add to a batch every client is waiting on */
+    if (batch.count > 0 &&
+        (batch.count == nfds - 2 || gettime() >= batch.deadline))
+      batch_run(tee, &batch);
+  }
+
+  for (nfds_t i = 2; i < nfds; i++) {
+    batch_drop(&batch, fds[i].fd);
+    close(fds[i].fd);
+  }
+  stream_close(&stream);
+  free(stream.staging);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+/*
+ * Client side of the video_tee daemon protocol, for batch tools and tests.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "video_tee_daemon.h"
+#include "video_tee_ta.h"
+
+int vt_client_connect(const char *sock_path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd;
+
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, sock_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Send a request header, optionally with an fd, followed by payload */
+static int send_req(int sock, const vt_job_req_t *req, int img_fd,
+                    const void *payload)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov[2] = {
+    { .iov_base = (void *)req, .iov_len = sizeof(*req) },
+    { .iov_base = (void *)payload, .iov_len = req->path_len },
+  };
+  struct msghdr msg = {
+    .msg_iov = iov,
+    .msg_iovlen = payload ? 2 : 1,
+  };
+  size_t total = sizeof(*req) + (payload ? req->path_len : 0);
+  ssize_t n;
+
+  if (img_fd >= 0) {
+    struct cmsghdr *cmsg;
+
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &img_fd, sizeof(int));
+  }
+
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+
+  /* Requests are tiny; treat a short send on a stream socket as an error */
+  return (n >= 0 && (size_t)n == total) ? 0 : -1;
+}
+
+/* Read exactly len bytes, failing on EOF */
+static int read_full(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Receive a reply header and its signed result */
+static int recv_rep(int sock, vt_job_rep_t *rep, void *res, uint32_t res_cap)
+{
+  if (read_full(sock, rep, sizeof(*rep)) != 0 || rep->res_size > res_cap)
+    return -1;
+
+  return read_full(sock, res, rep->res_size);
+}
+
+int vt_client_submit_path(int sock, const char *path, vt_job_rep_t *rep,
+                          void *res, uint32_t res_cap)
+{
+  vt_job_req_t req = {
+    .type = VT_JOB_PATH,
+    .path_len = (uint32_t)strlen(path),
+  };
+
+  if (req.path_len == 0 || req.path_len > VT_MAX_PATH) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (send_req(sock, &req, -1, path) != 0)
+    return -1;
+
+  return recv_rep(sock, rep, res, res_cap);
+}
+
+int vt_client_submit_fd(int sock, int img_fd, vt_job_rep_t *rep,
+                        void *res, uint32_t res_cap)
+{
+  vt_job_req_t req = {
+    .type = VT_JOB_FD,
+    .path_len = 0,
+  };
+
+  if (send_req(sock, &req, img_fd, NULL) != 0)
+    return -1;
+
+  return recv_rep(sock, rep, res, res_cap);
+}
+
+int vt_client_stream_begin(int sock, int img_fd)
+{
+  vt_job_req_t req = {
+    .type = VT_JOB_STREAM_BEGIN,
+    .path_len = 0,
+  };
+
+  return send_req(sock, &req, img_fd, NULL);
+}
+
+int vt_client_stream_rows(int sock, uint32_t rows)
+{
+  vt_job_req_t req = {
+    .type = VT_JOB_STREAM_ROWS,
+    .path_len = rows,
+  };
+
+  return send_req(sock, &req, -1, NULL);
+}
+
+int vt_client_stream_end(int sock, vt_job_rep_t *rep, void *res,
+                         uint32_t res_cap)
+{
+  vt_job_req_t req = {
+    .type = VT_JOB_STREAM_END,
+    .path_len = 0,
+  };
+
+  if (send_req(sock, &req, -1, NULL) != 0)
+    return -1;
+
+  return recv_rep(sock, rep, res, res_cap);
+}
+
+int vt_client_load(int sock, const void *digest, vt_job_rep_t *rep,
+                   void *out, uint32_t out_cap, uint32_t *out_size)
+{
+  vt_job_req_t req = {
+    .type = VT_JOB_LOAD,
+    .path_len = DIGEST_SIZE,
+  };
+
+  if (send_req(sock, &req, -1, digest) != 0 ||
+      recv_rep(sock, rep, NULL, 0) != 0 ||
+      read_full(sock, out_size, sizeof(*out_size)) != 0 ||
+      *out_size > out_cap)
+    return -1;
+
+  return read_full(sock, out, *out_size);
+}
@@ -0,0 +1,80 @@
+#ifndef VIDEO_TEE_DAEMON_H
+#define VIDEO_TEE_DAEMON_H
+
+/*
+ * Wire protocol of the video_tee daemon.
+ *
+ * A client connects to the daemon's Unix domain socket and sends any number
+ * of jobs over the same connection. Every job is answered with exactly one
+ * reply, in order. All fields are in host byte order.
+ */
+
+#include <stdint.h>
+
+/* Default socket the daemon listens on */
+#define VT_DAEMON_SOCKET "/run/video_tee.sock"
+
+/* Job types */
+#define VT_JOB_PATH 0 /* Image path (path_len bytes) follows the header */
+#define VT_JOB_FD   1 /* Open image fd is passed as SCM_RIGHTS with the header */
+
+/*
+ * Streaming jobs: the client opens a stream on an image that is still being
+ * written, tells the daemon as more rows are complete in the file, and ends
+ * it once the file is closed. Only END is answered, like a job. The daemon
+ * streams one image at a time; an END after a refused or broken stream
+ * answers with an error, and the client can resubmit the image as a job.
+ */
+#define VT_JOB_STREAM_BEGIN 2 /* Image fd as SCM_RIGHTS; its headers are written */
+#define VT_JOB_STREAM_ROWS  3 /* path_len stored rows are now in the file */
+#define VT_JOB_STREAM_END   4 /* All rows written; finish and sign */
+
+/*
+ * Processed images. With VT_JOB_WANT_OUTPUT set in the type of a PATH, FD
+ * or STREAM_END job, the reply is followed by a uint32_t size and that many
+ * bytes of the processed image, packed top-down in the daemon's output
+ * format (0 bytes if there is none, as for a stream or a failed job).
+ * VT_JOB_LOAD fetches an earlier image from the TA's secure storage by its
+ * digest (path_len = DIGEST_SIZE bytes follow); its reply always has the
+ * image part.
+ */
+#define VT_JOB_LOAD        5
+#define VT_JOB_WANT_OUTPUT 0x100
+
+/* Longest path accepted in a VT_JOB_PATH request */
+#define VT_MAX_PATH 4096
+
+/* Request header */
+typedef struct vt_job_req {
+  uint32_t type;
+  uint32_t path_len; /* Row count for VT_JOB_STREAM_ROWS */
+} vt_job_req_t;
+
+/*
+ * Reply header, followed by res_size bytes of signed_res_t on success. A
+ * daemon started with batching (-b) may process the image together with
+ * other clients' in one TA invocation; its reply then carries a longer
+ * batch_proof_t, which starts with the image's digest and the signature
+ * over the batch (see TA_VIDEO_PROCESS_BATCH).
+ */
+typedef struct vt_job_rep {
+  uint32_t status;   /* TEEC_SUCCESS or a TEEC error code */
+  uint32_t took_us;  /* Time spent in the TA invocation; a batch's is
+                        split evenly among its frames */
+  uint32_t res_size;
+} vt_job_rep_t;
+
+/* Client helpers (daemon_client.c) */
+int vt_client_connect(const char *sock_path);
+int vt_client_submit_path(int sock, const char *path, vt_job_rep_t *rep,
+                          void *res, uint32_t res_cap);
+int vt_client_submit_fd(int sock, int img_fd, vt_job_rep_t *rep,
+                        void *res, uint32_t res_cap);
+int vt_client_stream_begin(int sock, int img_fd);
+int vt_client_stream_rows(int sock, uint32_t rows);
+int vt_client_stream_end(int sock, vt_job_rep_t *rep, void *res,
+                         uint32_t res_cap);
+int vt_client_load(int sock, const void *digest, vt_job_rep_t *rep,
+                   void *out, uint32_t out_cap, uint32_t *out_size);
+
+#endif /* VIDEO_TEE_DAEMON_H */
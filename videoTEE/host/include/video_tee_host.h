@@ -0,0 +1,101 @@
+#ifndef VIDEO_TEE_HOST_H
+#define VIDEO_TEE_HOST_H
+
+#include <stdio.h>
+
+/* OP-TEE client API for communicating with the TA */
+#include <tee_client_api.h>
+
+/* TA's header file */
+#include <video_tee_ta.h>
+
+/* TEE resources */
+struct tee_ctx {
+  TEEC_Context ctx;
+  TEEC_Session sess;
+  /* Shared memory reused across invocations, grown to the largest frame */
+  TEEC_SharedMemory in_shm;  /* Input image */
+  TEEC_SharedMemory res_shm; /* Signed result */
+  TEEC_SharedMemory out_shm; /* Processed image */
+  uint32_t out_format;       /* IMG_FMT_* requested from the TA */
+  img_meta_t frame;          /* Last frame processed into out_shm */
+  img_meta_t stream;         /* Frame being streamed, width 0 when none */
+  /* Frames of the last batch as laid out in the shared buffers; res_shm
+   * holds its result. batch_count is 0 once the buffers were reused. */
+  batch_frame_t batch[TA_BATCH_MAX_FRAMES];
+  uint32_t batch_count;
+  /* Daemon batching: up to batch_max frames, waiting at most batch_wait_ms
+   * for more. A batch_max of 1 processes every job on its own. */
+  uint32_t batch_max;
+  unsigned int batch_wait_ms;
+};
+
+/* Current time in microseconds */
+unsigned long long gettime(void);
+
+/* Connect to the TEE, open a session to the video TA and allocate the
+ * shared result buffer. Output defaults to IMG_FMT_Y8. */
+void prepare_tee_session(struct tee_ctx *tee);
+
+/* Release shared memory, then cleanup session and context */
+void terminate_tee_session(struct tee_ctx *tee);
+
+/*
+ * Load the image in img_file, process it in the TA and fill in the signed
+ * result. took_us receives the time spent in the TA invocation.
+ * img_file is closed before returning.
+ */
+TEEC_Result run_job(struct tee_ctx *tee, FILE *img_file, signed_res_t *res_buf,
+                    unsigned long long *took_us);
+
+/*
+ * Process the images in img_files in one TA invocation, signed together
+ * (see TA_VIDEO_PROCESS_BATCH). took_us receives the time spent in the TA
+ * invocation. The files are left open. Fails with TEEC_ERROR_NOT_SUPPORTED
+ * if one of them is not a BMP the batch can map; run_job() takes those.
+ */
+TEEC_Result run_batch(struct tee_ctx *tee, FILE **img_files, uint32_t count,
+                      unsigned long long *took_us);
+
+/* Processed image of frame index of the last batch; size receives its
+ * length. NULL if there is no such frame. */
+const uint8_t *batch_output(struct tee_ctx *tee, uint32_t index,
+                            size_t *size);
+
+/* Fill in the attestation of frame index of the last batch and return how
+ * many bytes of it are used, 0 if there is no such frame */
+size_t batch_proof(struct tee_ctx *tee, uint32_t index, batch_proof_t *proof);
+
+/*
+ * Streaming: feed the TA a frame in row bands while it is still being
+ * written (see TA_VIDEO_STREAM_BEGIN). Input is packed BGR rows.
+ * stream_buffer() returns room in the shared input buffer for count rows,
+ * which stream_rows() then hands over as rows first..first+count-1,
+ * counted from the top.
+ */
+TEEC_Result stream_begin(struct tee_ctx *tee, uint32_t width, uint32_t height);
+uint8_t *stream_buffer(struct tee_ctx *tee, uint32_t count);
+TEEC_Result stream_rows(struct tee_ctx *tee, uint32_t first, uint32_t count);
+TEEC_Result stream_end(struct tee_ctx *tee, signed_res_t *res_buf);
+
+/*
+ * Load the processed image the TA stored under digest into tee->out_shm.
+ * size receives its length in bytes.
+ */
+TEEC_Result load_output(struct tee_ctx *tee, const uint8_t *digest,
+                        size_t *size);
+
+/* Write the last processed frame in tee->out_shm to a BMP file */
+int save_output(struct tee_ctx *tee, const char *path);
+
+/* Query the public key the TA signs results with */
+TEEC_Result get_pub_key(struct tee_ctx *tee, pub_key_t *pub_key);
+
+/* Serve jobs from clients of the listening Unix socket until stop_fd
+ * becomes readable (pass -1 to serve forever) */
+int vt_daemon_serve(struct tee_ctx *tee, int listen_fd, int stop_fd);
+
+/* Create, bind and listen on a Unix socket at sock_path */
+int vt_daemon_listen(const char *sock_path);
+
+#endif /* VIDEO_TEE_HOST_H */
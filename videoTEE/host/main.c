@@ -3,188 +3,249 @@
  * TEE of an ARM TrustZone CPU.
  */
 
+#define _GNU_SOURCE /* pipe2 */
+
 #include <err.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "video_tee_host.h"
+#include "video_tee_daemon.h"
+
+/* Helper to print hex values */
+void print_hex(uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    printf("%02x", buf[i]);
+  }
+  printf("\n");
+}
 
-/* OP-TEE client API for communicating with the TA */
-#include <tee_client_api.h>
+/*
+ * Process the image at path on an already open session and report the
+ * time it took. setup_us is added to the reported time, so one-shot mode
+ * keeps accounting for the session setup.
+ */
+static int run_path(struct tee_ctx *tee, char *path, unsigned long long setup_us)
+{
+  signed_res_t res_buf;
+  unsigned long long took_us;
 
-/* TA's header file */
-#include <video_tee_ta.h>
+  FILE *img_fp = fopen(path, "rb");
+  if (img_fp == NULL) {
+    fprintf(stderr, "Failed to open image %s\n", path);
+    return -1;
+  }
 
-/* BMP library */
-#include "bmp.h"
-#include "libbmp.h"
+  if (run_job(tee, img_fp, &res_buf, &took_us) != TEEC_SUCCESS)
+    return -1;
 
-/* Size of buffer to receive hash */
-#define DIGEST_SIZE (256 / 8)
+  // Print timestamp of successful computation
+  printf("Took: %lld\n", (took_us + setup_us) / 1000);
+  fflush(stdout);
+
+  /* ------------------- PRINTS ------------------- */
 
-/* Timer helper courtesy of Morten Grønnesby */
-unsigned long long gettime()
+  // printf("Hash of result: ");
+  // print_hex(res_buf.digest, DIGEST_SIZE);
+  //
+  // printf("Signed hash: ");
+  // print_hex(res_buf.signature, SIGNATURE_SIZE);
+
+  return 0;
+}
+
+/* Print the public key results are signed with, for verification */
+static int print_pub_key(struct tee_ctx *tee)
 {
-    struct timeval tv;
-    if (gettimeofday(&tv, NULL) == -1)
-    {
-        fprintf(stderr, "Could not get time\n");
-        return -1;
-    }
+  pub_key_t pub_key;
+  TEEC_Result res;
 
-    unsigned long long micros = 1000000 * tv.tv_sec + tv.tv_usec;
+  res = get_pub_key(tee, &pub_key);
+  if (res != TEEC_SUCCESS) {
+    fprintf(stderr, "Failed to get public key with code 0x%x\n", res);
+    return EXIT_FAILURE;
+  }
 
-    return micros;
+  printf("Pubkey x component: ");
+  print_hex(pub_key.pub_key_x, pub_key.pub_key_x_size);
+
+  printf("Pubkey y component: ");
+  print_hex(pub_key.pub_key_y, pub_key.pub_key_y_size);
+
+  return EXIT_SUCCESS;
 }
 
-/* Helper to print hex values */
-void print_hex(uint8_t *buf, size_t len) {
-  for (size_t i = 0; i < len; i++) {
-    printf("%02x", buf[i]);
+/*
+ * Persistent mode: keep the TEE session open and process one image path
+ * per line read from stdin. Every job is answered with exactly one line on
+ * stdout ("Took: <ms>" or "Error: <path>") so a caller can pipeline jobs.
+ */
+static int serve_stdin(struct tee_ctx *tee)
+{
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &cap, stdin)) != -1) {
+    /* Strip trailing newline */
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+
+    if (run_path(tee, line, 0) != 0) {
+      printf("Error: %s\n", line);
+      fflush(stdout);
+    }
+  }
+
+  free(line);
+  return EXIT_SUCCESS;
+}
+
+/* Write end of the pipe that stops the daemon on SIGINT/SIGTERM */
+static int stop_pipe[2] = { -1, -1 };
+
+static void on_stop_signal(int sig)
+{
+  (void)sig;
+  if (write(stop_pipe[1], "", 1) < 0) {
+    /* Nothing sensible to do from a signal handler */
   }
-  printf("\n");
 }
 
-/* Load an image into memory */
-FILE *load_img(char *path, RGB **img, img_meta_t *metadata) {
+/* Daemon mode: keep the TEE session open and take jobs over a Unix socket */
+static int serve_socket(struct tee_ctx *tee, const char *sock_path)
+{
+  struct sigaction sa;
+  int listen_fd;
+  int ret;
 
-  /* Open img file */
-  FILE *img_file = fopen(path, "rb");
+  if (pipe2(stop_pipe, O_CLOEXEC) != 0)
+    err(EXIT_FAILURE, "pipe");
 
-  /* Read file contents */
-	bmp_img img_handle;
-	bmp_img_read(&img_handle, img_file);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
 
-  /* Get image dimensions */
-  int width, height;
-  GetSize(img_handle, &width, &height);
+  listen_fd = vt_daemon_listen(sock_path);
+  if (listen_fd < 0)
+    err(EXIT_FAILURE, "Failed to listen on %s", sock_path);
 
-  /* Allocate image */
-  *img = malloc(sizeof(RGB) * width * height);
-  if (*img == NULL)
-    return img_file;
+  ret = vt_daemon_serve(tee, listen_fd, stop_pipe[0]);
 
-  /* Load from bmp */
-  LoadRegion(img_handle, 0, 0, width, height, *img);
+  close(listen_fd);
+  unlink(sock_path);
+  return ret;
+}
 
-  /* Set metadata */
-  (metadata->width) = (uint32_t)width;
-  (metadata->height) = (uint32_t)height;
+static void usage(const char *prog)
+{
+  errx(EXIT_FAILURE,
+       "usage: %s [-f y8|rgb24] [-b frames] [-t ms] "
+       "<image.bmp> [output.bmp] | -s | -d [socket] | -k",
+       prog);
+}
 
-  bmp_img_free(&img_handle);
+/* Parse a non-negative number option, or give up with the usage */
+static unsigned long parse_count(const char *prog, const char *arg)
+{
+  char *end;
+  unsigned long n = strtoul(arg, &end, 10);
 
-  return img_file;
+  if (*arg == '\0' || *end != '\0' || arg[0] == '-' || n > 1000000)
+    usage(prog);
+  return n;
 }
 
-/* Write an image from memory to disk */
-void write_img(char *path, RGB *img, img_meta_t *metadata) {
-  /* Create BMP file */
-  CreateBMP(path, metadata->width, metadata->height);
-  /* Write image data */
-  WriteRegion(path, 0, 0, metadata->width, metadata->height, img);
+/* Open the TEE session and select the output format of processed frames
+ * and how the daemon batches them */
+static void open_session(struct tee_ctx *tee, uint32_t out_format,
+                         uint32_t batch_max, unsigned int batch_wait_ms)
+{
+  prepare_tee_session(tee);
+  tee->out_format = out_format;
+  tee->batch_max = batch_max;
+  tee->batch_wait_ms = batch_wait_ms;
 }
 
 int main(int argc, char *argv[]) {
-  /* OP-TEE constructs */
-  TEEC_UUID uuid = TA_VIDEO_TEE_UUID;
-  TEEC_Result res;
-  TEEC_Context ctx;
-  TEEC_Session sess;
-  TEEC_Operation op;
-  uint32_t err_origin;
-  RGB *res_img;
-  RGB *img;
-  signed_res_t *res_buf;
-  FILE *img_fp;
-
-
-  /* Load image into memory */
-  img_meta_t *metadata = calloc(1, sizeof(img_meta_t));
-  img_fp = load_img(argv[1], &img, metadata);
-  if (img == NULL)
-    errx(EXIT_FAILURE, "failed to load image");
-
-  /* Get time before operation */
-  unsigned long long t_start = gettime();
+  const char *prog = argv[0];
+  uint32_t out_format = IMG_FMT_Y8;
+  /* Batching is off unless asked for; then wait up to 5 ms for more frames */
+  uint32_t batch_max = 1;
+  unsigned int batch_wait_ms = 5;
+  struct tee_ctx tee;
+  int ret;
+
+  for (;;) {
+    if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+      if (strcmp(argv[2], "y8") == 0)
+        out_format = IMG_FMT_Y8;
+      else if (strcmp(argv[2], "rgb24") == 0)
+        out_format = IMG_FMT_RGB24;
+      else
+        usage(prog);
+    } else if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+      /* Frames per TA invocation in daemon mode */
+      batch_max = parse_count(prog, argv[2]);
+      if (batch_max == 0 || batch_max > TA_BATCH_MAX_FRAMES)
+        usage(prog);
+    } else if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+      /* Longest a frame waits for a batch to fill up */
+      batch_wait_ms = parse_count(prog, argv[2]);
+    } else {
+      break;
+    }
+    argc -= 2;
+    argv += 2;
+  }
 
-  /* Connect to TEE */
-  res = TEEC_InitializeContext(NULL, &ctx);
-  if (res != TEEC_SUCCESS)
-    errx(EXIT_FAILURE, "Failed to initialize TEE Context with code 0x%x", res);
+  if (argc < 2 || argc > 3)
+    usage(prog);
 
-  /* Open a session to connect to the TA */
-  res = TEEC_OpenSession(&ctx, &sess, &uuid, TEEC_LOGIN_PUBLIC, NULL, NULL,
-                         &err_origin);
-  if (res != TEEC_SUCCESS) {
-    errx(EXIT_FAILURE,
-         "Failed to open session to TA with code 0x%x, origin 0x%x", res,
-         err_origin);
+  if (strcmp(argv[1], "-s") == 0) {
+    if (argc != 2)
+      usage(prog);
+    open_session(&tee, out_format, batch_max, batch_wait_ms);
+    ret = serve_stdin(&tee);
+    terminate_tee_session(&tee);
+    return ret;
   }
 
-  /* Clear operation struct */
-  memset(&op, 0, sizeof(op));
-
-  /* Insert argument for TA invocation. */
-  op.paramTypes =
-      TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_MEMREF_TEMP_OUTPUT,
-                       TEEC_MEMREF_TEMP_OUTPUT, TEEC_NONE);
-
-  /* Load image into memref to send to TA */
-  op.params[0].tmpref.size =
-      (size_t)(sizeof(RGB) * metadata->width * metadata->height);
-  op.params[0].tmpref.buffer = img;
-
-  /* Initialize output memref parameters */
-  op.params[1].tmpref.size = (size_t)sizeof(signed_res_t);
-  res_buf = calloc(1, sizeof(signed_res_t));
-  if (res_buf == NULL)
-    errx(EXIT_FAILURE, "Failed to allocate buffer for digest");
-  op.params[1].tmpref.buffer = res_buf;
-
-  op.params[2].tmpref.size = sizeof(RGB) * metadata->width * metadata->height;
-  res_img = calloc(1, sizeof(RGB) * metadata->width * metadata->height);
-  if (res_img == NULL)
-    errx(EXIT_FAILURE, "Failed to allocate buffer for result image");
-  op.params[2].tmpref.buffer = res_img;
-
-  /*
-   * Invoke TA to increment number, hash the result and
-   * sign it with its hardware key
-   */
-  // printf("Invoking TA to process image and sign the operation\n");
-  res = TEEC_InvokeCommand(&sess, TA_VIDEO_INC_SIGN, &op, &err_origin);
-  // printf("Success\n");
-  if (res != TEEC_SUCCESS)
-    errx(EXIT_FAILURE, "TA invocation failed with code 0x%x, origin 0x%x", res,
-         err_origin);
-
-  // Print timestamp of successful computation
-  unsigned long long t_finish = gettime();
-  // printf("Finished at: %lld\n", t_finish);
-  printf("Took: %lld\n", (t_finish - t_start) / 1000);
-  fclose(img_fp);
-  // char new_filename[256]; // Adjust size as needed based on the maximum expected
-                          // path length
-  /* Write processed image to disk */
-  // sprintf(new_filename, "gray%s", argv[1]);
-  // write_img(new_filename, res_img, metadata);
+  if (strcmp(argv[1], "-k") == 0) {
+    if (argc != 2)
+      usage(prog);
+    open_session(&tee, out_format, batch_max, batch_wait_ms);
+    ret = print_pub_key(&tee);
+    terminate_tee_session(&tee);
+    return ret;
+  }
 
-  /* ------------------- PRINTS ------------------- */
+  if (strcmp(argv[1], "-d") == 0) {
+    open_session(&tee, out_format, batch_max, batch_wait_ms);
+    ret = serve_socket(&tee, argc == 3 ? argv[2] : VT_DAEMON_SOCKET);
+    terminate_tee_session(&tee);
+    return ret;
+  }
 
-  // printf("Hash of result: ");
-  // print_hex(res_buf->digest, DIGEST_SIZE);
-  //
-  // printf("Signed hash: ");
-  // print_hex(res_buf->signature, SIGNATURE_SIZE);
-  //
-  // printf("Pubkey x component: ");
-  // print_hex(res_buf->pub_key_x, res_buf->pub_key_x_size);
-  //
-  // printf("Pubkey y component: ");
-  // print_hex(res_buf->pub_key_y, res_buf->pub_key_y_size);
+  /* One-shot mode: the reported time includes TEE session setup */
+  unsigned long long t_start = gettime();
+  open_session(&tee, out_format, batch_max, batch_wait_ms);
+  ret = run_path(&tee, argv[1], gettime() - t_start);
 
-  /* Cleanup session and context */
-  TEEC_CloseSession(&sess);
-  TEEC_FinalizeContext(&ctx);
+  /* Write the processed frame if asked to */
+  if (ret == 0 && argc == 3 && save_output(&tee, argv[2]) != 0) {
+    fprintf(stderr, "Failed to write %s\n", argv[2]);
+    ret = -1;
+  }
+  terminate_tee_session(&tee);
 
-  return EXIT_SUCCESS;
+  return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,572 @@
+/*
+ * TEE session handling and per-image processing shared by the one-shot,
+ * persistent (stdin) and daemon modes of the video_tee client.
+ */
+
+#include <err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "video_tee_host.h"
+
+/* BMP library */
+#include "bmp.h"
+#include "bmp_map.h"
+#include "bmp_write.h"
+#include "libbmp.h"
+
+/* Timer helper courtesy of Morten Grønnesby */
+unsigned long long gettime()
+{
+    struct timeval tv;
+    if (gettimeofday(&tv, NULL) == -1)
+    {
+        fprintf(stderr, "Could not get time\n");
+        return -1;
+    }
+
+    unsigned long long micros = 1000000 * tv.tv_sec + tv.tv_usec;
+
+    return micros;
+}
+
+/*
+ * Make sure shm can hold size bytes. The buffer is only reallocated when a
+ * larger frame than any before comes in, so a stream of same-sized frames
+ * keeps reusing the same shared memory.
+ */
+static TEEC_Result reserve_shm(struct tee_ctx *tee, TEEC_SharedMemory *shm,
+                               size_t size, uint32_t flags)
+{
+  TEEC_Result res;
+
+  if (shm->buffer != NULL && shm->size >= size)
+    return TEEC_SUCCESS;
+
+  if (shm->buffer != NULL)
+    TEEC_ReleaseSharedMemory(shm);
+
+  memset(shm, 0, sizeof(*shm));
+  shm->size = size;
+  shm->flags = flags;
+  res = TEEC_AllocateSharedMemory(&tee->ctx, shm);
+  if (res != TEEC_SUCCESS) {
+    fprintf(stderr, "Failed to allocate %zu bytes of shared memory: 0x%x\n",
+            size, res);
+    memset(shm, 0, sizeof(*shm));
+  }
+
+  return res;
+}
+
+/* Make room in the shared buffers for a width x height frame */
+static int reserve_frame(struct tee_ctx *tee, int width, int height)
+{
+  /* 64-bit, so a crafted header cannot wrap the sizes on 32-bit hosts */
+  uint64_t pixels = (uint64_t)width * height;
+  uint64_t in_size = sizeof(RGB) * pixels;
+  uint64_t out_size = IMG_FMT_BPP(tee->out_format) * pixels;
+
+  if (width <= 0 || height <= 0 || in_size > SIZE_MAX || out_size > SIZE_MAX) {
+    fprintf(stderr, "Frame of %dx%d is too large\n", width, height);
+    return -1;
+  }
+
+  if (reserve_shm(tee, &tee->in_shm, in_size,
+                  TEEC_MEM_INPUT) != TEEC_SUCCESS ||
+      reserve_shm(tee, &tee->out_shm, out_size,
+                  TEEC_MEM_OUTPUT) != TEEC_SUCCESS)
+    return -1;
+
+  return 0;
+}
+
+/* Load an image through libbmp, for files that cannot be mapped */
+static int load_img_stdio(struct tee_ctx *tee, FILE *img_file,
+                          img_meta_t *metadata) {
+
+  /* Read file contents */
+  bmp_img img_handle = { 0 };
+  if (bmp_img_read(&img_handle, img_file) != BMP_OK) {
+    /* Rows may already have been allocated when the pixel data was short */
+    if (img_handle.img_pixels != NULL)
+      bmp_img_free(&img_handle);
+    return -1;
+  }
+
+  /* Get image dimensions */
+  int width, height;
+  GetSize(img_handle, &width, &height);
+  height = abs(height);
+
+  if (reserve_frame(tee, width, height) != 0) {
+    bmp_img_free(&img_handle);
+    return -1;
+  }
+
+  /* Load from bmp */
+  LoadRegion(img_handle, 0, 0, width, height, tee->in_shm.buffer);
+
+  /* Set metadata */
+  (metadata->width) = (uint32_t)width;
+  (metadata->height) = (uint32_t)height;
+  metadata->in_format = IMG_FMT_RGB24;
+
+  bmp_img_free(&img_handle);
+
+  return 0;
+}
+
+/*
+ * Load an image straight into the shared input buffer. The file is mapped
+ * and its rows copied into in_shm in the BMP's own BGR order, which is the
+ * only copy between the page cache and the TA.
+ */
+static int load_img(struct tee_ctx *tee, FILE *img_file, img_meta_t *metadata) {
+  bmp_map map;
+
+  if (bmp_map_open(&map, fileno(img_file)) != 0)
+    return load_img_stdio(tee, img_file, metadata);
+
+  if (reserve_frame(tee, map.width, map.height) != 0) {
+    bmp_map_close(&map);
+    return -1;
+  }
+
+  /* The file may be cut short by its writer meanwhile */
+  if (bmp_map_copy(&map, tee->in_shm.buffer) != 0) {
+    fprintf(stderr, "Image was truncated while loading\n");
+    bmp_map_close(&map);
+    return -1;
+  }
+
+  metadata->width = (uint32_t)map.width;
+  metadata->height = (uint32_t)map.height;
+  metadata->in_format = IMG_FMT_BGR24;
+
+  bmp_map_close(&map);
+
+  return 0;
+}
+
+/* Write an image from memory to disk in one sequential pass */
+static int write_img(const char *path, void *img, img_meta_t *metadata) {
+  enum bmp_write_fmt fmt =
+      metadata->out_format == IMG_FMT_Y8 ? BMP_WRITE_Y8 : BMP_WRITE_RGB24;
+
+  return bmp_write_file(path, img, metadata->width, metadata->height, fmt);
+}
+
+int save_output(struct tee_ctx *tee, const char *path)
+{
+  if (tee->out_shm.buffer == NULL || tee->frame.width == 0)
+    return -1;
+
+  return write_img(path, tee->out_shm.buffer, &tee->frame);
+}
+
+void prepare_tee_session(struct tee_ctx *tee)
+{
+  TEEC_UUID uuid = TA_VIDEO_TEE_UUID;
+  TEEC_Result res;
+  uint32_t err_origin;
+
+  /* Connect to TEE */
+  res = TEEC_InitializeContext(NULL, &tee->ctx);
+  if (res != TEEC_SUCCESS)
+    errx(EXIT_FAILURE, "Failed to initialize TEE Context with code 0x%x", res);
+
+  /* Open a session to connect to the TA */
+  res = TEEC_OpenSession(&tee->ctx, &tee->sess, &uuid, TEEC_LOGIN_PUBLIC,
+                         NULL, NULL, &err_origin);
+  if (res != TEEC_SUCCESS) {
+    errx(EXIT_FAILURE,
+         "Failed to open session to TA with code 0x%x, origin 0x%x", res,
+         err_origin);
+  }
+
+  tee->out_format = IMG_FMT_Y8;
+  memset(&tee->frame, 0, sizeof(tee->frame));
+  memset(&tee->stream, 0, sizeof(tee->stream));
+  tee->batch_count = 0;
+  tee->batch_max = 1;
+  tee->batch_wait_ms = 0;
+
+  /* Image buffers are sized on the first frame */
+  memset(&tee->in_shm, 0, sizeof(tee->in_shm));
+  memset(&tee->out_shm, 0, sizeof(tee->out_shm));
+  memset(&tee->res_shm, 0, sizeof(tee->res_shm));
+  res = reserve_shm(tee, &tee->res_shm, sizeof(signed_res_t), TEEC_MEM_OUTPUT);
+  if (res != TEEC_SUCCESS)
+    errx(EXIT_FAILURE, "Failed to allocate shared result buffer");
+}
+
+void terminate_tee_session(struct tee_ctx *tee)
+{
+  if (tee->in_shm.buffer != NULL)
+    TEEC_ReleaseSharedMemory(&tee->in_shm);
+  if (tee->out_shm.buffer != NULL)
+    TEEC_ReleaseSharedMemory(&tee->out_shm);
+  if (tee->res_shm.buffer != NULL)
+    TEEC_ReleaseSharedMemory(&tee->res_shm);
+
+  TEEC_CloseSession(&tee->sess);
+  TEEC_FinalizeContext(&tee->ctx);
+}
+
+/*
+ * Invoke TA to convert the image to grayscale, hash the result and
+ * sign it with its hardware key.
+ * The image is expected in tee->in_shm; the processed image is left in
+ * tee->out_shm and the signed result in tee->res_shm. Partial memrefs into
+ * the preallocated buffers avoid the bounce copies temporary memrefs need.
+ */
+static TEEC_Result process_image(struct tee_ctx *tee, img_meta_t *metadata,
+                                 uint32_t *err_origin)
+{
+  TEEC_Operation op;
+  size_t pixels = (size_t)metadata->width * metadata->height;
+
+  /* Clear operation struct */
+  memset(&op, 0, sizeof(op));
+
+  /* Insert argument for TA invocation. */
+  op.paramTypes =
+      TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT, TEEC_MEMREF_PARTIAL_OUTPUT,
+                       TEEC_MEMREF_PARTIAL_OUTPUT, TEEC_VALUE_INPUT);
+
+  /* Input image */
+  op.params[0].memref.parent = &tee->in_shm;
+  op.params[0].memref.size = sizeof(RGB) * pixels;
+
+  /* Output memref parameters */
+  op.params[1].memref.parent = &tee->res_shm;
+  op.params[1].memref.size = sizeof(signed_res_t);
+
+  op.params[2].memref.parent = &tee->out_shm;
+  op.params[2].memref.size = IMG_FMT_BPP(metadata->out_format) * pixels;
+
+  op.params[3].value.a = metadata->out_format;
+  op.params[3].value.b = metadata->in_format;
+
+  return TEEC_InvokeCommand(&tee->sess, TA_VIDEO_INC_SIGN, &op, err_origin);
+}
+
+TEEC_Result stream_begin(struct tee_ctx *tee, uint32_t width, uint32_t height)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t err_origin;
+
+  memset(&op, 0, sizeof(op));
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT, TEEC_VALUE_INPUT,
+                                   TEEC_NONE, TEEC_NONE);
+  op.params[0].value.a = width;
+  op.params[0].value.b = height;
+  op.params[1].value.a = tee->out_format;
+  op.params[1].value.b = IMG_FMT_BGR24;
+
+  memset(&tee->stream, 0, sizeof(tee->stream));
+  res = TEEC_InvokeCommand(&tee->sess, TA_VIDEO_STREAM_BEGIN, &op,
+                           &err_origin);
+  if (res != TEEC_SUCCESS) {
+    fprintf(stderr, "Failed to start stream with code 0x%x, origin 0x%x\n",
+            res, err_origin);
+    return res;
+  }
+
+  tee->stream.width = width;
+  tee->stream.height = height;
+  tee->stream.in_format = IMG_FMT_BGR24;
+  tee->stream.out_format = tee->out_format;
+  return res;
+}
+
+uint8_t *stream_buffer(struct tee_ctx *tee, uint32_t count)
+{
+  if (tee->stream.width == 0 ||
+      reserve_shm(tee, &tee->in_shm,
+                  sizeof(RGB) * (size_t)tee->stream.width * count,
+                  TEEC_MEM_INPUT) != TEEC_SUCCESS)
+    return NULL;
+
+  return tee->in_shm.buffer;
+}
+
+TEEC_Result stream_rows(struct tee_ctx *tee, uint32_t first, uint32_t count)
+{
+  TEEC_Operation op;
+  uint32_t err_origin;
+
+  if (tee->stream.width == 0)
+    return TEEC_ERROR_BAD_STATE;
+
+  memset(&op, 0, sizeof(op));
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT, TEEC_VALUE_INPUT,
+                                   TEEC_NONE, TEEC_NONE);
+  op.params[0].memref.parent = &tee->in_shm;
+  op.params[0].memref.size = sizeof(RGB) * (size_t)tee->stream.width * count;
+  op.params[1].value.a = first;
+  op.params[1].value.b = count;
+
+  return TEEC_InvokeCommand(&tee->sess, TA_VIDEO_STREAM_ROWS, &op,
+                            &err_origin);
+}
+
+TEEC_Result stream_end(struct tee_ctx *tee, signed_res_t *res_buf)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t err_origin;
+
+  if (tee->stream.width == 0)
+    return TEEC_ERROR_BAD_STATE;
+
+  memset(&op, 0, sizeof(op));
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_OUTPUT, TEEC_NONE,
+                                   TEEC_NONE, TEEC_NONE);
+  op.params[0].memref.parent = &tee->res_shm;
+  op.params[0].memref.size = sizeof(signed_res_t);
+
+  res = TEEC_InvokeCommand(&tee->sess, TA_VIDEO_STREAM_END, &op, &err_origin);
+  if (res == TEEC_SUCCESS)
+    memcpy(res_buf, tee->res_shm.buffer, sizeof(*res_buf));
+  else
+    fprintf(stderr, "Failed to finish stream with code 0x%x, origin 0x%x\n",
+            res, err_origin);
+
+  memset(&tee->stream, 0, sizeof(tee->stream));
+  return res;
+}
+
+TEEC_Result load_output(struct tee_ctx *tee, const uint8_t *digest,
+                        size_t *size)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t err_origin;
+  size_t need = tee->out_shm.size > 0 ? tee->out_shm.size : 1;
+
+  /* out_shm no longer holds the last processed frame */
+  tee->frame.width = 0;
+  tee->batch_count = 0;
+
+  /* Retried once if the image is larger than the buffer */
+  for (int attempt = 0; attempt < 2; attempt++) {
+    res = reserve_shm(tee, &tee->out_shm, need, TEEC_MEM_OUTPUT);
+    if (res != TEEC_SUCCESS)
+      return res;
+
+    memset(&op, 0, sizeof(op));
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+                                     TEEC_MEMREF_PARTIAL_OUTPUT,
+                                     TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = (void *)digest;
+    op.params[0].tmpref.size = DIGEST_SIZE;
+    op.params[1].memref.parent = &tee->out_shm;
+    op.params[1].memref.size = tee->out_shm.size;
+
+    res = TEEC_InvokeCommand(&tee->sess, TA_VIDEO_LOAD_OUTPUT, &op,
+                             &err_origin);
+    if (res != TEEC_ERROR_SHORT_BUFFER)
+      break;
+    need = op.params[1].memref.size;
+  }
+
+  if (res == TEEC_SUCCESS)
+    *size = op.params[1].memref.size;
+  else if (res != TEEC_ERROR_ITEM_NOT_FOUND)
+    fprintf(stderr, "Failed to load output with code 0x%x, origin 0x%x\n",
+            res, err_origin);
+
+  return res;
+}
+
+TEEC_Result get_pub_key(struct tee_ctx *tee, pub_key_t *pub_key)
+{
+  TEEC_Operation op;
+  uint32_t err_origin;
+
+  memset(&op, 0, sizeof(op));
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT, TEEC_NONE,
+                                   TEEC_NONE, TEEC_NONE);
+  op.params[0].tmpref.buffer = pub_key;
+  op.params[0].tmpref.size = sizeof(*pub_key);
+
+  return TEEC_InvokeCommand(&tee->sess, TA_VIDEO_GET_PUBKEY, &op, &err_origin);
+}
+
+TEEC_Result run_job(struct tee_ctx *tee, FILE *img_file, signed_res_t *res_buf,
+                    unsigned long long *took_us)
+{
+  TEEC_Result res;
+  uint32_t err_origin;
+  img_meta_t metadata = { 0 };
+
+  /* Load image into shared memory */
+  metadata.out_format = tee->out_format;
+  if (load_img(tee, img_file, &metadata) != 0) {
+    fclose(img_file);
+    return TEEC_ERROR_BAD_PARAMETERS;
+  }
+  fclose(img_file);
+
+  /* Get time before operation */
+  unsigned long long t_start = gettime();
+
+  tee->frame.width = 0;
+  tee->batch_count = 0;
+  res = process_image(tee, &metadata, &err_origin);
+  if (res != TEEC_SUCCESS) {
+    fprintf(stderr, "TA invocation failed with code 0x%x, origin 0x%x\n",
+            res, err_origin);
+    return res;
+  }
+
+  *took_us = gettime() - t_start;
+
+  memcpy(res_buf, tee->res_shm.buffer, sizeof(*res_buf));
+
+  /* Remember the frame so save_output() can write it to disk */
+  tee->frame = metadata;
+
+  return res;
+}
+
+TEEC_Result run_batch(struct tee_ctx *tee, FILE **img_files, uint32_t count,
+                      unsigned long long *took_us)
+{
+  bmp_map maps[TA_BATCH_MAX_FRAMES];
+  uint32_t mapped = 0;
+  uint64_t in_size, out_size;
+  size_t res_size;
+  TEEC_Operation op;
+  TEEC_Result res = TEEC_SUCCESS;
+  uint32_t err_origin;
+
+  tee->frame.width = 0;
+  tee->batch_count = 0;
+  if (count == 0 || count > TA_BATCH_MAX_FRAMES)
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  /* The descriptors come first in the input buffer, then the frames */
+  in_size = count * sizeof(batch_frame_t);
+  out_size = 0;
+  for (; mapped < count; mapped++) {
+    batch_frame_t *f = &tee->batch[mapped];
+    bmp_map *map = &maps[mapped];
+
+    if (bmp_map_open(map, fileno(img_files[mapped])) != 0) {
+      res = TEEC_ERROR_NOT_SUPPORTED;
+      goto out;
+    }
+
+    uint64_t pixels = (uint64_t)map->width * map->height;
+    f->width = (uint32_t)map->width;
+    f->height = (uint32_t)map->height;
+    f->in_format = IMG_FMT_BGR24;
+    f->out_format = tee->out_format;
+    f->in_offset = (uint32_t)in_size;
+    f->out_offset = (uint32_t)out_size;
+    in_size += sizeof(RGB) * pixels;
+    out_size += IMG_FMT_BPP(tee->out_format) * pixels;
+
+    /* Offsets are 32-bit */
+    if (in_size > UINT32_MAX || out_size > UINT32_MAX) {
+      mapped++;
+      res = TEEC_ERROR_EXCESS_DATA;
+      goto out;
+    }
+  }
+
+  res_size = TA_BATCH_RES_SIZE(count);
+  if ((res = reserve_shm(tee, &tee->in_shm, in_size,
+                         TEEC_MEM_INPUT)) != TEEC_SUCCESS ||
+      (res = reserve_shm(tee, &tee->out_shm, out_size,
+                         TEEC_MEM_OUTPUT)) != TEEC_SUCCESS ||
+      (res = reserve_shm(tee, &tee->res_shm, res_size,
+                         TEEC_MEM_OUTPUT)) != TEEC_SUCCESS)
+    goto out;
+
+  uint8_t *in = tee->in_shm.buffer;
+  memcpy(in, tee->batch, count * sizeof(batch_frame_t));
+  for (uint32_t i = 0; i < count; i++) {
+    /* A truncated frame fails the batch; it is retried frame by frame */
+    if (bmp_map_copy(&maps[i], in + tee->batch[i].in_offset) != 0) {
+      res = TEEC_ERROR_NOT_SUPPORTED;
+      goto out;
+    }
+  }
+
+  memset(&op, 0, sizeof(op));
+  op.paramTypes =
+      TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT, TEEC_MEMREF_PARTIAL_OUTPUT,
+                       TEEC_MEMREF_PARTIAL_OUTPUT, TEEC_VALUE_INPUT);
+  op.params[0].memref.parent = &tee->in_shm;
+  op.params[0].memref.size = in_size;
+  op.params[1].memref.parent = &tee->res_shm;
+  op.params[1].memref.size = res_size;
+  op.params[2].memref.parent = &tee->out_shm;
+  op.params[2].memref.size = out_size;
+  op.params[3].value.a = count;
+
+  unsigned long long t_start = gettime();
+  res = TEEC_InvokeCommand(&tee->sess, TA_VIDEO_PROCESS_BATCH, &op,
+                           &err_origin);
+  *took_us = gettime() - t_start;
+
+  if (res == TEEC_SUCCESS)
+    tee->batch_count = count;
+  else
+    fprintf(stderr, "Batch of %u failed with code 0x%x, origin 0x%x\n",
+            count, res, err_origin);
+
+out:
+  for (uint32_t i = 0; i < mapped; i++)
+    bmp_map_close(&maps[i]);
+  return res;
+}
+
+const uint8_t *batch_output(struct tee_ctx *tee, uint32_t index,
+                            size_t *size)
+{
+  if (index >= tee->batch_count)
+    return NULL;
+
+  batch_frame_t *f = &tee->batch[index];
+  *size = IMG_FMT_BPP(f->out_format) * (size_t)f->width * f->height;
+  return (const uint8_t *)tee->out_shm.buffer + f->out_offset;
+}
+
+size_t batch_proof(struct tee_ctx *tee, uint32_t index, batch_proof_t *proof)
+{
+  uint32_t count = tee->batch_count;
+  uint32_t depth = 0;
+
+  if (index >= count)
+    return 0;
+
+  /* signed_res_t over the root, the frame digests, then the tree */
+  const signed_res_t *root = tee->res_shm.buffer;
+  const uint8_t *digests = (const uint8_t *)(root + 1);
+  const uint8_t *level = digests + count * DIGEST_SIZE;
+
+  memcpy(proof->res.digest, digests + index * DIGEST_SIZE, DIGEST_SIZE);
+  memcpy(proof->res.signature, root->signature, SIGNATURE_SIZE);
+  proof->index = index;
+  proof->count = count;
+
+  /* The sibling on each level, where the node has one */
+  for (uint32_t m = count, i = index; m > 1; level += m * DIGEST_SIZE,
+       m = (m + 1) / 2, i /= 2) {
+    if ((i ^ 1) < m)
+      memcpy(proof->path[depth++], level + (i ^ 1) * DIGEST_SIZE,
+             DIGEST_SIZE);
+  }
+
+  return offsetof(batch_proof_t, path) + depth * DIGEST_SIZE;
+}
@@ -19,8 +19,17 @@ void LoadRegion(const bmp_img img, const int x,const int y,const int width,const
 }
 
 void WriteRegion(const char* filepath,const int x,const int y,const int width,const int height,RGB* region){
-    bmp_img img;
-	bmp_img_read (&img, filepath);
+    bmp_img img = { 0 };
+    FILE* file=fopen(filepath,"rb");
+    if(file==NULL)
+        return;
+    if(bmp_img_read(&img,file)!=BMP_OK){
+        fclose(file);
+        if(img.img_pixels!=NULL)
+            bmp_img_free(&img);
+        return;
+    }
+    fclose(file);
     // Load region
     for(int curY=y;curY<y+height;curY++){
         for(int curX=x;curX<x+width;curX++){
@@ -0,0 +1,192 @@
+#include "bmp_map.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Size of BITMAPINFOHEADER
+#define BMP_INFO_HEADER 40
+
+// Largest dimension accepted, keeps a row and its offset within 32 bits
+#define BMP_MAP_MAX_DIM (1 << 16)
+
+static uint32_t le32(const uint8_t *p){
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t le16(const uint8_t *p){
+    return p[0] | p[1] << 8;
+}
+
+int bmp_layout_parse(bmp_layout *l, const void *hdr, size_t size){
+    const uint8_t *h = hdr;
+
+    memset(l, 0, sizeof(*l));
+    if(size < BMP_LAYOUT_HEADER){
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Uncompressed 24-bit only
+    int32_t width = (int32_t)le32(h + 18);
+    int32_t height = (int32_t)le32(h + 22);
+    if(h[0] != 'B' || h[1] != 'M' ||
+       le32(h + 14) < BMP_INFO_HEADER ||
+       le16(h + 26) != 1 || le16(h + 28) != 24 || le32(h + 30) != 0 ||
+       width <= 0 || width > BMP_MAP_MAX_DIM ||
+       height == 0 || height > BMP_MAP_MAX_DIM || height < -BMP_MAP_MAX_DIM ||
+       le32(h + 10) < BMP_LAYOUT_HEADER){
+        errno = EINVAL;
+        return -1;
+    }
+
+    l->width = width;
+    l->height = height < 0 ? -height : height;
+    l->bottom_up = height > 0;
+    l->off_bits = le32(h + 10);
+    // Rows are padded to 4 bytes
+    l->row = (3 * (size_t)width + 3) & ~(size_t)3;
+    return 0;
+}
+
+int bmp_map_open(bmp_map *m, int fd){
+    struct stat st;
+    bmp_layout l;
+
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+
+    if(fstat(fd, &st) != 0)
+        return -1;
+    if(st.st_size < BMP_LAYOUT_HEADER){
+        errno = EINVAL;
+        return -1;
+    }
+
+    m->map_size = st.st_size;
+    m->map = mmap(NULL, m->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(m->map == MAP_FAILED){
+        m->map = NULL;
+        return -1;
+    }
+    m->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(m->fd < 0){
+        int err = errno;
+        bmp_map_close(m);
+        errno = err;
+        return -1;
+    }
+    // The whole file is read once, front to back
+    madvise(m->map, m->map_size, MADV_SEQUENTIAL);
+    madvise(m->map, m->map_size, MADV_WILLNEED);
+
+    // Validate the header once. row * height may not fit a 32-bit size_t,
+    // so compare by division: the pixels must fit the mapping
+    if(bmp_layout_parse(&l, m->map, m->map_size) != 0 ||
+       l.off_bits > m->map_size ||
+       l.height > (m->map_size - l.off_bits) / l.row)
+        goto invalid;
+
+    const uint8_t *pixels = (const uint8_t *)m->map + l.off_bits;
+    m->width = l.width;
+    m->height = l.height;
+    if(l.bottom_up){
+        // Bottom-up: the top row is stored last
+        m->top = pixels + (l.height - 1) * l.row;
+        m->stride = -(ptrdiff_t)l.row;
+    } else {
+        m->top = pixels;
+        m->stride = l.row;
+    }
+    return 0;
+
+invalid:
+    bmp_map_close(m);
+    errno = EINVAL;
+    return -1;
+}
+
+// Where a SIGBUS during bmp_map_copy() on this thread returns to
+static __thread sigjmp_buf *copy_fault;
+static struct sigaction prev_sigbus;
+
+static void copy_sigbus(int sig, siginfo_t *info, void *ctx){
+    if(copy_fault != NULL)
+        siglongjmp(*copy_fault, 1);
+
+    // Not a copy: hand the fault to whoever had it before, or retry it with
+    // the default action, which ends the process as it would have
+    if(prev_sigbus.sa_flags & SA_SIGINFO)
+        prev_sigbus.sa_sigaction(sig, info, ctx);
+    else if(prev_sigbus.sa_handler == SIG_DFL ||
+            prev_sigbus.sa_handler == SIG_IGN)
+        signal(SIGBUS, SIG_DFL);
+    else
+        prev_sigbus.sa_handler(sig);
+}
+
+// Catch SIGBUS from the mapping once, keeping the handler that was there
+static void guard_sigbus(void){
+    struct sigaction sa, cur;
+
+    sigaction(SIGBUS, NULL, &cur);
+    if((cur.sa_flags & SA_SIGINFO) && cur.sa_sigaction == copy_sigbus)
+        return;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = copy_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    prev_sigbus = cur;
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+int bmp_map_copy(const bmp_map *m, void *dst){
+    size_t row = 3 * (size_t)m->width;
+    uint8_t *out = dst;
+    struct stat st;
+    sigjmp_buf fault;
+
+    // The file may have been truncated since it was mapped; touching pages
+    // past its end raises SIGBUS. Refuse a file that is already short, and
+    // catch one that shrinks during the copy.
+    if(fstat(m->fd, &st) != 0)
+        return -1;
+    if((size_t)st.st_size < m->map_size){
+        errno = EIO;
+        return -1;
+    }
+
+    guard_sigbus();
+    if(sigsetjmp(fault, 1) != 0){
+        copy_fault = NULL;
+        errno = EIO;
+        return -1;
+    }
+    copy_fault = &fault;
+
+    if(m->stride == (ptrdiff_t)row){
+        // Top-down without padding is already the packed layout
+        memcpy(out, m->top, row * m->height);
+    } else {
+        for(int y = 0; y < m->height; y++)
+            memcpy(out + y * row, BMP_MAP_ROW(m, y), row);
+    }
+
+    copy_fault = NULL;
+    return 0;
+}
+
+void bmp_map_close(bmp_map *m){
+    if(m->map != NULL)
+        munmap(m->map, m->map_size);
+    if(m->fd >= 0)
+        close(m->fd);
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Read-only view of the pixels of a 24-bit BMP file, mapped straight from
+ * the page cache. Rows keep the file's BGR byte order and padding; the
+ * view hides whether the file is stored bottom-up or top-down.
+ */
+typedef struct bmp_map {
+  void          *map;      // Whole file mapping
+  size_t         map_size;
+  int            fd;       // Own descriptor of the file, to notice it shrinking
+  int            width;
+  int            height;   // Always positive
+  const uint8_t *top;      // First byte of the top row
+  ptrdiff_t      stride;   // Bytes from one row to the next one down
+} bmp_map;
+
+// Bytes of the file and info headers, enough for bmp_layout_parse()
+#define BMP_LAYOUT_HEADER 54
+
+// Where the pixels of a 24-bit BMP are, as described by its headers
+typedef struct bmp_layout {
+    int    width;
+    int    height;    // Always positive
+    int    bottom_up; // Stored rows run from the bottom row up
+    size_t off_bits;  // Offset of the first stored row
+    size_t row;       // Bytes per stored row, padding included
+} bmp_layout;
+
+// Validate the headers at the start of a file, 0 on success. Only the
+// BMP_LAYOUT_HEADER bytes at hdr are read; the pixels need not exist yet.
+int bmp_layout_parse(bmp_layout *l, const void *hdr, size_t size);
+
+// Pointer to row y, counting from the top
+#define BMP_MAP_ROW(m, y) ((m)->top + (ptrdiff_t)(y) * (m)->stride)
+
+// Map and validate the BMP open on fd, 0 on success. fd may be closed after.
+int bmp_map_open(bmp_map *m, int fd);
+
+// Copy the pixels as packed, top-down BGR rows into dst (3 * width * height
+// bytes), 0 on success. Fails with EIO instead of raising SIGBUS if the file
+// was truncated under the mapping.
+int bmp_map_copy(const bmp_map *m, void *dst);
+
+void bmp_map_close(bmp_map *m);
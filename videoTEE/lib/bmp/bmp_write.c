@@ -0,0 +1,161 @@
+#define _GNU_SOURCE // pwritev
+
+#include "bmp_write.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// File + info header, and the 8-bit gray palette
+#define BMP_HEADER_SIZE 54
+#define BMP_PALETTE_SIZE (256 * 4)
+
+// Rows handed to one pwritev call, two iovecs per row
+#define BMP_WRITE_ROWS 256
+
+static void put_le32(uint8_t *p, uint32_t v){
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_le16(uint8_t *p, uint16_t v){
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+// Write all iovecs at off, resuming after short writes
+static int pwritev_full(int fd, struct iovec *iov, int cnt, off_t off){
+    while(cnt > 0){
+        ssize_t n = pwritev(fd, iov, cnt, off);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(n == 0){
+            errno = EIO;
+            return -1;
+        }
+        off += n;
+
+        // Drop what was written
+        while(cnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if(cnt > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int bmp_write_fd(int fd, off_t offset, const void *pixels, int width,
+                 int height, enum bmp_write_fmt fmt){
+    static const uint8_t padding[3];
+    const size_t bpp = fmt == BMP_WRITE_Y8 ? 1 : 3;
+    const size_t row = bpp * width;
+    const size_t stride = (row + 3) & ~(size_t)3;
+    const size_t pad = stride - row;
+    const uint8_t *src = pixels;
+    uint8_t header[BMP_HEADER_SIZE + BMP_PALETTE_SIZE];
+    struct iovec iov[2 * BMP_WRITE_ROWS + 1];
+    uint8_t *stage = NULL;
+    int cnt = 0, ret = 0;
+
+    if(width <= 0 || height <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+
+    // BITMAPFILEHEADER + BITMAPINFOHEADER, bottom-up rows
+    size_t off_bits = BMP_HEADER_SIZE + (fmt == BMP_WRITE_Y8 ? BMP_PALETTE_SIZE : 0);
+    memset(header, 0, BMP_HEADER_SIZE);
+    header[0] = 'B';
+    header[1] = 'M';
+    put_le32(header + 2, off_bits + stride * height);
+    put_le32(header + 10, off_bits);
+    put_le32(header + 14, 40);
+    put_le32(header + 18, width);
+    put_le32(header + 22, height);
+    put_le16(header + 26, 1);
+    put_le16(header + 28, 8 * bpp);
+    put_le32(header + 34, stride * height);
+    if(fmt == BMP_WRITE_Y8){
+        put_le32(header + 46, 256);
+        // Gray ramp palette, entries are B,G,R,reserved
+        for(int i = 0; i < 256; i++){
+            uint8_t *entry = header + BMP_HEADER_SIZE + 4 * i;
+            entry[0] = entry[1] = entry[2] = i;
+            entry[3] = 0;
+        }
+    }
+    iov[cnt].iov_base = header;
+    iov[cnt++].iov_len = off_bits;
+
+    // Red-first rows are swapped into a staging buffer, a batch at a time
+    if(fmt == BMP_WRITE_RGB24){
+        stage = calloc(BMP_WRITE_ROWS, stride);
+        if(stage == NULL)
+            return -1;
+    }
+
+    for(int y = height - 1, k = 0; y >= 0; y--, k++){
+        const uint8_t *line = src + (size_t)y * row;
+
+        if(stage != NULL){
+            uint8_t *out = stage + (size_t)k * stride;
+            for(int x = 0; x < width; x++){
+                out[3 * x] = line[3 * x + 2];
+                out[3 * x + 1] = line[3 * x + 1];
+                out[3 * x + 2] = line[3 * x];
+            }
+            iov[cnt].iov_base = out;
+            iov[cnt++].iov_len = stride;
+        } else {
+            iov[cnt].iov_base = (void *)line;
+            iov[cnt++].iov_len = row;
+            if(pad > 0){
+                iov[cnt].iov_base = (void *)padding;
+                iov[cnt++].iov_len = pad;
+            }
+        }
+
+        // Flush a full batch, and the last one
+        if(k + 1 == BMP_WRITE_ROWS || y == 0){
+            size_t len = 0;
+            for(int i = 0; i < cnt; i++)
+                len += iov[i].iov_len;
+            if(pwritev_full(fd, iov, cnt, offset) != 0){
+                ret = -1;
+                break;
+            }
+            offset += len;
+            cnt = 0;
+            k = -1;
+        }
+    }
+
+    free(stage);
+    return ret;
+}
+
+int bmp_write_file(const char *filepath, const void *pixels, int width,
+                   int height, enum bmp_write_fmt fmt){
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return -1;
+
+    int ret = bmp_write_fd(fd, 0, pixels, width, height, fmt);
+    if(close(fd) != 0)
+        ret = -1;
+    return ret;
+}
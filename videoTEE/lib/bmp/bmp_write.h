@@ -0,0 +1,20 @@
+#pragma once
+
+#include <sys/types.h>
+
+// Pixel layouts bmp_write_fd() accepts
+enum bmp_write_fmt {
+  BMP_WRITE_Y8,    // 8-bit gray, written with a gray palette
+  BMP_WRITE_RGB24, // Packed 24-bit, red first (swapped while writing)
+  BMP_WRITE_BGR24  // Packed 24-bit, blue first as stored in the file
+};
+
+// Write a top-down, packed pixel buffer as a bottom-up BMP at offset of fd.
+// Header and padded rows go out sequentially with pwritev, straight from
+// pixels where the layout allows. Returns 0 on success.
+int bmp_write_fd(int fd, off_t offset, const void *pixels, int width,
+                 int height, enum bmp_write_fmt fmt);
+
+// Create or truncate filepath and write the image to it
+int bmp_write_file(const char *filepath, const void *pixels, int width,
+                   int height, enum bmp_write_fmt fmt);
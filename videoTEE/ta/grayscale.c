@@ -0,0 +1,198 @@
+/*
+ * Fixed-point grayscale kernels used by the TA.
+ *
+ * Kept free of TEE APIs so the host tests can build and check them natively.
+ */
+
+#include <grayscale.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GRAY_NEON 1
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define GRAY_SSSE3 1
+#endif
+
+/* w0 and w2 are the weights of the first and third byte of a pixel */
+static inline uint8_t gray_px(const uint8_t *px, int w0, int w2)
+{
+  return (uint8_t)((px[0] * w0 + px[1] * GRAY_W_GREEN + px[2] * w2) >> 8);
+}
+
+#if defined(GRAY_NEON)
+
+/*
+ * 16 pixels per iteration: vld3q splits the channels, the weighted sum is
+ * accumulated in 16-bit lanes and narrowed back with a shift by 8.
+ */
+static size_t gray_block(const uint8_t *src, uint8_t *dst, size_t pixels,
+                         int expand, int w0, int w2)
+{
+  const uint8x8_t wr = vdup_n_u8(w0);
+  const uint8x8_t wg = vdup_n_u8(GRAY_W_GREEN);
+  const uint8x8_t wb = vdup_n_u8(w2);
+  size_t i;
+
+  for (i = 0; i + GRAY_BLOCK <= pixels; i += GRAY_BLOCK) {
+    uint8x16x3_t px = vld3q_u8(src + 3 * i);
+    uint16x8_t lo, hi;
+    uint8x16_t gray;
+
+    lo = vmull_u8(vget_low_u8(px.val[0]), wr);
+    lo = vmlal_u8(lo, vget_low_u8(px.val[1]), wg);
+    lo = vmlal_u8(lo, vget_low_u8(px.val[2]), wb);
+    hi = vmull_u8(vget_high_u8(px.val[0]), wr);
+    hi = vmlal_u8(hi, vget_high_u8(px.val[1]), wg);
+    hi = vmlal_u8(hi, vget_high_u8(px.val[2]), wb);
+    gray = vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+
+    if (expand) {
+      uint8x16x3_t out = { { gray, gray, gray } };
+      vst3q_u8(dst + 3 * i, out);
+    } else {
+      vst1q_u8(dst + i, gray);
+    }
+  }
+
+  return i;
+}
+
+#elif defined(GRAY_SSSE3)
+
+#define X (-1) /* pshufb: zero the byte */
+
+/*
+ * 16 pixels per iteration: three 16-byte loads are deinterleaved into
+ * channel vectors with pshufb, widened to 16 bits for the weighted sum and
+ * packed back down.
+ */
+static size_t gray_block(const uint8_t *src, uint8_t *dst, size_t pixels,
+                         int expand, int w0, int w2)
+{
+  const __m128i r0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, X, X, X, X, X, X, X, X, X, X);
+  const __m128i r1 = _mm_setr_epi8(X, X, X, X, X, X, 2, 5, 8, 11, 14, X, X, X, X, X);
+  const __m128i r2 = _mm_setr_epi8(X, X, X, X, X, X, X, X, X, X, X, 1, 4, 7, 10, 13);
+  const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, X, X, X, X, X, X, X, X, X, X, X);
+  const __m128i g1 = _mm_setr_epi8(X, X, X, X, X, 0, 3, 6, 9, 12, 15, X, X, X, X, X);
+  const __m128i g2 = _mm_setr_epi8(X, X, X, X, X, X, X, X, X, X, X, 2, 5, 8, 11, 14);
+  const __m128i b0 = _mm_setr_epi8(2, 5, 8, 11, 14, X, X, X, X, X, X, X, X, X, X, X);
+  const __m128i b1 = _mm_setr_epi8(X, X, X, X, X, 1, 4, 7, 10, 13, X, X, X, X, X, X);
+  const __m128i b2 = _mm_setr_epi8(X, X, X, X, X, X, X, X, X, X, 0, 3, 6, 9, 12, 15);
+  const __m128i e0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+  const __m128i e1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+  const __m128i e2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+  const __m128i wr = _mm_set1_epi16(w0);
+  const __m128i wg = _mm_set1_epi16(GRAY_W_GREEN);
+  const __m128i wb = _mm_set1_epi16(w2);
+  const __m128i zero = _mm_setzero_si128();
+  size_t i;
+
+  for (i = 0; i + GRAY_BLOCK <= pixels; i += GRAY_BLOCK) {
+    const __m128i *in = (const __m128i *)(src + 3 * i);
+    __m128i a = _mm_loadu_si128(in);
+    __m128i b = _mm_loadu_si128(in + 1);
+    __m128i c = _mm_loadu_si128(in + 2);
+    __m128i r, g, bl, lo, hi, gray;
+
+    r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(b, r1)),
+                     _mm_shuffle_epi8(c, r2));
+    g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(b, g1)),
+                     _mm_shuffle_epi8(c, g2));
+    bl = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(b, b1)),
+                      _mm_shuffle_epi8(c, b2));
+
+    lo = _mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), wr);
+    lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), wg));
+    lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(bl, zero), wb));
+    hi = _mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), wr);
+    hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), wg));
+    hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(bl, zero), wb));
+    gray = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+
+    if (expand) {
+      __m128i *out = (__m128i *)(dst + 3 * i);
+      _mm_storeu_si128(out, _mm_shuffle_epi8(gray, e0));
+      _mm_storeu_si128(out + 1, _mm_shuffle_epi8(gray, e1));
+      _mm_storeu_si128(out + 2, _mm_shuffle_epi8(gray, e2));
+    } else {
+      _mm_storeu_si128((__m128i *)(dst + i), gray);
+    }
+  }
+
+  return i;
+}
+
+#undef X
+
+#else
+
+/*
+ * Portable path: the same 16-pixel blocks in plain C. The gray values are
+ * computed into a local block before storing, so in-place conversion is
+ * safe and the compiler is free to vectorize the inner loops.
+ */
+static size_t gray_block(const uint8_t *src, uint8_t *dst, size_t pixels,
+                         int expand, int w0, int w2)
+{
+  uint8_t gray[GRAY_BLOCK];
+  size_t i;
+
+  for (i = 0; i + GRAY_BLOCK <= pixels; i += GRAY_BLOCK) {
+    for (int j = 0; j < GRAY_BLOCK; j++)
+      gray[j] = gray_px(src + 3 * (i + j), w0, w2);
+
+    for (int j = 0; j < GRAY_BLOCK; j++) {
+      if (expand) {
+        dst[3 * (i + j)] = gray[j];
+        dst[3 * (i + j) + 1] = gray[j];
+        dst[3 * (i + j) + 2] = gray[j];
+      } else {
+        dst[i + j] = gray[j];
+      }
+    }
+  }
+
+  return i;
+}
+
+#endif
+
+static void gray_y8(const uint8_t *src, uint8_t *dst, size_t pixels,
+                    int w0, int w2)
+{
+  for (size_t i = gray_block(src, dst, pixels, 0, w0, w2); i < pixels; i++)
+    dst[i] = gray_px(src + 3 * i, w0, w2);
+}
+
+static void gray_rgb24(const uint8_t *src, uint8_t *dst, size_t pixels,
+                       int w0, int w2)
+{
+  for (size_t i = gray_block(src, dst, pixels, 1, w0, w2); i < pixels; i++) {
+    uint8_t gray = gray_px(src + 3 * i, w0, w2);
+
+    dst[3 * i] = gray;
+    dst[3 * i + 1] = gray;
+    dst[3 * i + 2] = gray;
+  }
+}
+
+void gray_rgb24_to_y8(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+  gray_y8(src, dst, pixels, GRAY_W_RED, GRAY_W_BLUE);
+}
+
+void gray_rgb24_to_rgb24(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+  gray_rgb24(src, dst, pixels, GRAY_W_RED, GRAY_W_BLUE);
+}
+
+void gray_bgr24_to_y8(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+  gray_y8(src, dst, pixels, GRAY_W_BLUE, GRAY_W_RED);
+}
+
+void gray_bgr24_to_rgb24(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+  gray_rgb24(src, dst, pixels, GRAY_W_BLUE, GRAY_W_RED);
+}
@@ -0,0 +1,33 @@
+#ifndef GRAYSCALE_H
+#define GRAYSCALE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fixed-point grayscale conversion of packed 24-bit RGB pixels.
+ *
+ * The 0.3/0.59/0.11 weights are scaled by 256 and sum to 256, so a pixel
+ * never overflows 16 bits and the result is within 1 LSB of the
+ * floating-point formula. Uses NEON on ARM and SSSE3 on x86 when the
+ * compiler targets them, and a portable loop otherwise.
+ */
+
+#define GRAY_W_RED 77
+#define GRAY_W_GREEN 151
+#define GRAY_W_BLUE 28
+
+/* Pixels handled per iteration of the vector loops */
+#define GRAY_BLOCK 16
+
+/* Write one gray byte per pixel to dst. dst may alias src. */
+void gray_rgb24_to_y8(const uint8_t *src, uint8_t *dst, size_t pixels);
+
+/* Write the gray value to all three channels of dst. dst may alias src. */
+void gray_rgb24_to_rgb24(const uint8_t *src, uint8_t *dst, size_t pixels);
+
+/* Same for pixels stored blue first, as in BMP files */
+void gray_bgr24_to_y8(const uint8_t *src, uint8_t *dst, size_t pixels);
+void gray_bgr24_to_rgb24(const uint8_t *src, uint8_t *dst, size_t pixels);
+
+#endif /* GRAYSCALE_H */
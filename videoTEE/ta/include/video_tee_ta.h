@@ -9,6 +9,71 @@
 
 /* Operations */
 #define TA_VIDEO_INC_SIGN 0
+#define TA_VIDEO_GET_PUBKEY 1 /* Public key of the TA signing key */
+
+/*
+ * Streaming: a frame is handed over in row bands while it is still being
+ * written, then finalized. The attestation is the same as TA_VIDEO_INC_SIGN
+ * gives for the whole frame.
+ *  BEGIN: params[0].value a = width, b = height;
+ *         params[1].value a = output format, b = input format
+ *  ROWS:  params[0].memref = count packed input rows,
+ *         params[1].value a = first row (from the top), b = count
+ *  END:   params[0].memref = attestation (signed_res_t)
+ */
+#define TA_VIDEO_STREAM_BEGIN 2
+#define TA_VIDEO_STREAM_ROWS 3
+#define TA_VIDEO_STREAM_END 4
+
+/* Largest width or height of a streamed frame */
+#define TA_STREAM_MAX_DIM (1 << 16)
+
+/*
+ * Every processed image is kept in secure storage under its digest.
+ *  LOAD_OUTPUT: params[0].memref = digest,
+ *               params[1].memref = image out, packed as it was processed
+ */
+#define TA_VIDEO_LOAD_OUTPUT 5
+
+/*
+ * Batches: many frames processed in one invocation under one signature.
+ *  PROCESS_BATCH: params[0].memref = count batch_frame_t, then the frames'
+ *                 packed input pixels at their in_offset,
+ *                 params[1].memref = batch result (see below),
+ *                 params[2].memref = processed images at their out_offset,
+ *                 params[3].value a = frame count
+ *
+ * Each frame is digested and kept in secure storage as TA_VIDEO_INC_SIGN
+ * does. Instead of signing every digest, the TA builds a Merkle tree over
+ * them and signs its root. The result is a signed_res_t whose digest is the
+ * root, then the count frame digests, then every node of the tree level by
+ * level from the leaves up (ta_batch_nodes(count) of them, the root last):
+ *   leaf i = SHA-256(0x00 || digest i)
+ *   node   = SHA-256(0x01 || left || right)
+ * A level with an odd number of nodes carries its last node up unchanged.
+ * A frame is verified from its digest, its index, the frame count and the
+ * siblings on its path to the root.
+ */
+#define TA_VIDEO_PROCESS_BATCH 6
+
+/* Most frames in a batch, and the depth of its tree */
+#define TA_BATCH_MAX_FRAMES 64
+#define TA_BATCH_MAX_DEPTH 6
+
+/* Domain separation of the tree's hashes */
+#define TA_MERKLE_LEAF 0x00
+#define TA_MERKLE_NODE 0x01
+
+/* One frame of a batch. Offsets are in bytes from the start of the input
+ * and output memrefs. */
+typedef struct batch_frame {
+  uint32_t width;
+  uint32_t height;
+  uint32_t in_format;  /* IMG_FMT_RGB24 or IMG_FMT_BGR24 */
+  uint32_t out_format; /* IMG_FMT_Y8 or IMG_FMT_RGB24 */
+  uint32_t in_offset;
+  uint32_t out_offset;
+} batch_frame_t;
 
 /* Size of digest (using SHA256) */
 #define DIGEST_SIZE (256 / 8)
@@ -20,20 +85,65 @@
 /* Size of a signature */
 #define SIGNATURE_SIZE DIGEST_SIZE * 2
 
+/* Image formats of TA_VIDEO_INC_SIGN. The output format is passed as
+ * params[3].value.a, the input format as params[3].value.b. */
+#define IMG_FMT_Y8 0    /* 8-bit single-channel gray (default output) */
+#define IMG_FMT_RGB24 1 /* Packed 24-bit, red first */
+#define IMG_FMT_BGR24 2 /* Packed 24-bit, blue first as in BMP files (input only) */
+
+/* Bytes per output pixel of a format */
+#define IMG_FMT_BPP(fmt) ((fmt) == IMG_FMT_Y8 ? 1 : 3)
+
 /* Image metadata */
 typedef struct img_meta {
   uint32_t width;
   uint32_t height;
+  uint32_t in_format;  /* IMG_FMT_RGB24 or IMG_FMT_BGR24 */
+  uint32_t out_format; /* IMG_FMT_Y8 or IMG_FMT_RGB24 */
 } img_meta_t;
 
 /* Structure of output data */
 typedef struct signed_res {
   uint8_t digest[DIGEST_SIZE];
   uint8_t signature[SIGNATURE_SIZE]; // Signed digest
-  uint8_t pub_key_x[ECDSA_KEY_SIZE_BYTES]; // Pub key for verification
+} signed_res_t;
+
+/*
+ * Attestation of one frame of a batch: the frame's digest and the batch's
+ * signature, laid out like a signed_res_t, then what it takes to rebuild
+ * the signed root from that digest: the frame's index, the frame count and
+ * the siblings on its path up, one for each level that has one. Only the
+ * siblings used are sent.
+ */
+typedef struct batch_proof {
+  signed_res_t res; /* Digest of this frame, signature over the root */
+  uint32_t index;
+  uint32_t count;
+  uint8_t path[TA_BATCH_MAX_DEPTH][DIGEST_SIZE];
+} batch_proof_t;
+
+/* Nodes of the Merkle tree over n frames, leaves and root included */
+static inline uint32_t ta_batch_nodes(uint32_t n)
+{
+  uint32_t nodes = n;
+
+  while (n > 1) {
+    n = (n + 1) / 2;
+    nodes += n;
+  }
+  return nodes;
+}
+
+/* Size of the result of a batch of n frames */
+#define TA_BATCH_RES_SIZE(n) \
+    (sizeof(signed_res_t) + ((n) + ta_batch_nodes(n)) * DIGEST_SIZE)
+
+/* Public key for verification, returned by TA_VIDEO_GET_PUBKEY */
+typedef struct pub_key {
+  uint8_t pub_key_x[ECDSA_KEY_SIZE_BYTES];
   uint32_t pub_key_x_size; // Component size can vary (?)
   uint8_t pub_key_y[ECDSA_KEY_SIZE_BYTES];
   uint32_t pub_key_y_size;
-} signed_res_t;
+} pub_key_t;
 
 #endif // !VIDEO_TEE_TA_H
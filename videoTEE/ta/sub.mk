@@ -1,2 +1,3 @@
 global-incdirs-y += include
 srcs-y += video_tee_ta.c
+srcs-y += grayscale.c
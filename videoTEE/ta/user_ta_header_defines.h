@@ -5,7 +5,10 @@
 
 #define TA_UUID TA_VIDEO_TEE_UUID
 
-#define TA_FLAGS TA_FLAG_SINGLE_INSTANCE
+/* One instance shared by all sessions of the FUSE worker pool, kept
+ * loaded between sessions so its signing key is only loaded once */
+#define TA_FLAGS (TA_FLAG_SINGLE_INSTANCE | TA_FLAG_MULTI_SESSION | \
+                  TA_FLAG_INSTANCE_KEEP_ALIVE)
 
 /* Stack and heap size for TA */
 #define TA_STACK_SIZE (2 * 1024)
@@ -10,48 +10,133 @@
 #include <tee_internal_api.h>
 #include <tee_internal_api_extensions.h>
 
+#include <grayscale.h>
 #include <video_tee_ta.h>
 
 /* Digest algorithm to use */
 #define DIGEST_ALG TEE_ALG_SHA256
 
-/* Structure to keep track of the current session */
+/* ID of the signing key in secure storage */
+#define SIGN_KEY_ID "video_tee_sign_key"
+
+/* Structure to keep track of the current session.
+ * The operations live as long as the session and are reset between frames,
+ * so the per-frame path does no crypto context allocation. */
 typedef struct video_ta_sess {
-  TEE_OperationHandle op_handle; /* Handle to keep track of tee api op */
-  TEE_ObjectHandle key_handle; /* Handle to keep track of key transient object */
+  TEE_OperationHandle digest_op; /* SHA-256 over the processed image */
+  TEE_OperationHandle sign_op; /* ECDSA signing with the TA key */
   signed_res_t res; // The signed result to return to client
+
+  /* Frame being streamed in with TA_VIDEO_STREAM_*. It has its own digest,
+   * so whole frames can still be processed between its bands. */
+  TEE_OperationHandle stream_op;
+  img_meta_t stream_meta;
+  uint8_t *stream_img;      /* Processed frame, NULL when no stream is open */
+  uint8_t *stream_seen;     /* One flag per row received */
+  uint32_t stream_hashed;   /* Rows digested so far, from the top */
 } video_ta_sess_t;
 
+/*
+ * ECDSA signing key and its public half. Loaded from secure storage (or
+ * generated on first run) once per TA instance and shared by all sessions.
+ */
+static TEE_ObjectHandle sign_key = TEE_HANDLE_NULL;
+static pub_key_t sign_pub_key;
+
 typedef struct RGB {
   uint8_t red;
   uint8_t green;
   uint8_t blue;
 } RGB;
 
-/* Convert an image to grayscale
- * COURTESY OF UIT. TAKEN FROM THE PRECODE IN THE PARALLEL PROGRAMMING COURSE */
-void ImageToGrayscale(RGB *img, size_t size)
-{
-    for(int i = 0; i < size; i++){
-        char grayscale = img[i].red * 0.3 + img[i].green * 0.59 + img[i].blue * 0.11;
-        img[i].red = grayscale;
-        img[i].green = grayscale;
-        img[i].blue = grayscale;
-    }
-}
+/* Pixels per band of the fused convert + hash pass. Input and output of a
+ * band (2 x 12 KiB) stay in L1 while the band is hashed and copied out. */
+#define BAND_PIXELS 4096
+
+static TEE_Result load_signing_key(void);
 
 /* Called when TA instance is created */
 TEE_Result TA_CreateEntryPoint() 
 {
   DMSG("Hello from video tee TA!");
 
-  return TEE_SUCCESS;
+  return load_signing_key();
 }
 
 /* Called when the TA instance is destroyed */
 void TA_DestroyEntryPoint() 
 {
   DMSG("Goodbye from video tee TA");
+
+  if (sign_key != TEE_HANDLE_NULL)
+    TEE_CloseObject(sign_key);
+  sign_key = TEE_HANDLE_NULL;
+}
+
+/* Drop the frame being streamed, if any */
+static void stream_reset(video_ta_sess_t *sess_ctx)
+{
+  TEE_Free(sess_ctx->stream_img);
+  TEE_Free(sess_ctx->stream_seen);
+  sess_ctx->stream_img = NULL;
+  sess_ctx->stream_seen = NULL;
+}
+
+/* Free the session's operations */
+static void free_session_ops(video_ta_sess_t *sess_ctx)
+{
+  if (sess_ctx->digest_op != TEE_HANDLE_NULL)
+    TEE_FreeOperation(sess_ctx->digest_op);
+  if (sess_ctx->sign_op != TEE_HANDLE_NULL)
+    TEE_FreeOperation(sess_ctx->sign_op);
+  if (sess_ctx->stream_op != TEE_HANDLE_NULL)
+    TEE_FreeOperation(sess_ctx->stream_op);
+  sess_ctx->digest_op = TEE_HANDLE_NULL;
+  sess_ctx->sign_op = TEE_HANDLE_NULL;
+  sess_ctx->stream_op = TEE_HANDLE_NULL;
+}
+
+/* Allocate the digest and sign operations used for every frame */
+static TEE_Result alloc_session_ops(video_ta_sess_t *sess_ctx)
+{
+  TEE_Result res = TEE_SUCCESS;
+
+  /* Prepare digest operation */
+  res = TEE_AllocateOperation(&sess_ctx->digest_op,
+                              DIGEST_ALG,
+                              TEE_MODE_DIGEST,
+                              0); /* No key used for digest */
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to allocate digest operation");
+    sess_ctx->digest_op = TEE_HANDLE_NULL;
+    return res;
+  }
+
+  res = TEE_AllocateOperation(&sess_ctx->stream_op, DIGEST_ALG,
+                              TEE_MODE_DIGEST, 0);
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to allocate stream digest operation");
+    sess_ctx->stream_op = TEE_HANDLE_NULL;
+    return res;
+  }
+
+  /* Prepare signing operation */
+  res = TEE_AllocateOperation(&sess_ctx->sign_op, TEE_ALG_ECDSA_P256,
+                              TEE_MODE_SIGN, ECDSA_KEY_SIZE);
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to allocate sign operaton with error 0x%x", res);
+    sess_ctx->sign_op = TEE_HANDLE_NULL;
+    return res;
+  }
+
+  /* Set the private key for signing */
+  res = TEE_SetOperationKey(sess_ctx->sign_op, sign_key);
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to set key for signing with error 0x%x", res);
+    return res;
+  }
+
+  return res;
 }
 
 /* Initialize a session with a client */
@@ -59,6 +144,8 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t __unused param_types,
                                     TEE_Param __unused params[4],
                                     void **session)
 {
+  TEE_Result res;
+
   /* Allocate session struct */
   video_ta_sess_t *sess_ctx;
 
@@ -66,6 +153,13 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t __unused param_types,
   if (!sess_ctx)
     return TEE_ERROR_OUT_OF_MEMORY;
 
+  res = alloc_session_ops(sess_ctx);
+  if (res != TEE_SUCCESS) {
+    free_session_ops(sess_ctx);
+    TEE_Free(sess_ctx);
+    return res;
+  }
+
   *session = (void *)sess_ctx;
 
   return TEE_SUCCESS;
@@ -76,40 +170,63 @@ void TA_CloseSessionEntryPoint(void *session)
 {
   video_ta_sess_t *sess_ctx = (video_ta_sess_t *)session;
 
-  /* Free operation */
-  if (sess_ctx->op_handle != TEE_HANDLE_NULL)
-    TEE_FreeOperation(sess_ctx->op_handle);
-
-  /* Free key handle */
-  TEE_FreeTransientObject(sess_ctx->key_handle);
+  /* Free operations and an unfinished stream */
+  stream_reset(sess_ctx);
+  free_session_ops(sess_ctx);
 
   /* Free session */
   TEE_Free(sess_ctx);
 }
 
-/* Create a digest of the given data */
-static TEE_Result create_digest(video_ta_sess_t *sess_ctx,
-                               void *in_buf, size_t in_size,
-                               void *out_buf)
+/*
+ * Convert the image to grayscale and hash the result in a single sweep.
+ * Each band is converted from the client's buffer into img, fed to the
+ * digest and copied to the client's output buffer while still in cache.
+ * The digest covers the whole processed image and is computed from TA
+ * memory only, so the client cannot change what gets signed.
+ * in holds pixels in in_format, img and out in out_format.
+ */
+typedef void (*convert_fn)(const uint8_t *, uint8_t *, size_t);
+
+/* Check an input/output format pair */
+static int valid_formats(uint32_t in_format, uint32_t out_format)
+{
+  return (out_format == IMG_FMT_Y8 || out_format == IMG_FMT_RGB24) &&
+         (in_format == IMG_FMT_RGB24 || in_format == IMG_FMT_BGR24);
+}
+
+/* Grayscale kernel for a valid format pair */
+static convert_fn pick_convert(uint32_t in_format, uint32_t out_format)
+{
+  if (in_format == IMG_FMT_BGR24)
+    return out_format == IMG_FMT_Y8 ? gray_bgr24_to_y8 : gray_bgr24_to_rgb24;
+  return out_format == IMG_FMT_Y8 ? gray_rgb24_to_y8 : gray_rgb24_to_rgb24;
+}
+
+static TEE_Result gray_and_digest(video_ta_sess_t *sess_ctx,
+                                  const uint8_t *in, uint8_t *img,
+                                  uint8_t *out, size_t pixels,
+                                  uint32_t in_format, uint32_t out_format)
 {
   TEE_Result res = TEE_SUCCESS;
+  convert_fn convert = pick_convert(in_format, out_format);
+  size_t bpp = IMG_FMT_BPP(out_format);
+  size_t band;
 
-  /* Prepare digest operation */
-  res = TEE_AllocateOperation(&sess_ctx->op_handle,
-                              DIGEST_ALG,
-                              TEE_MODE_DIGEST,
-                              0); /* No key used for digest */
-  if (res != TEE_SUCCESS) {
-    EMSG("Failed to allocate digest operation");
-    sess_ctx->op_handle = TEE_HANDLE_NULL;
-    return res;
+  /* Start from a clean state in case a previous frame failed midway */
+  TEE_ResetOperation(sess_ctx->digest_op);
+
+  for (size_t i = 0; i < pixels; i += band) {
+    band = pixels - i < BAND_PIXELS ? pixels - i : BAND_PIXELS;
+
+    convert(in + 3 * i, img + bpp * i, band);
+    TEE_DigestUpdate(sess_ctx->digest_op, img + bpp * i, bpp * band);
+    TEE_MemMove(out + bpp * i, img + bpp * i, bpp * band);
   }
 
-  /* Perform digest operation */
   uint32_t digest_size = DIGEST_SIZE;
-  res = TEE_DigestDoFinal(sess_ctx->op_handle,
-                          in_buf, in_size,
-                          out_buf, &digest_size);
+  res = TEE_DigestDoFinal(sess_ctx->digest_op, NULL, 0,
+                          sess_ctx->res.digest, &digest_size);
   if (res != TEE_SUCCESS) {
     EMSG("Failed to perform digest operation");
   }
@@ -118,19 +235,19 @@ static TEE_Result create_digest(video_ta_sess_t *sess_ctx,
 }
 
 /* Generate an ECDSA keypair.
- * Reference to a transient object containing the key
- * is put in sess_ctx->key_handle
- * Public key components are put in corresponding buffers
- * in sess_ctx struct
+ * The key is stored in secure storage so later TA instances sign with
+ * the same key. A reference to the transient object holding the key is
+ * put in *key_handle.
  */
-TEE_Result gen_ecdsa_keypair(video_ta_sess_t *sess_ctx) 
+static TEE_Result gen_ecdsa_keypair(TEE_ObjectHandle *key_handle)
 {
   TEE_Result res = TEE_SUCCESS;
   TEE_Attribute curve_attr; // Required attribute for EC key gen
+  TEE_ObjectHandle obj_handle;
 
   /* Allocate transient object to hold key */
   res = TEE_AllocateTransientObject(TEE_TYPE_ECDSA_KEYPAIR, ECDSA_KEY_SIZE,
-                                    &sess_ctx->key_handle);
+                                    key_handle);
   if (res != TEE_SUCCESS) {
     EMSG("Failed to allocate transient object with error 0x%x", res);
     return res;
@@ -141,31 +258,53 @@ TEE_Result gen_ecdsa_keypair(video_ta_sess_t *sess_ctx)
                          sizeof(int));
 
   /* Generate keypair */
-  res = TEE_GenerateKey(sess_ctx->key_handle, ECDSA_KEY_SIZE, &curve_attr, 1);
+  res = TEE_GenerateKey(*key_handle, ECDSA_KEY_SIZE, &curve_attr, 1);
   if (res != TEE_SUCCESS) {
     EMSG("Failed to generate ECDSA keypair with error 0x%x", res);
+    TEE_FreeTransientObject(*key_handle);
+    *key_handle = TEE_HANDLE_NULL;
     return res;
   }
 
+  /* Persist the key; without it signing still works for this instance */
+  res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+                                   SIGN_KEY_ID, sizeof(SIGN_KEY_ID) - 1,
+                                   TEE_DATA_FLAG_ACCESS_READ,
+                                   *key_handle,
+                                   NULL, 0,
+                                   &obj_handle);
+  if (res != TEE_SUCCESS)
+    EMSG("Failed to persist signing key with error 0x%x", res);
+  else
+    TEE_CloseObject(obj_handle);
+
+  return TEE_SUCCESS;
+}
+
+/* Copy the public key components of the signing key into sign_pub_key */
+static TEE_Result extract_pub_key(void)
+{
+  TEE_Result res = TEE_SUCCESS;
+
   /* Set initial pubkey component sizes */
-  sess_ctx->res.pub_key_x_size = sizeof(sess_ctx->res.pub_key_x);
-  sess_ctx->res.pub_key_y_size = sizeof(sess_ctx->res.pub_key_y);
+  sign_pub_key.pub_key_x_size = sizeof(sign_pub_key.pub_key_x);
+  sign_pub_key.pub_key_y_size = sizeof(sign_pub_key.pub_key_y);
 
   /* Extract x component of pubkey */
-  res = TEE_GetObjectBufferAttribute(sess_ctx->key_handle,
+  res = TEE_GetObjectBufferAttribute(sign_key,
                                      TEE_ATTR_ECC_PUBLIC_VALUE_X,
-                                     sess_ctx->res.pub_key_x,
-                                     &sess_ctx->res.pub_key_x_size);
+                                     sign_pub_key.pub_key_x,
+                                     &sign_pub_key.pub_key_x_size);
   if (res != TEE_SUCCESS) {
     EMSG("Failed to get pubkey x component with error 0x%x", res);
     return res;
   }
 
   /* Extract y component of pubkey */
-  res = TEE_GetObjectBufferAttribute(sess_ctx->key_handle,
+  res = TEE_GetObjectBufferAttribute(sign_key,
                                      TEE_ATTR_ECC_PUBLIC_VALUE_Y,
-                                     sess_ctx->res.pub_key_y,
-                                     &sess_ctx->res.pub_key_y_size);
+                                     sign_pub_key.pub_key_y,
+                                     &sign_pub_key.pub_key_y_size);
   if (res != TEE_SUCCESS) {
     EMSG("Failed to get pubkey y component with error 0x%x", res);
     return res;
@@ -175,37 +314,41 @@ TEE_Result gen_ecdsa_keypair(video_ta_sess_t *sess_ctx)
   return res;
 }
 
-TEE_Result sign_digest(video_ta_sess_t *sess_ctx)
+/* Load the signing key from secure storage, generating it on first use */
+static TEE_Result load_signing_key(void)
 {
-  TEE_Result res = TEE_SUCCESS;
-
-  /* Obtain ECDSA keypair for signing */
-  res = gen_ecdsa_keypair(sess_ctx);
-  if (res != TEE_SUCCESS) {
-    return res;
+  TEE_Result res;
+
+  res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+                                 SIGN_KEY_ID, sizeof(SIGN_KEY_ID) - 1,
+                                 TEE_DATA_FLAG_ACCESS_READ,
+                                 &sign_key);
+  if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+    DMSG("No signing key in secure storage, generating one");
+    res = gen_ecdsa_keypair(&sign_key);
   }
-
-  /* Prepare signing operation */
-  res = TEE_AllocateOperation(&sess_ctx->op_handle, TEE_ALG_ECDSA_P256,
-                              TEE_MODE_SIGN, ECDSA_KEY_SIZE);
   if (res != TEE_SUCCESS) {
-    EMSG("Failed to allocate sign operaton with error 0x%x", res);
+    EMSG("Failed to load signing key with error 0x%x", res);
+    sign_key = TEE_HANDLE_NULL;
     return res;
   }
 
-  /* Set the private key for signing */
-  res = TEE_SetOperationKey(sess_ctx->op_handle, sess_ctx->key_handle);
-  if (res != TEE_SUCCESS) {
-    EMSG("Failed to set key for signing with error 0x%x", res);
-    return res;
-  }
+  return extract_pub_key();
+}
+
+TEE_Result sign_digest(video_ta_sess_t *sess_ctx)
+{
+  TEE_Result res = TEE_SUCCESS;
+
+  /* The key stays set on the session's sign operation */
+  TEE_ResetOperation(sess_ctx->sign_op);
 
   /* Will verify sig len after signing */
   uint32_t signature_size = sizeof(sess_ctx->res.signature);
   uint32_t exp_signature_size = SIGNATURE_SIZE;
 
   /* Perform signing operation */
-  res = TEE_AsymmetricSignDigest(sess_ctx->op_handle, NULL, 0, sess_ctx->res.digest,
+  res = TEE_AsymmetricSignDigest(sess_ctx->sign_op, NULL, 0, sess_ctx->res.digest,
                                  sizeof(sess_ctx->res.digest),
                                  sess_ctx->res.signature,
                                  &signature_size);
@@ -274,50 +417,460 @@ static TEE_Result inc_and_sign(video_ta_sess_t *sess_ctx,
     TEE_PARAM_TYPE_MEMREF_INPUT, /* Input image */
     TEE_PARAM_TYPE_MEMREF_OUTPUT, /* Attestation */
     TEE_PARAM_TYPE_MEMREF_OUTPUT, /* Out img */
-    TEE_PARAM_TYPE_NONE);
+    TEE_PARAM_TYPE_VALUE_INPUT); /* a: output format, b: input format */
 
   if (param_types != exp_param_types)
     return TEE_ERROR_BAD_PARAMETERS;
 
-  RGB *img = TEE_Malloc(params[0].memref.size, TEE_MALLOC_FILL_ZERO);
+  uint32_t out_format = params[3].value.a;
+  uint32_t in_format = params[3].value.b;
+  if (!valid_formats(in_format, out_format))
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[0].memref.size % sizeof(RGB) != 0)
+    return TEE_ERROR_BAD_PARAMETERS;
+  size_t pixels = params[0].memref.size / sizeof(RGB);
+  size_t img_size = pixels * IMG_FMT_BPP(out_format);
+  if (params[1].memref.size < sizeof(sess_ctx->res) ||
+      params[2].memref.size < img_size) {
+    params[1].memref.size = sizeof(sess_ctx->res);
+    params[2].memref.size = img_size;
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  /* TA copy of the processed image, kept for secure storage */
+  uint8_t *img = TEE_Malloc(img_size, 0);
   if (img == NULL)
     return TEE_ERROR_OUT_OF_MEMORY;
-  TEE_MemMove(img, (RGB *)params[0].memref.buffer, (size_t)params[0].memref.size);
-
-  ImageToGrayscale(img, (params[0].memref.size)/sizeof(RGB));
 
-  /* Generate a hash of the new image */
-  res = create_digest(sess_ctx, img, sizeof(uint32_t), &(sess_ctx->res.digest));
+  /* Convert, hash and copy out the processed image */
+  res = gray_and_digest(sess_ctx, params[0].memref.buffer, img,
+                        params[2].memref.buffer, pixels, in_format,
+                        out_format);
   if (res != TEE_SUCCESS) {
     EMSG("Failed to create digest with error 0x%x", res);
-    return res;
+    goto out;
   }
 
   /* Sign the hashed value */
   res = sign_digest(sess_ctx);
-  if (res != TEE_SUCCESS)
+  if (res != TEE_SUCCESS) {
     EMSG("Failed to sign digest with error 0x%x", res);
+    goto out;
+  }
 
   /* Copy attestation results into return buffer */
   params[1].memref.size = sizeof(sess_ctx->res);
   TEE_MemMove(params[1].memref.buffer, &sess_ctx->res, sizeof(sess_ctx->res));
 
-  /* Copy processed image */
-  params[2].memref.size = params[0].memref.size;
-  TEE_MemMove(params[2].memref.buffer, img, params[0].memref.size);
+  /* The processed image was copied out band by band */
+  params[2].memref.size = img_size;
 
   /* Save img securely */
-  res = save_secure(sess_ctx, img, params[0].memref.size);
+  res = save_secure(sess_ctx, img, img_size);
+  if (res != TEE_SUCCESS)
+    EMSG("Failed to save img securely with error 0x%x", res);
+
+out:
+  TEE_Free(img);
+  return res;
+}
+
+/* One node of a batch's Merkle tree: SHA-256(prefix || left || right), or
+ * SHA-256(prefix || left) for a leaf (right NULL) */
+static TEE_Result merkle_hash(video_ta_sess_t *sess_ctx, uint8_t prefix,
+                              const uint8_t *left, const uint8_t *right,
+                              uint8_t *node)
+{
+  uint32_t node_size = DIGEST_SIZE;
+
+  TEE_ResetOperation(sess_ctx->digest_op);
+  TEE_DigestUpdate(sess_ctx->digest_op, &prefix, 1);
+  if (right != NULL)
+    TEE_DigestUpdate(sess_ctx->digest_op, left, DIGEST_SIZE);
+
+  return TEE_DigestDoFinal(sess_ctx->digest_op, right != NULL ? right : left,
+                           DIGEST_SIZE, node, &node_size);
+}
+
+/* Build the tree over count frame digests into nodes, level by level from
+ * the leaves up, so the root ends up last */
+static TEE_Result merkle_tree(video_ta_sess_t *sess_ctx,
+                              const uint8_t *digests, uint32_t count,
+                              uint8_t *nodes)
+{
+  TEE_Result res = TEE_SUCCESS;
+  uint8_t *level = nodes;
+
+  for (uint32_t i = 0; i < count && res == TEE_SUCCESS; i++)
+    res = merkle_hash(sess_ctx, TA_MERKLE_LEAF, digests + i * DIGEST_SIZE,
+                      NULL, level + i * DIGEST_SIZE);
+
+  for (uint32_t m = count; m > 1 && res == TEE_SUCCESS; m = (m + 1) / 2) {
+    uint8_t *next = level + m * DIGEST_SIZE;
+
+    for (uint32_t i = 0; i + 1 < m && res == TEE_SUCCESS; i += 2)
+      res = merkle_hash(sess_ctx, TA_MERKLE_NODE, level + i * DIGEST_SIZE,
+                        level + (i + 1) * DIGEST_SIZE,
+                        next + i / 2 * DIGEST_SIZE);
+
+    /* An odd node out moves up a level as it is */
+    if (m % 2)
+      TEE_MemMove(next + m / 2 * DIGEST_SIZE, level + (m - 1) * DIGEST_SIZE,
+                  DIGEST_SIZE);
+
+    level = next;
+  }
+
+  return res;
+}
+
+/*
+ * Process every frame of a batch as inc_and_sign() would, then sign the
+ * root of a Merkle tree over their digests once for the whole batch.
+ */
+static TEE_Result process_batch(video_ta_sess_t *sess_ctx,
+                                uint32_t param_types, TEE_Param params[4])
+{
+  TEE_Result res = TEE_SUCCESS;
+  batch_frame_t *frames = NULL;
+  uint8_t *digests = NULL, *nodes = NULL, *img = NULL;
+  size_t img_max = 0;
+
+  uint32_t exp_param_types = TEE_PARAM_TYPES(
+    TEE_PARAM_TYPE_MEMREF_INPUT, /* Descriptors, then input images */
+    TEE_PARAM_TYPE_MEMREF_OUTPUT, /* Batch result */
+    TEE_PARAM_TYPE_MEMREF_OUTPUT, /* Out imgs */
+    TEE_PARAM_TYPE_VALUE_INPUT); /* a: frame count */
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  uint32_t count = params[3].value.a;
+  if (count == 0 || count > TA_BATCH_MAX_FRAMES ||
+      params[0].memref.size < count * sizeof(batch_frame_t))
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  uint32_t nodes_count = ta_batch_nodes(count);
+  size_t res_size = TA_BATCH_RES_SIZE(count);
+  if (params[1].memref.size < res_size) {
+    params[1].memref.size = res_size;
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  /* Check a copy of the descriptors, so the client cannot change them
+   * once they passed */
+  frames = TEE_Malloc(count * sizeof(batch_frame_t), 0);
+  digests = TEE_Malloc(count * DIGEST_SIZE, 0);
+  nodes = TEE_Malloc(nodes_count * DIGEST_SIZE, 0);
+  if (frames == NULL || digests == NULL || nodes == NULL) {
+    res = TEE_ERROR_OUT_OF_MEMORY;
+    goto out;
+  }
+  TEE_MemMove(frames, params[0].memref.buffer,
+              count * sizeof(batch_frame_t));
+
+  for (uint32_t i = 0; i < count; i++) {
+    batch_frame_t *f = &frames[i];
+    uint64_t pixels = (uint64_t)f->width * f->height;
+    uint64_t img_size = pixels * IMG_FMT_BPP(f->out_format);
+
+    if (f->width == 0 || f->width > TA_STREAM_MAX_DIM ||
+        f->height == 0 || f->height > TA_STREAM_MAX_DIM ||
+        !valid_formats(f->in_format, f->out_format) ||
+        f->in_offset + pixels * sizeof(RGB) > params[0].memref.size ||
+        f->out_offset + img_size > params[2].memref.size) {
+      res = TEE_ERROR_BAD_PARAMETERS;
+      goto out;
+    }
+    if (img_size > img_max)
+      img_max = img_size;
+  }
+
+  /* TA copy of each processed image in turn, kept for secure storage */
+  img = TEE_Malloc(img_max, 0);
+  if (img == NULL) {
+    res = TEE_ERROR_OUT_OF_MEMORY;
+    goto out;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    batch_frame_t *f = &frames[i];
+    size_t pixels = (size_t)f->width * f->height;
+
+    res = gray_and_digest(sess_ctx,
+                          (uint8_t *)params[0].memref.buffer + f->in_offset,
+                          img,
+                          (uint8_t *)params[2].memref.buffer + f->out_offset,
+                          pixels, f->in_format, f->out_format);
+    if (res != TEE_SUCCESS) {
+      EMSG("Failed to create digest with error 0x%x", res);
+      goto out;
+    }
+    TEE_MemMove(digests + i * DIGEST_SIZE, sess_ctx->res.digest, DIGEST_SIZE);
+
+    /* Stored under its own digest, so it loads like a single frame */
+    res = save_secure(sess_ctx, img, pixels * IMG_FMT_BPP(f->out_format));
+    if (res != TEE_SUCCESS) {
+      EMSG("Failed to save img securely with error 0x%x", res);
+      goto out;
+    }
+  }
+
+  res = merkle_tree(sess_ctx, digests, count, nodes);
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to build the batch tree with error 0x%x", res);
+    goto out;
+  }
+
+  /* One signature over the root for the whole batch */
+  TEE_MemMove(sess_ctx->res.digest, nodes + (nodes_count - 1) * DIGEST_SIZE,
+              DIGEST_SIZE);
+  res = sign_digest(sess_ctx);
   if (res != TEE_SUCCESS) {
+    EMSG("Failed to sign digest with error 0x%x", res);
+    goto out;
+  }
+
+  uint8_t *out = params[1].memref.buffer;
+  TEE_MemMove(out, &sess_ctx->res, sizeof(sess_ctx->res));
+  out += sizeof(sess_ctx->res);
+  TEE_MemMove(out, digests, count * DIGEST_SIZE);
+  out += count * DIGEST_SIZE;
+  TEE_MemMove(out, nodes, nodes_count * DIGEST_SIZE);
+  params[1].memref.size = res_size;
+
+out:
+  TEE_Free(img);
+  TEE_Free(nodes);
+  TEE_Free(digests);
+  TEE_Free(frames);
+  return res;
+}
+
+/* Start streaming a frame, dropping any unfinished one */
+static TEE_Result stream_begin(video_ta_sess_t *sess_ctx,
+                               uint32_t param_types, TEE_Param params[4])
+{
+  uint32_t exp_param_types = TEE_PARAM_TYPES(
+    TEE_PARAM_TYPE_VALUE_INPUT, /* a: width, b: height */
+    TEE_PARAM_TYPE_VALUE_INPUT, /* a: output format, b: input format */
+    TEE_PARAM_TYPE_NONE,
+    TEE_PARAM_TYPE_NONE);
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  img_meta_t meta = {
+    .width = params[0].value.a,
+    .height = params[0].value.b,
+    .in_format = params[1].value.b,
+    .out_format = params[1].value.a,
+  };
+  if (meta.width == 0 || meta.width > TA_STREAM_MAX_DIM ||
+      meta.height == 0 || meta.height > TA_STREAM_MAX_DIM ||
+      !valid_formats(meta.in_format, meta.out_format))
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  /* Input rows of the frame must be addressable on a 32-bit TA */
+  if (meta.height > SIZE_MAX / sizeof(RGB) / meta.width)
+    return TEE_ERROR_OUT_OF_MEMORY;
+
+  stream_reset(sess_ctx);
+
+  size_t img_size = (size_t)meta.width * meta.height *
+                    IMG_FMT_BPP(meta.out_format);
+  sess_ctx->stream_img = TEE_Malloc(img_size, 0);
+  sess_ctx->stream_seen = TEE_Malloc(meta.height, TEE_MALLOC_FILL_ZERO);
+  if (sess_ctx->stream_img == NULL || sess_ctx->stream_seen == NULL) {
+    stream_reset(sess_ctx);
+    return TEE_ERROR_OUT_OF_MEMORY;
+  }
+
+  sess_ctx->stream_meta = meta;
+  sess_ctx->stream_hashed = 0;
+  TEE_ResetOperation(sess_ctx->stream_op);
+
+  return TEE_SUCCESS;
+}
+
+/*
+ * Convert a band of rows into the streamed frame. Rows may come in any
+ * order; the digest advances over the rows received contiguously from the
+ * top, so a top-down file is hashed while it is being written.
+ */
+static TEE_Result stream_rows(video_ta_sess_t *sess_ctx,
+                              uint32_t param_types, TEE_Param params[4])
+{
+  uint32_t exp_param_types = TEE_PARAM_TYPES(
+    TEE_PARAM_TYPE_MEMREF_INPUT, /* Input rows */
+    TEE_PARAM_TYPE_VALUE_INPUT, /* a: first row, b: count */
+    TEE_PARAM_TYPE_NONE,
+    TEE_PARAM_TYPE_NONE);
+
+  if (param_types != exp_param_types || sess_ctx->stream_img == NULL)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  img_meta_t *meta = &sess_ctx->stream_meta;
+  uint32_t first = params[1].value.a;
+  uint32_t count = params[1].value.b;
+  if (count == 0 || first >= meta->height || count > meta->height - first ||
+      params[0].memref.size != (size_t)count * meta->width * sizeof(RGB))
+    return TEE_ERROR_BAD_PARAMETERS;
+  for (uint32_t y = first; y < first + count; y++)
+    if (sess_ctx->stream_seen[y])
+      return TEE_ERROR_BAD_PARAMETERS;
+
+  size_t bpp = IMG_FMT_BPP(meta->out_format);
+  size_t row = (size_t)meta->width * bpp;
+  pick_convert(meta->in_format, meta->out_format)(
+      params[0].memref.buffer, sess_ctx->stream_img + first * row,
+      (size_t)count * meta->width);
+  TEE_MemFill(sess_ctx->stream_seen + first, 1, count);
+
+  uint32_t from = sess_ctx->stream_hashed;
+  while (sess_ctx->stream_hashed < meta->height &&
+         sess_ctx->stream_seen[sess_ctx->stream_hashed])
+    sess_ctx->stream_hashed++;
+  if (sess_ctx->stream_hashed > from)
+    TEE_DigestUpdate(sess_ctx->stream_op, sess_ctx->stream_img + from * row,
+                     (sess_ctx->stream_hashed - from) * row);
+
+  return TEE_SUCCESS;
+}
+
+/* Finish the streamed frame: sign it and save it like a whole frame */
+static TEE_Result stream_end(video_ta_sess_t *sess_ctx,
+                             uint32_t param_types, TEE_Param params[4])
+{
+  TEE_Result res;
+  uint32_t exp_param_types = TEE_PARAM_TYPES(
+    TEE_PARAM_TYPE_MEMREF_OUTPUT, /* Attestation */
+    TEE_PARAM_TYPE_NONE,
+    TEE_PARAM_TYPE_NONE,
+    TEE_PARAM_TYPE_NONE);
+
+  if (param_types != exp_param_types || sess_ctx->stream_img == NULL)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[0].memref.size < sizeof(sess_ctx->res)) {
+    params[0].memref.size = sizeof(sess_ctx->res);
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  /* Every row must have arrived */
+  img_meta_t *meta = &sess_ctx->stream_meta;
+  if (sess_ctx->stream_hashed != meta->height) {
+    res = TEE_ERROR_BAD_STATE;
+    goto out;
+  }
+
+  uint32_t digest_size = DIGEST_SIZE;
+  res = TEE_DigestDoFinal(sess_ctx->stream_op, NULL, 0,
+                          sess_ctx->res.digest, &digest_size);
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to perform digest operation");
+    goto out;
+  }
+
+  res = sign_digest(sess_ctx);
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to sign digest with error 0x%x", res);
+    goto out;
+  }
+
+  params[0].memref.size = sizeof(sess_ctx->res);
+  TEE_MemMove(params[0].memref.buffer, &sess_ctx->res, sizeof(sess_ctx->res));
+
+  res = save_secure(sess_ctx, sess_ctx->stream_img,
+                    (size_t)meta->width * meta->height *
+                    IMG_FMT_BPP(meta->out_format));
+  if (res != TEE_SUCCESS)
     EMSG("Failed to save img securely with error 0x%x", res);
+
+out:
+  stream_reset(sess_ctx);
+  return res;
+}
+
+/* Copy a processed image saved by save_secure() back out */
+static TEE_Result load_output(uint32_t param_types, TEE_Param params[4])
+{
+  TEE_Result res;
+  TEE_ObjectHandle obj_handle;
+  TEE_ObjectInfo info;
+  uint32_t read_bytes;
+
+  uint32_t exp_param_types = TEE_PARAM_TYPES(
+    TEE_PARAM_TYPE_MEMREF_INPUT, /* Digest */
+    TEE_PARAM_TYPE_MEMREF_OUTPUT, /* Image */
+    TEE_PARAM_TYPE_NONE,
+    TEE_PARAM_TYPE_NONE);
+
+  if (param_types != exp_param_types ||
+      params[0].memref.size != DIGEST_SIZE)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  /* The object ID must not live in shared memory */
+  char *obj_id = TEE_Malloc(DIGEST_SIZE, 0);
+  if (obj_id == NULL)
+    return TEE_ERROR_OUT_OF_MEMORY;
+  TEE_MemMove(obj_id, params[0].memref.buffer, DIGEST_SIZE);
+
+  res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+                                 obj_id, DIGEST_SIZE,
+                                 TEE_DATA_FLAG_ACCESS_READ,
+                                 &obj_handle);
+  TEE_Free(obj_id);
+  if (res != TEE_SUCCESS)
     return res;
+
+  res = TEE_GetObjectInfo1(obj_handle, &info);
+  if (res != TEE_SUCCESS)
+    goto out;
+
+  if (params[1].memref.size < info.dataSize) {
+    params[1].memref.size = info.dataSize;
+    res = TEE_ERROR_SHORT_BUFFER;
+    goto out;
   }
 
-  /* Free operation and exit */
-  TEE_FreeOperation(sess_ctx->op_handle); // NOTE: Is this needed here?
+  res = TEE_ReadObjectData(obj_handle, params[1].memref.buffer,
+                           info.dataSize, &read_bytes);
+  if (res == TEE_SUCCESS)
+    params[1].memref.size = read_bytes;
+  else
+    EMSG("TEE_ReadObjectData failed 0x%08x", res);
+
+out:
+  TEE_CloseObject(obj_handle);
   return res;
 }
 
+/* Return the public key of the signing key */
+static TEE_Result get_pub_key(uint32_t param_types, TEE_Param params[4])
+{
+  /* Expected parameter types */
+  uint32_t exp_param_types = TEE_PARAM_TYPES(
+    TEE_PARAM_TYPE_MEMREF_OUTPUT, /* Public key */
+    TEE_PARAM_TYPE_NONE,
+    TEE_PARAM_TYPE_NONE,
+    TEE_PARAM_TYPE_NONE);
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[0].memref.size < sizeof(sign_pub_key)) {
+    params[0].memref.size = sizeof(sign_pub_key);
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  params[0].memref.size = sizeof(sign_pub_key);
+  TEE_MemMove(params[0].memref.buffer, &sign_pub_key, sizeof(sign_pub_key));
+
+  return TEE_SUCCESS;
+}
+
 /* Entry point to invoke a specified command */
 TEE_Result TA_InvokeCommandEntryPoint(
   void *session,
@@ -331,6 +884,18 @@ TEE_Result TA_InvokeCommandEntryPoint(
   switch (cmd_id) {
     case TA_VIDEO_INC_SIGN:
       return inc_and_sign(sess_ctx, param_types, params);
+    case TA_VIDEO_GET_PUBKEY:
+      return get_pub_key(param_types, params);
+    case TA_VIDEO_STREAM_BEGIN:
+      return stream_begin(sess_ctx, param_types, params);
+    case TA_VIDEO_STREAM_ROWS:
+      return stream_rows(sess_ctx, param_types, params);
+    case TA_VIDEO_STREAM_END:
+      return stream_end(sess_ctx, param_types, params);
+    case TA_VIDEO_LOAD_OUTPUT:
+      return load_output(param_types, params);
+    case TA_VIDEO_PROCESS_BATCH:
+      return process_batch(sess_ctx, param_types, params);
     default:
       return TEE_ERROR_BAD_PARAMETERS;
   }
@@ -0,0 +1,105 @@
+/*
+ * Benchmark of BMP frame loading: libbmp (per-row malloc and fread, then
+ * LoadRegion pixel by pixel) against the mapped loader copying straight
+ * into the destination buffer. Files are read from the page cache.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmp.h"
+#include "bmp_map.h"
+#include "libbmp.h"
+
+#define ROUNDS 20
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void load_libbmp(const char *path, void *dst)
+{
+  FILE *f = fopen(path, "rb");
+  bmp_img img = { 0 };
+  int width, height;
+
+  bmp_img_read(&img, f);
+  fclose(f);
+  GetSize(img, &width, &height);
+  LoadRegion(img, 0, 0, width, height, dst);
+  bmp_img_free(&img);
+}
+
+static void load_mapped(const char *path, void *dst)
+{
+  int fd = open(path, O_RDONLY);
+  bmp_map map;
+
+  if (bmp_map_open(&map, fd) == 0) {
+    bmp_map_copy(&map, dst);
+    bmp_map_close(&map);
+  }
+  close(fd);
+}
+
+static double bench(void (*load)(const char *, void *), const char *path,
+                    void *dst)
+{
+  double start;
+
+  /* Warm the page cache */
+  load(path, dst);
+
+  start = now();
+  for (int i = 0; i < ROUNDS; i++)
+    load(path, dst);
+  return (now() - start) / ROUNDS * 1e3;
+}
+
+static void bench_size(const char *dir, int width, int height)
+{
+  char path[64];
+  void *dst = malloc((size_t)3 * width * height);
+  bmp_img img;
+  double old_ms, new_ms;
+
+  snprintf(path, sizeof(path), "%s/frame.bmp", dir);
+  bmp_img_init_df(&img, width, height);
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      bmp_pixel_init(&img.img_pixels[y][x], x, y, x + y);
+  bmp_img_write(&img, path);
+  bmp_img_free(&img);
+
+  old_ms = bench(load_libbmp, path, dst);
+  new_ms = bench(load_mapped, path, dst);
+  printf("%4dx%-4d  libbmp %7.2f ms  mapped %7.2f ms  (%.1fx)\n",
+         width, height, old_ms, new_ms, old_ms / new_ms);
+
+  unlink(path);
+  free(dst);
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/bmp_load_bench_XXXXXX";
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  bench_size(dir, 1280, 720);
+  bench_size(dir, 1920, 1080);
+  bench_size(dir, 3840, 2160);
+
+  rmdir(dir);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+/*
+ * Microbenchmark of the grayscale kernels on 1080p frames.
+ * Reports throughput in MPix/s for the original floating-point loop and
+ * the fixed-point kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "grayscale.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define FRAMES 200
+
+/* The original scalar ImageToGrayscale() loop */
+static void ref_rgb24_to_rgb24(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+  for (size_t i = 0; i < pixels; i++) {
+    uint8_t gray = src[3 * i] * 0.3 + src[3 * i + 1] * 0.59 + src[3 * i + 2] * 0.11;
+    dst[3 * i] = dst[3 * i + 1] = dst[3 * i + 2] = gray;
+  }
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name,
+                  void (*kernel)(const uint8_t *, uint8_t *, size_t),
+                  const uint8_t *src, uint8_t *dst)
+{
+  size_t pixels = (size_t)WIDTH * HEIGHT;
+  double start;
+  double secs;
+
+  /* Warm up caches and page in dst */
+  kernel(src, dst, pixels);
+
+  start = now();
+  for (int i = 0; i < FRAMES; i++)
+    kernel(src, dst, pixels);
+  secs = now() - start;
+
+  printf("%-22s %8.1f MPix/s\n", name, FRAMES * pixels / secs / 1e6);
+}
+
+int main(void)
+{
+  size_t size = (size_t)3 * WIDTH * HEIGHT;
+  uint8_t *src = malloc(size);
+  uint8_t *dst = malloc(size);
+
+  srand(1);
+  for (size_t i = 0; i < size; i++)
+    src[i] = rand() & 0xff;
+
+  printf("%dx%d, %d frames\n", WIDTH, HEIGHT, FRAMES);
+  bench("float rgb24 (old)", ref_rgb24_to_rgb24, src, dst);
+  bench("fixed-point rgb24", gray_rgb24_to_rgb24, src, dst);
+  bench("fixed-point y8", gray_rgb24_to_y8, src, dst);
+
+  free(src);
+  free(dst);
+  return EXIT_SUCCESS;
+}
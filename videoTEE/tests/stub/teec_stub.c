@@ -0,0 +1,500 @@
+/*
+ * Stubbed TEE client library for running the host on a plain Linux box.
+ *
+ * Instead of talking to OP-TEE, TEEC_InvokeCommand emulates the video TA in
+ * the normal world: it checks the parameter layout the real TA expects,
+ * converts the image to grayscale and fills in a deterministic digest and
+ * signature. It is only good enough to exercise the host side.
+ *
+ * The stub's signature of a digest is the digest XOR 0xa5, twice, so tests
+ * can tell what was signed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <tee_client_api.h>
+#include <video_tee_ta.h>
+#include <grayscale.h>
+
+#include "teec_stub.h"
+
+unsigned int teec_stub_contexts;
+unsigned int teec_stub_sessions;
+unsigned int teec_stub_invocations;
+unsigned int teec_stub_shm_allocs;
+
+TEEC_Result TEEC_InitializeContext(const char *name, TEEC_Context *context)
+{
+  (void)name;
+  memset(context, 0, sizeof(*context));
+  teec_stub_contexts++;
+  return TEEC_SUCCESS;
+}
+
+void TEEC_FinalizeContext(TEEC_Context *context)
+{
+  (void)context;
+}
+
+TEEC_Result TEEC_OpenSession(TEEC_Context *context, TEEC_Session *session,
+                             const TEEC_UUID *destination,
+                             uint32_t connectionMethod,
+                             const void *connectionData,
+                             TEEC_Operation *operation,
+                             uint32_t *returnOrigin)
+{
+  (void)destination;
+  (void)connectionMethod;
+  (void)connectionData;
+  (void)operation;
+
+  session->ctx = context;
+  session->session_id = ++teec_stub_sessions;
+  if (returnOrigin)
+    *returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+  return TEEC_SUCCESS;
+}
+
+void TEEC_CloseSession(TEEC_Session *session)
+{
+  session->ctx = NULL;
+}
+
+/* FNV-1a, spread over the digest so equal images give equal digests */
+static void stub_digest(const uint8_t *buf, size_t len, uint8_t *digest)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    h ^= buf[i];
+    h *= 0x100000001b3ULL;
+  }
+  for (size_t i = 0; i < DIGEST_SIZE; i++)
+    digest[i] = (uint8_t)(h >> ((i % 8) * 8)) ^ (uint8_t)i;
+}
+
+void teec_stub_merkle_hash(uint8_t prefix, const uint8_t *left,
+                           const uint8_t *right, uint8_t *node)
+{
+  uint8_t buf[1 + 2 * DIGEST_SIZE];
+
+  buf[0] = prefix;
+  memcpy(buf + 1, left, DIGEST_SIZE);
+  if (right != NULL)
+    memcpy(buf + 1 + DIGEST_SIZE, right, DIGEST_SIZE);
+  stub_digest(buf, right != NULL ? sizeof(buf) : 1 + DIGEST_SIZE, node);
+}
+
+/* Sign res->digest */
+static void stub_sign(signed_res_t *res)
+{
+  for (size_t i = 0; i < SIGNATURE_SIZE; i++)
+    res->signature[i] = res->digest[i % DIGEST_SIZE] ^ 0xa5;
+}
+
+/* A memref parameter as the TA sees it */
+struct stub_memref {
+  uint8_t *buffer;
+  size_t size;
+};
+
+/*
+ * Resolve parameter i to a buffer, the way the driver would, and check its
+ * direction. Returns 0 when the parameter is not a memref of that direction.
+ */
+static int stub_get_memref(TEEC_Operation *op, int i, int output,
+                           struct stub_memref *ref)
+{
+  uint32_t type = TEEC_PARAM_TYPE_GET(op->paramTypes, i);
+  TEEC_Parameter *p = &op->params[i];
+
+  switch (type) {
+  case TEEC_MEMREF_TEMP_INPUT:
+  case TEEC_MEMREF_TEMP_OUTPUT:
+    if ((type == TEEC_MEMREF_TEMP_OUTPUT) != output)
+      return 0;
+    ref->buffer = p->tmpref.buffer;
+    ref->size = p->tmpref.size;
+    return 1;
+  case TEEC_MEMREF_PARTIAL_INPUT:
+  case TEEC_MEMREF_PARTIAL_OUTPUT:
+    if ((type == TEEC_MEMREF_PARTIAL_OUTPUT) != output)
+      return 0;
+    if (p->memref.parent == NULL ||
+        p->memref.offset + p->memref.size > p->memref.parent->size)
+      return 0;
+    ref->buffer = (uint8_t *)p->memref.parent->buffer + p->memref.offset;
+    ref->size = p->memref.size;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Report the size actually written back to an output parameter */
+static void stub_set_size(TEEC_Operation *op, int i, size_t size)
+{
+  if (TEEC_PARAM_TYPE_GET(op->paramTypes, i) == TEEC_MEMREF_TEMP_OUTPUT)
+    op->params[i].tmpref.size = size;
+  else
+    op->params[i].memref.size = size;
+}
+
+/* The TA's grayscale kernel for a format pair */
+static void stub_convert(uint32_t in_format, uint32_t out_format,
+                         const uint8_t *in, uint8_t *out, size_t pixels)
+{
+  if (in_format == IMG_FMT_BGR24 && out_format == IMG_FMT_Y8)
+    gray_bgr24_to_y8(in, out, pixels);
+  else if (in_format == IMG_FMT_BGR24)
+    gray_bgr24_to_rgb24(in, out, pixels);
+  else if (out_format == IMG_FMT_Y8)
+    gray_rgb24_to_y8(in, out, pixels);
+  else
+    gray_rgb24_to_rgb24(in, out, pixels);
+}
+
+/* Processed images by digest, standing in for the TA's secure storage */
+#define STUB_STORE_SLOTS 8
+
+static struct {
+  uint8_t digest[DIGEST_SIZE];
+  uint8_t *img;
+  size_t size;
+} stub_store[STUB_STORE_SLOTS];
+static unsigned int stub_store_next;
+
+static void stub_store_save(const uint8_t *digest, const uint8_t *img,
+                            size_t size)
+{
+  unsigned int slot = stub_store_next++ % STUB_STORE_SLOTS;
+
+  free(stub_store[slot].img);
+  stub_store[slot].img = malloc(size);
+  stub_store[slot].size = stub_store[slot].img != NULL ? size : 0;
+  if (stub_store[slot].img != NULL)
+    memcpy(stub_store[slot].img, img, size);
+  memcpy(stub_store[slot].digest, digest, DIGEST_SIZE);
+}
+
+static TEEC_Result stub_load_output(TEEC_Operation *op)
+{
+  struct stub_memref digest, out;
+
+  if (!stub_get_memref(op, 0, 0, &digest) || !stub_get_memref(op, 1, 1, &out) ||
+      digest.size != DIGEST_SIZE)
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  for (unsigned int i = 0; i < STUB_STORE_SLOTS; i++) {
+    if (stub_store[i].img == NULL ||
+        memcmp(stub_store[i].digest, digest.buffer, DIGEST_SIZE) != 0)
+      continue;
+    if (out.size < stub_store[i].size) {
+      stub_set_size(op, 1, stub_store[i].size);
+      return TEEC_ERROR_SHORT_BUFFER;
+    }
+    memcpy(out.buffer, stub_store[i].img, stub_store[i].size);
+    stub_set_size(op, 1, stub_store[i].size);
+    return TEEC_SUCCESS;
+  }
+
+  return TEEC_ERROR_ITEM_NOT_FOUND;
+}
+
+static TEEC_Result stub_inc_sign(TEEC_Operation *op)
+{
+  struct stub_memref in, att, out;
+  signed_res_t res;
+  uint32_t in_format, out_format;
+  size_t pixels, out_size;
+
+  if (!stub_get_memref(op, 0, 0, &in) || !stub_get_memref(op, 1, 1, &att) ||
+      !stub_get_memref(op, 2, 1, &out) ||
+      TEEC_PARAM_TYPE_GET(op->paramTypes, 3) != TEEC_VALUE_INPUT)
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  out_format = op->params[3].value.a;
+  in_format = op->params[3].value.b;
+  if (out_format != IMG_FMT_Y8 && out_format != IMG_FMT_RGB24)
+    return TEEC_ERROR_BAD_PARAMETERS;
+  if (in_format != IMG_FMT_RGB24 && in_format != IMG_FMT_BGR24)
+    return TEEC_ERROR_BAD_PARAMETERS;
+  pixels = in.size / 3;
+  out_size = pixels * IMG_FMT_BPP(out_format);
+  if (att.size < sizeof(res) || out.size < out_size)
+    return TEEC_ERROR_SHORT_BUFFER;
+
+  /* The TA's own kernels */
+  stub_convert(in_format, out_format, in.buffer, out.buffer, pixels);
+  stub_set_size(op, 2, out_size);
+
+  memset(&res, 0, sizeof(res));
+  stub_digest(out.buffer, out_size, res.digest);
+  stub_sign(&res);
+  memcpy(att.buffer, &res, sizeof(res));
+  stub_set_size(op, 1, sizeof(res));
+  stub_store_save(res.digest, out.buffer, out_size);
+
+  return TEEC_SUCCESS;
+}
+
+static TEEC_Result stub_process_batch(TEEC_Operation *op)
+{
+  struct stub_memref in, att, out;
+  batch_frame_t frames[TA_BATCH_MAX_FRAMES];
+  signed_res_t res;
+  uint32_t count, nodes_count;
+
+  if (!stub_get_memref(op, 0, 0, &in) || !stub_get_memref(op, 1, 1, &att) ||
+      !stub_get_memref(op, 2, 1, &out) ||
+      TEEC_PARAM_TYPE_GET(op->paramTypes, 3) != TEEC_VALUE_INPUT)
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  count = op->params[3].value.a;
+  if (count == 0 || count > TA_BATCH_MAX_FRAMES ||
+      in.size < count * sizeof(batch_frame_t))
+    return TEEC_ERROR_BAD_PARAMETERS;
+  nodes_count = ta_batch_nodes(count);
+  if (att.size < TA_BATCH_RES_SIZE(count))
+    return TEEC_ERROR_SHORT_BUFFER;
+
+  memcpy(frames, in.buffer, count * sizeof(batch_frame_t));
+  for (uint32_t i = 0; i < count; i++) {
+    batch_frame_t *f = &frames[i];
+    uint64_t pixels = (uint64_t)f->width * f->height;
+
+    if (pixels == 0 ||
+        (f->out_format != IMG_FMT_Y8 && f->out_format != IMG_FMT_RGB24) ||
+        (f->in_format != IMG_FMT_RGB24 && f->in_format != IMG_FMT_BGR24) ||
+        f->in_offset + 3 * pixels > in.size ||
+        f->out_offset + IMG_FMT_BPP(f->out_format) * pixels > out.size)
+      return TEEC_ERROR_BAD_PARAMETERS;
+  }
+
+  /* Result layout: signed root, frame digests, then the tree */
+  uint8_t *digests = att.buffer + sizeof(res);
+  uint8_t *nodes = digests + count * DIGEST_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    batch_frame_t *f = &frames[i];
+    size_t pixels = (size_t)f->width * f->height;
+    size_t out_size = IMG_FMT_BPP(f->out_format) * pixels;
+    uint8_t *img = out.buffer + f->out_offset;
+
+    stub_convert(f->in_format, f->out_format, in.buffer + f->in_offset, img,
+                 pixels);
+    stub_digest(img, out_size, digests + i * DIGEST_SIZE);
+    stub_store_save(digests + i * DIGEST_SIZE, img, out_size);
+  }
+
+  uint8_t *level = nodes;
+  for (uint32_t i = 0; i < count; i++)
+    teec_stub_merkle_hash(TA_MERKLE_LEAF, digests + i * DIGEST_SIZE, NULL,
+                          level + i * DIGEST_SIZE);
+  for (uint32_t m = count; m > 1; m = (m + 1) / 2) {
+    uint8_t *next = level + m * DIGEST_SIZE;
+
+    for (uint32_t i = 0; i + 1 < m; i += 2)
+      teec_stub_merkle_hash(TA_MERKLE_NODE, level + i * DIGEST_SIZE,
+                            level + (i + 1) * DIGEST_SIZE,
+                            next + i / 2 * DIGEST_SIZE);
+    if (m % 2)
+      memcpy(next + m / 2 * DIGEST_SIZE, level + (m - 1) * DIGEST_SIZE,
+             DIGEST_SIZE);
+    level = next;
+  }
+
+  memcpy(res.digest, nodes + (nodes_count - 1) * DIGEST_SIZE, DIGEST_SIZE);
+  stub_sign(&res);
+  memcpy(att.buffer, &res, sizeof(res));
+  stub_set_size(op, 1, TA_BATCH_RES_SIZE(count));
+
+  return TEEC_SUCCESS;
+}
+
+/* The frame being streamed, as the TA session would keep it */
+static struct {
+  img_meta_t meta;
+  uint8_t *img;
+  uint8_t *seen;
+} stub_stream;
+
+static void stub_stream_reset(void)
+{
+  free(stub_stream.img);
+  free(stub_stream.seen);
+  memset(&stub_stream, 0, sizeof(stub_stream));
+}
+
+static TEEC_Result stub_stream_begin(TEEC_Operation *op)
+{
+  img_meta_t meta;
+
+  if (op->paramTypes != TEEC_PARAM_TYPES(TEEC_VALUE_INPUT, TEEC_VALUE_INPUT,
+                                         TEEC_NONE, TEEC_NONE))
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  meta.width = op->params[0].value.a;
+  meta.height = op->params[0].value.b;
+  meta.out_format = op->params[1].value.a;
+  meta.in_format = op->params[1].value.b;
+  if (meta.width == 0 || meta.width > TA_STREAM_MAX_DIM ||
+      meta.height == 0 || meta.height > TA_STREAM_MAX_DIM ||
+      (meta.out_format != IMG_FMT_Y8 && meta.out_format != IMG_FMT_RGB24) ||
+      (meta.in_format != IMG_FMT_RGB24 && meta.in_format != IMG_FMT_BGR24))
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  stub_stream_reset();
+  stub_stream.meta = meta;
+  stub_stream.img = malloc((size_t)meta.width * meta.height *
+                           IMG_FMT_BPP(meta.out_format));
+  stub_stream.seen = calloc(meta.height, 1);
+  if (stub_stream.img == NULL || stub_stream.seen == NULL) {
+    stub_stream_reset();
+    return TEEC_ERROR_OUT_OF_MEMORY;
+  }
+  return TEEC_SUCCESS;
+}
+
+static TEEC_Result stub_stream_rows(TEEC_Operation *op)
+{
+  img_meta_t *meta = &stub_stream.meta;
+  struct stub_memref in;
+  uint32_t first, count;
+
+  if (stub_stream.img == NULL || !stub_get_memref(op, 0, 0, &in) ||
+      TEEC_PARAM_TYPE_GET(op->paramTypes, 1) != TEEC_VALUE_INPUT)
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  first = op->params[1].value.a;
+  count = op->params[1].value.b;
+  if (count == 0 || first >= meta->height || count > meta->height - first ||
+      in.size != (size_t)count * meta->width * 3)
+    return TEEC_ERROR_BAD_PARAMETERS;
+  for (uint32_t y = first; y < first + count; y++)
+    if (stub_stream.seen[y])
+      return TEEC_ERROR_BAD_PARAMETERS;
+
+  size_t row = (size_t)meta->width * IMG_FMT_BPP(meta->out_format);
+  stub_convert(meta->in_format, meta->out_format, in.buffer,
+               stub_stream.img + first * row, (size_t)count * meta->width);
+  memset(stub_stream.seen + first, 1, count);
+  return TEEC_SUCCESS;
+}
+
+static TEEC_Result stub_stream_end(TEEC_Operation *op)
+{
+  img_meta_t *meta = &stub_stream.meta;
+  struct stub_memref att;
+  signed_res_t res;
+  TEEC_Result ret = TEEC_SUCCESS;
+
+  if (stub_stream.img == NULL || !stub_get_memref(op, 0, 1, &att))
+    return TEEC_ERROR_BAD_PARAMETERS;
+  if (att.size < sizeof(res))
+    return TEEC_ERROR_SHORT_BUFFER;
+
+  for (uint32_t y = 0; y < meta->height; y++)
+    if (!stub_stream.seen[y])
+      ret = TEEC_ERROR_BAD_STATE;
+
+  if (ret == TEEC_SUCCESS) {
+    /* Digest of the whole frame, as stub_inc_sign() computes it */
+    size_t img_size = (size_t)meta->width * meta->height *
+                      IMG_FMT_BPP(meta->out_format);
+
+    memset(&res, 0, sizeof(res));
+    stub_digest(stub_stream.img, img_size, res.digest);
+    stub_sign(&res);
+    memcpy(att.buffer, &res, sizeof(res));
+    stub_set_size(op, 0, sizeof(res));
+    stub_store_save(res.digest, stub_stream.img, img_size);
+  }
+
+  stub_stream_reset();
+  return ret;
+}
+
+static TEEC_Result stub_get_pubkey(TEEC_Operation *op)
+{
+  struct stub_memref out;
+  pub_key_t pub_key;
+
+  if (!stub_get_memref(op, 0, 1, &out) ||
+      TEEC_PARAM_TYPE_GET(op->paramTypes, 1) != TEEC_NONE)
+    return TEEC_ERROR_BAD_PARAMETERS;
+  if (out.size < sizeof(pub_key))
+    return TEEC_ERROR_SHORT_BUFFER;
+
+  memset(pub_key.pub_key_x, 0x11, sizeof(pub_key.pub_key_x));
+  memset(pub_key.pub_key_y, 0x22, sizeof(pub_key.pub_key_y));
+  pub_key.pub_key_x_size = sizeof(pub_key.pub_key_x);
+  pub_key.pub_key_y_size = sizeof(pub_key.pub_key_y);
+  memcpy(out.buffer, &pub_key, sizeof(pub_key));
+  stub_set_size(op, 0, sizeof(pub_key));
+
+  return TEEC_SUCCESS;
+}
+
+TEEC_Result TEEC_InvokeCommand(TEEC_Session *session, uint32_t commandID,
+                               TEEC_Operation *operation,
+                               uint32_t *returnOrigin)
+{
+  if (returnOrigin)
+    *returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+  if (session->ctx == NULL || operation == NULL)
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  teec_stub_invocations++;
+
+  switch (commandID) {
+  case TA_VIDEO_INC_SIGN:
+    return stub_inc_sign(operation);
+  case TA_VIDEO_GET_PUBKEY:
+    return stub_get_pubkey(operation);
+  case TA_VIDEO_STREAM_BEGIN:
+    return stub_stream_begin(operation);
+  case TA_VIDEO_STREAM_ROWS:
+    return stub_stream_rows(operation);
+  case TA_VIDEO_STREAM_END:
+    return stub_stream_end(operation);
+  case TA_VIDEO_LOAD_OUTPUT:
+    return stub_load_output(operation);
+  case TA_VIDEO_PROCESS_BATCH:
+    return stub_process_batch(operation);
+  default:
+    return TEEC_ERROR_BAD_PARAMETERS;
+  }
+}
+
+TEEC_Result TEEC_RegisterSharedMemory(TEEC_Context *context,
+                                      TEEC_SharedMemory *sharedMem)
+{
+  (void)context;
+  if (sharedMem->buffer == NULL)
+    return TEEC_ERROR_BAD_PARAMETERS;
+  sharedMem->shadow_buffer = NULL;
+  teec_stub_shm_allocs++;
+  return TEEC_SUCCESS;
+}
+
+TEEC_Result TEEC_AllocateSharedMemory(TEEC_Context *context,
+                                      TEEC_SharedMemory *sharedMem)
+{
+  (void)context;
+  sharedMem->buffer = calloc(1, sharedMem->size ? sharedMem->size : 1);
+  if (sharedMem->buffer == NULL)
+    return TEEC_ERROR_OUT_OF_MEMORY;
+  sharedMem->shadow_buffer = sharedMem->buffer;
+  teec_stub_shm_allocs++;
+  return TEEC_SUCCESS;
+}
+
+void TEEC_ReleaseSharedMemory(TEEC_SharedMemory *sharedMemory)
+{
+  /* Only buffers we allocated ourselves are freed */
+  if (sharedMemory->shadow_buffer)
+    free(sharedMemory->shadow_buffer);
+  sharedMemory->buffer = NULL;
+  sharedMemory->shadow_buffer = NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef TEEC_STUB_H
+#define TEEC_STUB_H
+
+#include <stdint.h>
+
+/*
+ * Counters kept by the stubbed TEE client library, so tests can check how
+ * often the host sets up the TEE compared to how many frames it processes.
+ */
+extern unsigned int teec_stub_contexts;
+extern unsigned int teec_stub_sessions;
+extern unsigned int teec_stub_invocations;
+extern unsigned int teec_stub_shm_allocs;
+
+/* Node of a batch's Merkle tree as the stub hashes it (right NULL for a
+ * leaf), for checking inclusion proofs */
+void teec_stub_merkle_hash(uint8_t prefix, const uint8_t *left,
+                           const uint8_t *right, uint8_t *node);
+
+#endif /* TEEC_STUB_H */
@@ -0,0 +1,184 @@
+/*
+ * Tests for the mapped BMP loader, checked against libbmp.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bmp_map.h"
+#include "libbmp.h"
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+  do {                                                                      \
+    if (!(cond)) {                                                          \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+              #cond);                                                       \
+      failures++;                                                           \
+    }                                                                       \
+  } while (0)
+
+static char path[64];
+
+/* Write a width x height pattern; negative height stores it top-down */
+static void write_pattern(int width, int height)
+{
+  bmp_img img;
+
+  bmp_img_init_df(&img, width, height);
+  for (int y = 0; y < abs(height); y++)
+    for (int x = 0; x < width; x++)
+      bmp_pixel_init(&img.img_pixels[y][x], x * 7 + y, y * 11, x ^ y);
+  bmp_img_write(&img, path);
+  bmp_img_free(&img);
+}
+
+/* Map the file and compare every row with what libbmp reads */
+static void check_pattern(int width, int height)
+{
+  size_t row = 3 * (size_t)width;
+  bmp_map map;
+  bmp_img img = { 0 };
+  uint8_t *packed;
+  FILE *f;
+  int fd;
+
+  write_pattern(width, height);
+
+  fd = open(path, O_RDONLY);
+  CHECK(bmp_map_open(&map, fd) == 0);
+  close(fd);
+  CHECK(map.width == width && map.height == abs(height));
+
+  f = fopen(path, "rb");
+  CHECK(bmp_img_read(&img, f) == BMP_OK);
+  fclose(f);
+
+  /* libbmp rows are top-down bmp_pixel {blue, green, red}, i.e. BGR */
+  packed = malloc(row * abs(height));
+  CHECK(bmp_map_copy(&map, packed) == 0);
+  for (int y = 0; y < abs(height); y++) {
+    CHECK(memcmp(BMP_MAP_ROW(&map, y), img.img_pixels[y], row) == 0);
+    CHECK(memcmp(packed + y * row, img.img_pixels[y], row) == 0);
+  }
+
+  free(packed);
+  bmp_img_free(&img);
+  bmp_map_close(&map);
+}
+
+/* Truncate the test file after it was mapped: the copy must fail, not
+ * raise SIGBUS. The image must span more than a page. */
+static void check_truncated(int width, int height)
+{
+  bmp_map map;
+  uint8_t *packed = malloc(3 * (size_t)width * abs(height));
+  int fd;
+
+  write_pattern(width, height);
+  fd = open(path, O_RDONLY);
+  CHECK(bmp_map_open(&map, fd) == 0);
+  close(fd);
+  CHECK(truncate(path, 54) == 0);
+
+  /* Noticed from the file size */
+  errno = 0;
+  CHECK(bmp_map_copy(&map, packed) != 0 && errno == EIO);
+
+  /* Caught from the fault, as when the file shrinks during the copy */
+  size_t map_size = map.map_size;
+  map.map_size = 0;
+  errno = 0;
+  CHECK(bmp_map_copy(&map, packed) != 0 && errno == EIO);
+  map.map_size = map_size;
+
+  free(packed);
+  bmp_map_close(&map);
+}
+
+/* Overwrite len bytes at off in the test file */
+static void patch_file(off_t off, const void *buf, size_t len)
+{
+  int fd = open(path, O_WRONLY);
+
+  CHECK(pwrite(fd, buf, len, off) == (ssize_t)len);
+  close(fd);
+}
+
+/* The test file must be rejected */
+static void check_invalid(void)
+{
+  bmp_map map;
+  int fd = open(path, O_RDONLY);
+
+  CHECK(bmp_map_open(&map, fd) != 0);
+  CHECK(map.map == NULL);
+  close(fd);
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/bmp_map_test_XXXXXX";
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  snprintf(path, sizeof(path), "%s/frame.bmp", dir);
+
+  /* Every row padding, both row orders */
+  for (int width = 1; width <= 9; width++)
+    for (int height = 1; height <= 5; height++) {
+      check_pattern(width, height);
+      check_pattern(width, -height);
+    }
+  check_pattern(64, -8); /* top-down without padding: one memcpy */
+
+  /* Truncated pixel data */
+  write_pattern(13, 7);
+  CHECK(truncate(path, 54 + 40 * 6) == 0);
+  check_invalid();
+
+  /* Bad magic */
+  write_pattern(13, 7);
+  patch_file(0, "XY", 2);
+  check_invalid();
+
+  /* Only 24-bit pixels are supported */
+  write_pattern(13, 7);
+  patch_file(28, "\x20\x00", 2);
+  check_invalid();
+
+  /* Pixel offset past the end of the file */
+  write_pattern(13, 7);
+  patch_file(10, "\xff\xff\x00\x00", 4);
+  check_invalid();
+
+  /* Largest dimensions, whose pixel size wraps a 32-bit size_t */
+  write_pattern(13, 7);
+  patch_file(18, "\x00\x00\x01\x00\x00\x00\x01\x00", 8);
+  check_invalid();
+
+  /* Truncated after it was mapped, then mapped again intact */
+  check_truncated(1024, -1024);
+  check_pattern(13, 7);
+
+  /* Too short for a header */
+  CHECK(truncate(path, 20) == 0);
+  check_invalid();
+
+  unlink(path);
+  rmdir(dir);
+
+  if (failures) {
+    fprintf(stderr, "test_bmp_map: %d check(s) failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("test_bmp_map: OK\n");
+  return EXIT_SUCCESS;
+}
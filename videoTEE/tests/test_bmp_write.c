@@ -0,0 +1,177 @@
+/*
+ * Tests for the streaming BMP writer, read back through the mapped loader.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bmp_map.h"
+#include "bmp_write.h"
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+  do {                                                                      \
+    if (!(cond)) {                                                          \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+              #cond);                                                       \
+      failures++;                                                           \
+    }                                                                       \
+  } while (0)
+
+static char path[64];
+
+static uint8_t *pattern(size_t size)
+{
+  uint8_t *buf = malloc(size);
+
+  for (size_t i = 0; i < size; i++)
+    buf[i] = i * 31 + (i >> 8);
+  return buf;
+}
+
+static off_t file_size(void)
+{
+  struct stat st;
+
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+/* Write 24-bit pixels and map them back */
+static void check_rgb(int width, int height, enum bmp_write_fmt fmt)
+{
+  size_t row = 3 * (size_t)width;
+  uint8_t *pixels = pattern(row * height);
+  size_t mismatches = 0;
+  bmp_map map;
+  int fd;
+
+  CHECK(bmp_write_file(path, pixels, width, height, fmt) == 0);
+  CHECK(file_size() == 54 + (off_t)((row + 3) & ~3) * height);
+
+  fd = open(path, O_RDONLY);
+  CHECK(bmp_map_open(&map, fd) == 0);
+  close(fd);
+  CHECK(map.width == width && map.height == height);
+
+  /* The file is always blue first */
+  for (int y = 0; y < height && map.map != NULL; y++) {
+    const uint8_t *in = pixels + y * row, *out = BMP_MAP_ROW(&map, y);
+    for (int x = 0; x < width; x++) {
+      int swap = fmt == BMP_WRITE_RGB24 ? 2 : 0;
+      if (out[3 * x] != in[3 * x + swap] || out[3 * x + 1] != in[3 * x + 1] ||
+          out[3 * x + 2] != in[3 * x + 2 - swap])
+        mismatches++;
+    }
+  }
+  CHECK(mismatches == 0);
+
+  bmp_map_close(&map);
+  free(pixels);
+}
+
+/* Write 8-bit gray pixels and check the file byte by byte */
+static void check_y8(int width, int height)
+{
+  size_t stride = ((size_t)width + 3) & ~3;
+  size_t size = 54 + 1024 + stride * height;
+  uint8_t *pixels = pattern((size_t)width * height);
+  uint8_t *file = malloc(size);
+  size_t mismatches = 0;
+  FILE *f;
+
+  CHECK(bmp_write_file(path, pixels, width, height, BMP_WRITE_Y8) == 0);
+  CHECK(file_size() == (off_t)size);
+
+  f = fopen(path, "rb");
+  CHECK(fread(file, size, 1, f) == 1);
+  fclose(f);
+
+  CHECK(file[0] == 'B' && file[1] == 'M');
+  CHECK(file[28] == 8);                    /* biBitCount */
+  CHECK(file[10] == (1078 & 0xff) && file[11] == 1078 >> 8);
+  CHECK(file[54 + 4 * 200] == 200 && file[54 + 4 * 200 + 2] == 200);
+
+  /* Rows bottom-up, padding zeroed */
+  for (int y = 0; y < height; y++) {
+    const uint8_t *line = file + 1078 + (height - 1 - y) * stride;
+    if (memcmp(line, pixels + (size_t)y * width, width) != 0)
+      mismatches++;
+    for (size_t x = width; x < stride; x++)
+      if (line[x] != 0)
+        mismatches++;
+  }
+  CHECK(mismatches == 0);
+
+  free(file);
+  free(pixels);
+}
+
+/* bmp_write_fd() writes at the offset without touching what is before it */
+static void check_offset(void)
+{
+  uint8_t *pixels = pattern(3 * 5 * 3);
+  uint8_t expected[128], got[128 + 40];
+  int fd;
+
+  CHECK(bmp_write_file(path, pixels, 5, 3, BMP_WRITE_BGR24) == 0);
+  fd = open(path, O_RDONLY);
+  CHECK(read(fd, expected, sizeof(expected)) == 54 + 16 * 3);
+  close(fd);
+
+  fd = open(path, O_RDWR | O_TRUNC);
+  memset(got, 'x', 40);
+  CHECK(write(fd, got, 40) == 40);
+  CHECK(bmp_write_fd(fd, 40, pixels, 5, 3, BMP_WRITE_BGR24) == 0);
+  CHECK(lseek(fd, 0, SEEK_CUR) == 40);
+  CHECK(pread(fd, got, sizeof(got), 0) == 40 + 54 + 16 * 3);
+  close(fd);
+
+  CHECK(got[0] == 'x' && got[39] == 'x');
+  CHECK(memcmp(got + 40, expected, 54 + 16 * 3) == 0);
+
+  free(pixels);
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/bmp_write_test_XXXXXX";
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  snprintf(path, sizeof(path), "%s/frame.bmp", dir);
+
+  /* Every row padding */
+  for (int width = 1; width <= 9; width++)
+    for (int height = 1; height <= 4; height++) {
+      check_rgb(width, height, BMP_WRITE_BGR24);
+      check_rgb(width, height, BMP_WRITE_RGB24);
+      check_y8(width, height);
+    }
+
+  /* More rows than one pwritev batch */
+  check_rgb(37, 601, BMP_WRITE_BGR24);
+  check_rgb(37, 601, BMP_WRITE_RGB24);
+  check_y8(37, 601);
+
+  check_offset();
+
+  /* Bad dimensions */
+  CHECK(bmp_write_file(path, "", 0, 1, BMP_WRITE_Y8) != 0);
+
+  unlink(path);
+  rmdir(dir);
+
+  if (failures) {
+    fprintf(stderr, "test_bmp_write: %d check(s) failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("test_bmp_write: OK\n");
+  return EXIT_SUCCESS;
+}
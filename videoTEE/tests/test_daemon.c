@@ -0,0 +1,449 @@
+/*
+ * Tests for the video_tee daemon mode, run against the stubbed TEEC library.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "video_tee_host.h"
+#include "video_tee_daemon.h"
+#include "libbmp.h"
+#include "bmp_write.h"
+#include "teec_stub.h"
+#include "grayscale.h"
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+  do {                                                                      \
+    if (!(cond)) {                                                          \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+              #cond);                                                       \
+      failures++;                                                           \
+    }                                                                       \
+  } while (0)
+
+struct daemon_args {
+  struct tee_ctx *tee;
+  int listen_fd;
+  int stop_fd;
+};
+
+static void *daemon_thread(void *arg)
+{
+  struct daemon_args *args = arg;
+
+  vt_daemon_serve(args->tee, args->listen_fd, args->stop_fd);
+  return NULL;
+}
+
+/* Write a small test pattern BMP */
+static void write_test_bmp(const char *path, int width, int height)
+{
+  bmp_img img;
+
+  bmp_img_init_df(&img, width, height);
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      bmp_pixel_init(&img.img_pixels[y][x], x * 16, y * 32, (x + y) * 8);
+  bmp_img_write(&img, path);
+  bmp_img_free(&img);
+}
+
+/* Check the 8-bit paletted BMP save_output() wrote for the test pattern */
+static void check_gray_bmp(const char *path, int width, int height)
+{
+  FILE *f = fopen(path, "rb");
+  bmp_header header;
+  unsigned char palette[4], px;
+  size_t stride = (width + 3) & ~3;
+
+  CHECK(f != NULL);
+  if (f == NULL)
+    return;
+
+  CHECK(bmp_header_read(&header, f) == BMP_OK);
+  CHECK(header.biWidth == width && header.biHeight == height);
+  CHECK(header.biBitCount == 8 && header.biClrUsed == 256);
+  CHECK(header.bfOffBits == 54 + 256 * 4);
+  CHECK(header.bfSize == header.bfOffBits + stride * height);
+
+  /* Palette entry 200 is gray 200 */
+  fseek(f, 54 + 200 * 4, SEEK_SET);
+  CHECK(fread(palette, 4, 1, f) == 1);
+  CHECK(palette[0] == 200 && palette[1] == 200 && palette[2] == 200);
+
+  /* Every pixel is the gray value of the pattern, rows stored bottom-up */
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      uint8_t rgb[3] = { x * 16, y * 32, (x + y) * 8 }, gray;
+
+      gray_rgb24_to_y8(rgb, &gray, 1);
+      fseek(f, header.bfOffBits + (height - 1 - y) * stride + x, SEEK_SET);
+      CHECK(fread(&px, 1, 1, f) == 1 && px == gray);
+    }
+
+  fclose(f);
+}
+
+/*
+ * Upload src to dst the way the FUSE write path streams it: the headers
+ * first, then a few rows at a time, telling the daemon after each write.
+ * Stops after stop_rows rows.
+ */
+static void stream_upload(int sock, const char *src, const char *dst,
+                          uint32_t stop_rows, int sync_sock,
+                          const char *sync_path)
+{
+  uint8_t file[4096];
+  FILE *f = fopen(src, "rb");
+  size_t size = fread(file, 1, sizeof(file), f);
+  fclose(f);
+
+  /* 13 x 7 test pattern: 54 header bytes, then rows of 40 bytes */
+  const size_t off_bits = 54, row = 40;
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int img_fd;
+
+  CHECK(out >= 0 && size == off_bits + 7 * row);
+  CHECK(write(out, file, off_bits) == (ssize_t)off_bits);
+  img_fd = open(dst, O_RDONLY);
+  CHECK(vt_client_stream_begin(sock, img_fd) == 0);
+  close(img_fd);
+
+  for (uint32_t rows = 0; rows < stop_rows;) {
+    uint32_t n = stop_rows - rows < 2 ? stop_rows - rows : 2;
+    CHECK(write(out, file + off_bits + rows * row, n * row) ==
+          (ssize_t)(n * row));
+    rows += n;
+    CHECK(vt_client_stream_rows(sock, rows) == 0);
+
+    /* A whole-frame job between bands does not disturb the stream */
+    if (rows == 2 && sync_sock >= 0) {
+      vt_job_rep_t rep;
+      signed_res_t res;
+      CHECK(vt_client_submit_path(sync_sock, sync_path, &rep, &res,
+                                  sizeof(res)) == 0);
+      CHECK(rep.status == TEEC_SUCCESS);
+    }
+  }
+  close(out);
+}
+
+/* A job submitted from its own thread, so several wait on the daemon */
+struct submit_args {
+  int sock;
+  const char *path;
+  int ret;
+  vt_job_rep_t rep;
+  batch_proof_t proof;
+};
+
+static void *submit_thread(void *arg)
+{
+  struct submit_args *a = arg;
+  int img_fd = open(a->path, O_RDONLY);
+
+  a->ret = vt_client_submit_fd(a->sock, img_fd, &a->rep, &a->proof,
+                               sizeof(a->proof));
+  close(img_fd);
+  return NULL;
+}
+
+/* Submit paths[i] on socks[i] at once and wait for all the replies */
+static void submit_all(int *socks, const char **paths, int n,
+                       struct submit_args *args)
+{
+  pthread_t threads[4];
+
+  for (int i = 0; i < n; i++) {
+    args[i].sock = socks[i];
+    args[i].path = paths[i];
+    pthread_create(&threads[i], NULL, submit_thread, &args[i]);
+  }
+  for (int i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+}
+
+/* Connect and wait until the daemon has taken the connection */
+static int connect_synced(const char *sock_path)
+{
+  uint8_t unknown[DIGEST_SIZE] = { 0 }, out[1];
+  vt_job_rep_t rep;
+  uint32_t out_size;
+  int sock = vt_client_connect(sock_path);
+
+  CHECK(sock >= 0);
+  CHECK(vt_client_load(sock, unknown, &rep, out, sizeof(out), &out_size) == 0);
+  return sock;
+}
+
+/* Rebuild the root from an inclusion proof and check the stub signed it */
+static int proof_verifies(const batch_proof_t *proof, uint32_t size)
+{
+  uint8_t node[DIGEST_SIZE];
+  uint32_t depth = 0;
+
+  teec_stub_merkle_hash(TA_MERKLE_LEAF, proof->res.digest, NULL, node);
+  for (uint32_t m = proof->count, i = proof->index; m > 1;
+       m = (m + 1) / 2, i /= 2) {
+    if ((i ^ 1) >= m)
+      continue;
+    if (i & 1)
+      teec_stub_merkle_hash(TA_MERKLE_NODE, proof->path[depth], node, node);
+    else
+      teec_stub_merkle_hash(TA_MERKLE_NODE, node, proof->path[depth], node);
+    depth++;
+  }
+
+  if (size != offsetof(batch_proof_t, path) + depth * DIGEST_SIZE)
+    return 0;
+  for (int i = 0; i < DIGEST_SIZE; i++)
+    if ((node[i] ^ 0xa5) != proof->res.signature[i])
+      return 0;
+  return 1;
+}
+
+/* Jobs from several clients run as one batch under one signature */
+static void test_batch(const char *dir)
+{
+  char paths[3][64], bad_path[64], sock_path[64];
+  const int sizes[3][2] = { { 13, 7 }, { 8, 5 }, { 16, 3 } };
+  struct submit_args args[3];
+  struct tee_ctx tee;
+  struct daemon_args daemon;
+  pthread_t thread;
+  int stop[2], socks[3];
+  const char *submit[3];
+
+  for (int i = 0; i < 3; i++) {
+    snprintf(paths[i], sizeof(paths[i]), "%s/batch%d.bmp", dir, i);
+    write_test_bmp(paths[i], sizes[i][0], sizes[i][1]);
+  }
+  snprintf(bad_path, sizeof(bad_path), "%s/not_a.bmp", dir);
+  FILE *f = fopen(bad_path, "w");
+  fputs("not a bitmap", f);
+  fclose(f);
+  snprintf(sock_path, sizeof(sock_path), "%s/batch.sock", dir);
+
+  prepare_tee_session(&tee);
+  tee.batch_max = 4;
+  tee.batch_wait_ms = 200;
+
+  daemon.tee = &tee;
+  daemon.listen_fd = vt_daemon_listen(sock_path);
+  CHECK(daemon.listen_fd >= 0);
+  CHECK(pipe(stop) == 0);
+  daemon.stop_fd = stop[0];
+  pthread_create(&thread, NULL, daemon_thread, &daemon);
+
+  for (int i = 0; i < 3; i++)
+    socks[i] = connect_synced(sock_path);
+
+  /* Three clients waiting: one invocation for all of them */
+  unsigned int invocations = teec_stub_invocations;
+  for (int i = 0; i < 3; i++)
+    submit[i] = paths[i];
+  submit_all(socks, submit, 3, args);
+  CHECK(teec_stub_invocations == invocations + 1);
+
+  for (int i = 0; i < 3; i++) {
+    CHECK(args[i].ret == 0 && args[i].rep.status == TEEC_SUCCESS);
+    CHECK(args[i].rep.res_size > sizeof(signed_res_t));
+    CHECK(args[i].proof.count == 3 && args[i].proof.index < 3);
+    CHECK(proof_verifies(&args[i].proof, args[i].rep.res_size));
+  }
+  /* Every frame signed the same root */
+  CHECK(memcmp(args[0].proof.res.signature, args[1].proof.res.signature,
+               SIGNATURE_SIZE) == 0);
+
+  /* A frame of the batch loads from secure storage like any other */
+  uint8_t out[13 * 7];
+  uint32_t out_size;
+  vt_job_rep_t rep;
+  CHECK(vt_client_load(socks[0], args[0].proof.res.digest, &rep, out,
+                       sizeof(out), &out_size) == 0);
+  CHECK(rep.status == TEEC_SUCCESS && out_size == 13 * 7);
+
+  /* With a client idle the batch waits for it, then runs what it has; a
+   * lone frame is processed and signed on its own */
+  unsigned long long t_start = gettime();
+  submit_all(socks, submit, 1, args);
+  CHECK(gettime() - t_start >= 1000ULL * tee.batch_wait_ms);
+  CHECK(args[0].ret == 0 && args[0].rep.status == TEEC_SUCCESS);
+  CHECK(args[0].rep.res_size == sizeof(signed_res_t));
+
+  /* A frame the batch cannot take sends the batch down the single path */
+  submit[1] = bad_path;
+  invocations = teec_stub_invocations;
+  submit_all(socks, submit, 3, args);
+  CHECK(teec_stub_invocations == invocations + 2);
+  CHECK(args[0].rep.status == TEEC_SUCCESS &&
+        args[0].rep.res_size == sizeof(signed_res_t));
+  CHECK(args[1].rep.status != TEEC_SUCCESS && args[1].rep.res_size == 0);
+  CHECK(args[2].rep.status == TEEC_SUCCESS);
+
+  for (int i = 0; i < 3; i++)
+    close(socks[i]);
+  CHECK(write(stop[1], "", 1) == 1);
+  pthread_join(thread, NULL);
+  close(daemon.listen_fd);
+  close(stop[0]);
+  close(stop[1]);
+  terminate_tee_session(&tee);
+
+  unlink(sock_path);
+  unlink(bad_path);
+  for (int i = 0; i < 3; i++)
+    unlink(paths[i]);
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/video_tee_test_XXXXXX";
+  char img_path[64], sock_path[64], gray_path[64], stream_path[64];
+  struct tee_ctx tee;
+  struct daemon_args args;
+  pthread_t thread;
+  int stop[2];
+  vt_job_rep_t rep;
+  signed_res_t by_path, by_fd;
+  int sock, img_fd;
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  snprintf(img_path, sizeof(img_path), "%s/frame.bmp", dir);
+  snprintf(sock_path, sizeof(sock_path), "%s/video_tee.sock", dir);
+  snprintf(gray_path, sizeof(gray_path), "%s/gray.bmp", dir);
+  snprintf(stream_path, sizeof(stream_path), "%s/stream.bmp", dir);
+  write_test_bmp(img_path, 13, 7);
+
+  prepare_tee_session(&tee);
+
+  args.tee = &tee;
+  args.listen_fd = vt_daemon_listen(sock_path);
+  CHECK(args.listen_fd >= 0);
+  CHECK(pipe(stop) == 0);
+  args.stop_fd = stop[0];
+  pthread_create(&thread, NULL, daemon_thread, &args);
+
+  sock = vt_client_connect(sock_path);
+  CHECK(sock >= 0);
+
+  /* Job by path */
+  CHECK(vt_client_submit_path(sock, img_path, &rep, &by_path,
+                              sizeof(by_path)) == 0);
+  CHECK(rep.status == TEEC_SUCCESS);
+  CHECK(rep.res_size == sizeof(signed_res_t));
+
+  /* Job by fd gives the same attestation for the same image */
+  img_fd = open(img_path, O_RDONLY);
+  CHECK(img_fd >= 0);
+  CHECK(vt_client_submit_fd(sock, img_fd, &rep, &by_fd, sizeof(by_fd)) == 0);
+  close(img_fd);
+  CHECK(rep.status == TEEC_SUCCESS);
+  CHECK(memcmp(by_path.digest, by_fd.digest, DIGEST_SIZE) == 0);
+
+  /* A bad job fails without taking the connection down */
+  CHECK(vt_client_submit_path(sock, "/nonexistent.bmp", &rep, &by_fd,
+                              sizeof(by_fd)) == 0);
+  CHECK(rep.status != TEEC_SUCCESS);
+  CHECK(rep.res_size == 0);
+  CHECK(vt_client_submit_path(sock, img_path, &rep, &by_fd,
+                              sizeof(by_fd)) == 0);
+  CHECK(rep.status == TEEC_SUCCESS);
+
+  /* The processed image comes back from secure storage by its digest */
+  uint8_t out[13 * 7];
+  uint32_t out_size;
+  CHECK(vt_client_load(sock, by_path.digest, &rep, out, sizeof(out),
+                       &out_size) == 0);
+  CHECK(rep.status == TEEC_SUCCESS && rep.res_size == 0);
+  CHECK(out_size == sizeof(out));
+  CHECK(bmp_write_file(gray_path, out, 13, 7, BMP_WRITE_Y8) == 0);
+  check_gray_bmp(gray_path, 13, 7);
+
+  uint8_t unknown[DIGEST_SIZE] = { 0 };
+  CHECK(vt_client_load(sock, unknown, &rep, out, sizeof(out),
+                       &out_size) == 0);
+  CHECK(rep.status == TEEC_ERROR_ITEM_NOT_FOUND && out_size == 0);
+
+  /* A frame streamed in while it is written gets the same attestation */
+  signed_res_t by_stream;
+  int other = vt_client_connect(sock_path);
+  CHECK(other >= 0);
+  stream_upload(sock, img_path, stream_path, 7, sock, img_path);
+
+  /* Only one stream at a time; the refused one ends with an error and the
+   * client resubmits the frame as a job */
+  img_fd = open(img_path, O_RDONLY);
+  CHECK(vt_client_stream_begin(other, img_fd) == 0);
+  CHECK(vt_client_stream_end(other, &rep, &by_stream, sizeof(by_stream)) == 0);
+  CHECK(rep.status != TEEC_SUCCESS && rep.res_size == 0);
+  CHECK(vt_client_submit_fd(other, img_fd, &rep, &by_fd, sizeof(by_fd)) == 0);
+  CHECK(rep.status == TEEC_SUCCESS);
+  close(img_fd);
+
+  CHECK(vt_client_stream_end(sock, &rep, &by_stream, sizeof(by_stream)) == 0);
+  CHECK(rep.status == TEEC_SUCCESS);
+  CHECK(rep.res_size == sizeof(signed_res_t));
+  CHECK(memcmp(by_path.digest, by_stream.digest, DIGEST_SIZE) == 0);
+
+  /* A stream closed before every row arrived is not signed */
+  stream_upload(other, img_path, stream_path, 5, -1, NULL);
+  CHECK(vt_client_stream_end(other, &rep, &by_stream, sizeof(by_stream)) == 0);
+  CHECK(rep.status != TEEC_SUCCESS);
+  close(other);
+
+  close(sock);
+
+  /* The public key is a separate query, not part of every result */
+  pub_key_t pub_key;
+  CHECK(get_pub_key(&tee, &pub_key) == TEEC_SUCCESS);
+  CHECK(pub_key.pub_key_x_size == ECDSA_KEY_SIZE_BYTES);
+  CHECK(pub_key.pub_key_y_size == ECDSA_KEY_SIZE_BYTES);
+
+  /* Stop the daemon */
+  CHECK(write(stop[1], "", 1) == 1);
+  pthread_join(thread, NULL);
+  close(args.listen_fd);
+
+  /* Output defaults to single-channel gray, saved as a paletted BMP */
+  CHECK(tee.out_format == IMG_FMT_Y8);
+  CHECK(tee.frame.width == 13 && tee.frame.height == 7);
+  CHECK(save_output(&tee, gray_path) == 0);
+  check_gray_bmp(gray_path, 13, 7);
+
+  terminate_tee_session(&tee);
+
+  /* The session was set up once for all jobs */
+  CHECK(teec_stub_contexts == 1);
+  CHECK(teec_stub_sessions == 1);
+  /* 6 jobs, 2 loads; BEGIN, ROWS per band and END for each stream */
+  CHECK(teec_stub_invocations == 6 + 2 + (1 + 4 + 1) + (1 + 3 + 1));
+
+  /* Same-sized frames reuse the input, output and result buffers */
+  CHECK(teec_stub_shm_allocs == 3);
+
+  test_batch(dir);
+
+  unlink(sock_path);
+  unlink(img_path);
+  unlink(gray_path);
+  unlink(stream_path);
+  rmdir(dir);
+
+  if (failures) {
+    fprintf(stderr, "test_daemon: %d check(s) failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("test_daemon: OK\n");
+  return EXIT_SUCCESS;
+}
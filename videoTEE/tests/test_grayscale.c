@@ -0,0 +1,132 @@
+/*
+ * Checks the fixed-point grayscale kernel against the floating-point
+ * formula the TA used before.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grayscale.h"
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+  do {                                                                      \
+    if (!(cond)) {                                                          \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+              #cond);                                                       \
+      failures++;                                                           \
+    }                                                                       \
+  } while (0)
+
+/* The original scalar ImageToGrayscale() formula */
+static uint8_t ref_gray(const uint8_t *px)
+{
+  return px[0] * 0.3 + px[1] * 0.59 + px[2] * 0.11;
+}
+
+/* Largest distance of any pixel in gray from ref_gray() */
+static int max_error(const uint8_t *rgb, const uint8_t *gray, size_t pixels)
+{
+  int worst = 0;
+
+  for (size_t i = 0; i < pixels; i++) {
+    int d = abs((int)gray[i] - (int)ref_gray(rgb + 3 * i));
+    if (d > worst)
+      worst = d;
+  }
+  return worst;
+}
+
+/* Run both kernels out of place and in place over pixels of rgb */
+static void check_image(const uint8_t *rgb, size_t pixels)
+{
+  size_t size = 3 * pixels;
+  uint8_t *y8 = malloc(pixels + 1);
+  uint8_t *out = malloc(size + 1);
+  uint8_t *inplace = malloc(size + 1);
+  size_t mismatches = 0;
+
+  /* Canary past the end catches overlong vector stores */
+  y8[pixels] = 0x5a;
+  out[size] = 0x5a;
+
+  gray_rgb24_to_y8(rgb, y8, pixels);
+  CHECK(max_error(rgb, y8, pixels) <= 1);
+  CHECK(y8[pixels] == 0x5a);
+
+  gray_rgb24_to_rgb24(rgb, out, pixels);
+  CHECK(out[size] == 0x5a);
+  for (size_t i = 0; i < pixels; i++) {
+    if (out[3 * i] != y8[i] || out[3 * i + 1] != y8[i] ||
+        out[3 * i + 2] != y8[i])
+      mismatches++;
+  }
+  CHECK(mismatches == 0);
+
+  memcpy(inplace, rgb, size);
+  gray_rgb24_to_rgb24(inplace, inplace, pixels);
+  CHECK(pixels == 0 || memcmp(inplace, out, size) == 0);
+
+  memcpy(inplace, rgb, size);
+  gray_rgb24_to_y8(inplace, inplace, pixels);
+  CHECK(pixels == 0 || memcmp(inplace, y8, pixels) == 0);
+
+  /* Blue-first input gives the same result */
+  for (size_t i = 0; i < pixels; i++) {
+    inplace[3 * i] = rgb[3 * i + 2];
+    inplace[3 * i + 1] = rgb[3 * i + 1];
+    inplace[3 * i + 2] = rgb[3 * i];
+  }
+  gray_bgr24_to_rgb24(inplace, out, pixels);
+  gray_bgr24_to_y8(inplace, inplace, pixels);
+  CHECK(pixels == 0 || memcmp(inplace, y8, pixels) == 0);
+  mismatches = 0;
+  for (size_t i = 0; i < pixels; i++) {
+    if (out[3 * i] != y8[i] || out[3 * i + 1] != y8[i] ||
+        out[3 * i + 2] != y8[i])
+      mismatches++;
+  }
+  CHECK(mismatches == 0);
+
+  free(y8);
+  free(out);
+  free(inplace);
+}
+
+int main(void)
+{
+  /* Every channel combination on a grid that includes 0 and 255 */
+  size_t steps = 52, pixels = steps * steps * steps;
+  uint8_t *rgb = malloc(3 * pixels);
+  uint8_t *p = rgb;
+
+  for (size_t r = 0; r < steps; r++)
+    for (size_t g = 0; g < steps; g++)
+      for (size_t b = 0; b < steps; b++) {
+        *p++ = r * 5;
+        *p++ = g * 5;
+        *p++ = b * 5;
+      }
+  check_image(rgb, pixels);
+
+  /* Random data at every length around the vector block size */
+  srand(1);
+  for (size_t i = 0; i < 3 * pixels; i++)
+    rgb[i] = rand() & 0xff;
+  for (size_t n = 0; n <= 4 * GRAY_BLOCK + 1; n++)
+    check_image(rgb, n);
+  check_image(rgb + 3, 1000);
+  check_image(rgb, pixels);
+
+  free(rgb);
+
+  if (failures) {
+    fprintf(stderr, "test_grayscale: %d check(s) failed\n", failures);
+    return EXIT_FAILURE;
+  }
+
+  printf("test_grayscale: OK\n");
+  return EXIT_SUCCESS;
+}